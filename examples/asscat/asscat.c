@@ -22,6 +22,12 @@ int main(int argc, char **argv)
 			} else if(strcmp(argv[i], "-archive") == 0) {
 				ass_add_archive(prefix, argv[++i]);
 
+			} else if(strcmp(argv[i], "-pack") == 0) {
+				ass_add_pack(prefix, argv[++i]);
+
+			} else if(strcmp(argv[i], "-patch") == 0) {
+				ass_add_patch(prefix, argv[++i]);
+
 			} else if(strcmp(argv[i], "-url") == 0) {
 				ass_add_url(prefix, argv[++i]);
 
@@ -57,6 +63,8 @@ void print_usage(const char *argv0)
 	printf(" -prefix <prefix>   sets the path prefix to match for subsequent asset sources\n");
 	printf(" -path <path>       filesystem asset source\n");
 	printf(" -archive <archive> archive asset source\n");
+	printf(" -pack <pack>       pack file asset source (see asspack)\n");
+	printf(" -patch <archive>   patch over the last archive or pack with the same prefix\n");
 	printf(" -url <url>         url asset source\n");
 	printf(" -h,-help           print usage and exit\n");
 	printf("\nExamples:\n");
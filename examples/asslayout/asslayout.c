@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "assfile.h"
+#include "tar.h"
+
+/* the hot prefix size goes in a pax global header, see tar.c */
+#define PAX_HOT_KEY		"ASSFILE.hot"
+
+#define BLKSZ(x)	((((x) + 511) / 512) * 512)
+
+/* POSIX ustar header */
+struct header {
+	char name[100];
+	char mode[8];
+	char uid[8], gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32], gname[32];
+	char devmajor[8], devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+static int load_order(const char *fname);
+static int cmp_layout(const void *a, const void *b);
+static int write_tar(const char *fname, const char *infile);
+static int write_header(gzFile out, const char *path, unsigned long size, int type);
+static int write_entry(gzFile out, struct tar_entry *ent);
+static int write_pad(gzFile out, unsigned long size);
+void print_usage(const char *argv0);
+
+static struct tar tar;
+static int *rank;	/* first access of each entry in the trace, or -1 */
+static const char *order_prefix;
+static long mtime;
+
+int main(int argc, char **argv)
+{
+	int i;
+	const char *infile = 0, *outfile = 0, *order_file = 0;
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-') {
+			if(strcmp(argv[i], "-o") == 0) {
+				if(!argv[++i]) goto missing_arg;
+				outfile = argv[i];
+
+			} else if(strcmp(argv[i], "-order") == 0) {
+				if(!argv[++i]) goto missing_arg;
+				order_file = argv[i];
+
+			} else if(strcmp(argv[i], "-prefix") == 0) {
+				if(!argv[++i]) goto missing_arg;
+				order_prefix = argv[i];
+
+			} else if(strcmp(argv[i], "-help") == 0 || strcmp(argv[i], "-h") == 0) {
+				print_usage(argv[0]);
+				return 0;
+
+			} else {
+				fprintf(stderr, "invalid option: %s\n", argv[i]);
+				return 1;
+			}
+
+		} else {
+			if(infile) {
+				fprintf(stderr, "unexpected argument: %s\n", argv[i]);
+				return 1;
+			}
+			infile = argv[i];
+		}
+	}
+
+	if(!infile || !outfile || !order_file) {
+		print_usage(argv[0]);
+		return 1;
+	}
+	if(strcmp(infile, outfile) == 0) {
+		fprintf(stderr, "the output can't overwrite the input archive\n");
+		return 1;
+	}
+
+	/* the file list comes from the archive, the data through a mount of it */
+	if(ass_add_archive(0, infile) == -1 || load_tar(&tar, infile) == -1) {
+		return 1;
+	}
+	if(!(rank = malloc(tar.num_files * sizeof *rank))) {
+		perror("failed to allocate memory");
+		return 1;
+	}
+	for(i=0; i<tar.num_files; i++) {
+		rank[i] = -1;
+	}
+	if(load_order(order_file) == -1) {
+		return 1;
+	}
+	return write_tar(outfile, infile) == -1 ? 1 : 0;
+
+missing_arg:
+	fprintf(stderr, "%s must be followed by an argument\n", argv[i - 1]);
+	return 1;
+}
+
+void print_usage(const char *argv0)
+{
+	printf("Usage: %s -order <trace> -o <output> [options] <archive>\n", argv0);
+	printf("Options:\n");
+	printf(" -o <output>        output tarball, gzip-compressed if its name ends in .gz\n");
+	printf(" -order <trace>     access trace recorded with ass_trace or ASSFILE_TRACE\n");
+	printf(" -prefix <prefix>   mount prefix used when the trace was recorded, stripped from its paths\n");
+	printf(" -h,-help           print usage and exit\n");
+	printf("\nRewrites a tarball (plain or gzip-compressed) or zip file, as a tarball with\n");
+	printf("the files in the trace first, in the order they were opened, followed by the\n");
+	printf("rest in their original order. ass_add_archive asks the OS to read in the\n");
+	printf("part with the traced files when it mounts the result. Example:\n");
+	printf("  ASSFILE_TRACE=level1.trace ./game\n");
+	printf("  %s -order level1.trace -prefix data -o data-new.tar data.tar\n", argv0);
+}
+
+/* ranks the entries by their first access in the trace, and returns how many
+ * of them it has. Paths in the trace which aren't in the archive are skipped:
+ * they're from other mounts, or the filesystem.
+ */
+static int load_order(const char *fname)
+{
+	FILE *fp;
+	char buf[1024], *name, *end;
+	int len, count = 0, plen = order_prefix ? strlen(order_prefix) : 0;
+	struct tar_entry *ent;
+
+	if(!(fp = fopen(fname, "r"))) {
+		fprintf(stderr, "failed to open trace %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	while(fgets(buf, sizeof buf, fp)) {
+		len = strlen(buf);
+		end = buf + len;
+		while(end > buf && isspace((unsigned char)end[-1])) *--end = 0;
+
+		/* same prefix matching as ass_fopen */
+		if(plen && memcmp(buf, order_prefix, plen) != 0) {
+			continue;
+		}
+		name = buf + plen;
+		while(*name == '/' || *name == '\\') name++;
+
+		if((ent = find_tar_entry(&tar, name)) && rank[ent - tar.files] < 0) {
+			rank[ent - tar.files] = count++;
+		}
+	}
+	fclose(fp);
+
+	if(!count) {
+		fprintf(stderr, "warning: none of the files in %s are in the archive%s\n", fname,
+				order_prefix ? "" : ", try -prefix");
+	}
+	return count;
+}
+
+static int cmp_layout(const void *a, const void *b)
+{
+	int ia = *(int*)a;
+	int ib = *(int*)b;
+
+	if(rank[ia] != rank[ib]) {
+		if(rank[ia] < 0) return 1;
+		if(rank[ib] < 0) return -1;
+		return rank[ia] - rank[ib];
+	}
+	return ia - ib;
+}
+
+static int write_tar(const char *fname, const char *infile)
+{
+	int i, n, len, res = -1, num_hot = 0, *order;
+	gzFile out;
+	struct stat st;
+	char rec[64], num[16];
+	unsigned long hot = 0;
+
+	if(!(order = malloc(tar.num_files * sizeof *order))) {
+		perror("failed to allocate memory");
+		return -1;
+	}
+	for(i=0; i<tar.num_files; i++) {
+		order[i] = i;
+	}
+	qsort(order, tar.num_files, sizeof *order, cmp_layout);
+
+	/* all of the layout is known in advance: the pax header, then a header
+	 * and the data for each file, in blocks of 512 bytes
+	 */
+	hot = 1024;
+	for(i=0; i<tar.num_files && rank[order[i]] >= 0; i++) {
+		hot += 512 + BLKSZ(tar.files[order[i]].size);
+		num_hot++;
+	}
+
+	if(stat(infile, &st) == 0) {
+		mtime = st.st_mtime;
+	} else {
+		mtime = time(0);
+	}
+
+	len = strlen(fname);
+	if(!(out = gzopen(fname, len > 3 && strcmp(fname + len - 3, ".gz") == 0 ? "wb" : "wbT"))) {
+		fprintf(stderr, "failed to open %s for writing: %s\n", fname, strerror(errno));
+		goto end;
+	}
+
+	/* pax records include their own length: "<len> <key>=<value>\n" */
+	if(!num_hot) hot = 0;
+	len = sprintf(rec, " " PAX_HOT_KEY "=%lu\n", hot);
+	for(n=len + 1; sprintf(num, "%d", n) + len != n; n++);
+	len = sprintf(rec, "%d " PAX_HOT_KEY "=%lu\n", n, hot);
+	if(write_header(out, "pax_global_header", len, 'g') == -1 ||
+			gzwrite(out, rec, len) < len || write_pad(out, BLKSZ(len) - len) == -1) {
+		goto err;
+	}
+
+	for(i=0; i<tar.num_files; i++) {
+		if(write_entry(out, tar.files + order[i]) == -1) {
+			goto err;
+		}
+	}
+	/* end of archive: two zero blocks */
+	if(write_pad(out, 1024) == -1) {
+		goto err;
+	}
+	if(gzclose(out) != Z_OK) {
+		fprintf(stderr, "failed to write %s\n", fname);
+		remove(fname);
+		goto end;
+	}
+
+	printf("%s: %d files, %d from the trace first, %lu bytes read in at mount time\n", fname,
+			tar.num_files, num_hot, hot);
+	res = 0;
+	goto end;
+
+err:
+	gzclose(out);
+	remove(fname);
+end:
+	free(order);
+	return res;
+}
+
+static int write_header(gzFile out, const char *path, unsigned long size, int type)
+{
+	struct header hdr;
+	int i, len = strlen(path), split;
+	unsigned int sum = 0;
+	unsigned char *ptr;
+
+	memset(&hdr, 0, sizeof hdr);
+	if(len <= (int)sizeof hdr.name) {
+		memcpy(hdr.name, path, len);
+	} else {
+		/* longer paths are split at a slash, into prefix and name */
+		for(split = len - sizeof hdr.name - 1; split < len && path[split] != '/'; split++);
+		if(split >= len || split > (int)sizeof hdr.prefix) {
+			fprintf(stderr, "%s: path too long for a tar header\n", path);
+			return -1;
+		}
+		memcpy(hdr.prefix, path, split);
+		memcpy(hdr.name, path + split + 1, len - split - 1);
+	}
+	if(size > 077777777777ul) {
+		fprintf(stderr, "%s: too large for a tar header\n", path);
+		return -1;
+	}
+	sprintf(hdr.mode, "%07o", 0644);
+	sprintf(hdr.uid, "%07o", 0);
+	sprintf(hdr.gid, "%07o", 0);
+	sprintf(hdr.size, "%011lo", size);
+	sprintf(hdr.mtime, "%011lo", (unsigned long)mtime);
+	hdr.typeflag = type;
+	memcpy(hdr.magic, "ustar", 6);
+	memcpy(hdr.version, "00", 2);
+
+	/* the checksum is computed with the checksum field set to spaces */
+	memset(hdr.chksum, ' ', sizeof hdr.chksum);
+	ptr = (unsigned char*)&hdr;
+	for(i=0; i<(int)sizeof hdr; i++) {
+		sum += ptr[i];
+	}
+	sprintf(hdr.chksum, "%06o", sum);
+
+	return gzwrite(out, &hdr, sizeof hdr) < (int)sizeof hdr ? -1 : 0;
+}
+
+static int write_entry(gzFile out, struct tar_entry *ent)
+{
+	ass_file *in;
+	static char buf[65536];
+	size_t sz;
+	unsigned long total = 0;
+
+	if(write_header(out, ent->path, ent->size, '0') == -1) {
+		return -1;
+	}
+	if(!(in = ass_fopen(ent->path, "rb"))) {
+		fprintf(stderr, "failed to read %s from the archive\n", ent->path);
+		return -1;
+	}
+	while((sz = ass_fread(buf, 1, sizeof buf, in)) > 0) {
+		if(gzwrite(out, buf, sz) < (int)sz) {
+			ass_fclose(in);
+			return -1;
+		}
+		total += sz;
+	}
+	ass_fclose(in);
+
+	if(total != ent->size) {
+		fprintf(stderr, "%s: read %lu bytes out of %lu\n", ent->path, total, ent->size);
+		return -1;
+	}
+	return write_pad(out, BLKSZ(ent->size) - ent->size);
+}
+
+static int write_pad(gzFile out, unsigned long size)
+{
+	static const char zeros[1024];
+	int sz;
+
+	while(size > 0) {
+		sz = size > sizeof zeros ? sizeof zeros : size;
+		if(gzwrite(out, zeros, sz) < sz) {
+			return -1;
+		}
+		size -= sz;
+	}
+	return 0;
+}
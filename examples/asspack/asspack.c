@@ -0,0 +1,767 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "pack.h"
+#include "hash.h"
+#include "lz4.h"
+
+struct file {
+	char *path;			/* path in the filesystem */
+	const char *name;	/* path in the pack, relative to the -C directory */
+	uint64_t size;
+	uint64_t chash;		/* hash of the contents, for deduplication */
+	int dup_of;			/* index of an earlier file with the same contents, or -1 */
+	int rank;			/* position of its first access in the -order trace, or -1 */
+};
+
+static int add_path(const char *path);
+static int add_file(const char *path, uint64_t size);
+static char *join_path(const char *dir, const char *name);
+static int build_pack(const char *fname);
+static int list_pack(const char *fname);
+static int cmp_files(const void *a, const void *b);
+static int write_data(FILE *fp, const char *path, uint64_t size);
+static int write_encoded(FILE *fp, struct file *file, struct pack_entry *ent);
+static int write_pad(FILE *fp, uint64_t size);
+static int find_duplicates(void);
+static int cmp_contents(const void *a, const void *b);
+static int hash_file(struct file *file);
+static int same_contents(struct file *a, struct file *b);
+static int load_order(const char *fname);
+static int cmp_name_key(const void *key, const void *f);
+static int cmp_layout(const void *a, const void *b);
+void print_usage(const char *argv0);
+
+static struct file *files;
+static int num_files, max_files;
+static unsigned int align = PACK_DEF_ALIGN;
+static unsigned int block_size = PACK_DEF_BLOCK_SIZE;
+static int encoding = PACK_ENC_NONE;
+static const char *basedir;
+static int dedup = 1;
+static const char *order_file, *order_prefix;
+
+int main(int argc, char **argv)
+{
+	int i;
+	char *path;
+	const char *outfile = "out.pack";
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-') {
+			if(strcmp(argv[i], "-o") == 0) {
+				if(!argv[++i]) goto missing_arg;
+				outfile = argv[i];
+
+			} else if(strcmp(argv[i], "-align") == 0) {
+				if(!argv[++i]) goto missing_arg;
+				align = atoi(argv[i]);
+				if(align < 8 || (align & (align - 1))) {
+					fprintf(stderr, "alignment must be a power of two, at least 8\n");
+					return 1;
+				}
+
+			} else if(strcmp(argv[i], "-z") == 0) {
+				if(!argv[++i]) goto missing_arg;
+				if(strcmp(argv[i], "none") == 0) {
+					encoding = PACK_ENC_NONE;
+				} else if(strcmp(argv[i], "lz4") == 0) {
+					encoding = PACK_ENC_LZ4;
+				} else if(strcmp(argv[i], "deflate") == 0) {
+					encoding = PACK_ENC_DEFLATE;
+				} else {
+					fprintf(stderr, "unknown compression method: %s\n", argv[i]);
+					return 1;
+				}
+
+			} else if(strcmp(argv[i], "-bs") == 0) {
+				if(!argv[++i]) goto missing_arg;
+				block_size = atoi(argv[i]);
+				if(block_size < 256 || block_size > PACK_MAX_BLOCK_SIZE) {
+					fprintf(stderr, "block size must be between 256 and %d\n", PACK_MAX_BLOCK_SIZE);
+					return 1;
+				}
+
+			} else if(strcmp(argv[i], "-C") == 0) {
+				if(!argv[++i]) goto missing_arg;
+				basedir = argv[i];
+
+			} else if(strcmp(argv[i], "-nodedup") == 0) {
+				dedup = 0;
+
+			} else if(strcmp(argv[i], "-order") == 0) {
+				if(!argv[++i]) goto missing_arg;
+				order_file = argv[i];
+
+			} else if(strcmp(argv[i], "-prefix") == 0) {
+				if(!argv[++i]) goto missing_arg;
+				order_prefix = argv[i];
+
+			} else if(strcmp(argv[i], "-l") == 0) {
+				if(!argv[++i]) goto missing_arg;
+				return list_pack(argv[i]) == -1 ? 1 : 0;
+
+			} else if(strcmp(argv[i], "-help") == 0 || strcmp(argv[i], "-h") == 0) {
+				print_usage(argv[0]);
+				return 0;
+
+			} else {
+				fprintf(stderr, "invalid option: %s\n", argv[i]);
+				return 1;
+			}
+
+		} else {
+			if(!(path = join_path(basedir, argv[i])) || add_path(path) == -1) {
+				return 1;
+			}
+			free(path);
+		}
+	}
+
+	if(!num_files) {
+		fprintf(stderr, "no input files\n");
+		return 1;
+	}
+	return build_pack(outfile) == -1 ? 1 : 0;
+
+missing_arg:
+	fprintf(stderr, "%s must be followed by an argument\n", argv[i - 1]);
+	return 1;
+}
+
+void print_usage(const char *argv0)
+{
+	printf("Usage: %s [options] <file/dir 1> <file/dir 2> ... <file/dir n>\n", argv0);
+	printf("Options:\n");
+	printf(" -o <pack>          output pack file (default: out.pack)\n");
+	printf(" -align <n>         alignment of file data in bytes (default: %d)\n", PACK_DEF_ALIGN);
+	printf(" -z <method>        compress files: none, lz4 (fast), or deflate (smaller) (default: none)\n");
+	printf(" -bs <n>            compression block size in bytes (default: %d)\n", PACK_DEF_BLOCK_SIZE);
+	printf(" -C <dir>           subsequent inputs are relative to dir, and so are their paths in the pack\n");
+	printf(" -nodedup           store identical files separately (default: once, shared by all their paths)\n");
+	printf(" -order <trace>     put the files in an access trace (see ass_trace) first, in the order they\n");
+	printf("                    were opened, and have them read in when the pack is mounted\n");
+	printf(" -prefix <prefix>   mount prefix used when the trace was recorded, stripped from its paths\n");
+	printf(" -l <pack>          list the contents of a pack file and exit\n");
+	printf(" -h,-help           print usage and exit\n");
+	printf("\nDirectories are added recursively. Example:\n");
+	printf("  %s -o data.pack -C data .\n", argv0);
+	printf("  asscat -prefix data -pack data.pack data/img/foo.jpg | display -\n");
+}
+
+/* adds a file, or everything under a directory */
+static int add_path(const char *path)
+{
+	struct stat st;
+	DIR *dir;
+	struct dirent *dent;
+	char *sub;
+	int res = 0;
+
+	if(stat(path, &st) == -1) {
+		fprintf(stderr, "failed to stat %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if(!S_ISDIR(st.st_mode)) {
+		return add_file(path, st.st_size);
+	}
+
+	if(!(dir = opendir(path))) {
+		fprintf(stderr, "failed to open directory %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while(res != -1 && (dent = readdir(dir))) {
+		if(strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0) {
+			continue;
+		}
+		if(!(sub = join_path(path, dent->d_name))) {
+			res = -1;
+			break;
+		}
+		res = add_path(sub);
+		free(sub);
+	}
+	closedir(dir);
+	return res;
+}
+
+/* joins a directory and a path in it, leaving out "." components */
+static char *join_path(const char *dir, const char *name)
+{
+	char *res;
+
+	while(name[0] == '.' && name[1] == '/') name += 2;
+	if(strcmp(name, ".") == 0) name = "";
+	if(dir && strcmp(dir, ".") == 0) dir = 0;
+
+	if(!(res = malloc((dir ? strlen(dir) : 0) + strlen(name) + 2))) {
+		perror("failed to allocate path");
+		return 0;
+	}
+	if(!dir || !*dir) {
+		strcpy(res, *name ? name : ".");
+	} else if(!*name) {
+		strcpy(res, dir);
+	} else {
+		sprintf(res, "%s/%s", dir, name);
+	}
+	return res;
+}
+
+static int add_file(const char *path, uint64_t size)
+{
+	struct file *tmp;
+	const char *name = path;
+	int newmax, len;
+
+	/* paths in the pack are relative, like the names passed to ass_fopen */
+	if(basedir && strcmp(basedir, ".") != 0) {
+		len = strlen(basedir);
+		if(memcmp(name, basedir, len) == 0) name += len;
+	}
+	while(*name == '/') name++;
+	if(!*name) {
+		fprintf(stderr, "%s: empty path in the pack\n", path);
+		return -1;
+	}
+
+	if(num_files >= max_files) {
+		newmax = max_files ? max_files * 2 : 64;
+		if(!(tmp = realloc(files, newmax * sizeof *files))) {
+			perror("failed to resize the file list");
+			return -1;
+		}
+		files = tmp;
+		max_files = newmax;
+	}
+	if(!(files[num_files].path = strdup(path))) {
+		perror("failed to allocate path");
+		return -1;
+	}
+	files[num_files].name = files[num_files].path + (name - path);
+	files[num_files].size = size;
+	files[num_files].dup_of = -1;
+	files[num_files].rank = -1;
+	num_files++;
+	return 0;
+}
+
+static int cmp_files(const void *a, const void *b)
+{
+	return strcmp(((struct file*)a)->name, ((struct file*)b)->name);
+}
+
+#define ALIGN(x, a)		(((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+
+static int build_pack(const char *fname)
+{
+	int i, j, n, *order;
+	FILE *fp;
+	struct pack_header hdr;
+	struct pack_entry *dir;
+	uint32_t *htab, idx;
+	uint64_t offs, total_size = 0, dup_size = 0, hot_end = 0;
+	int num_dups = 0, num_hot = 0;
+
+	qsort(files, num_files, sizeof *files, cmp_files);
+	for(i=1; i<num_files; i++) {
+		if(strcmp(files[i].name, files[i - 1].name) == 0) {
+			fprintf(stderr, "%s added more than once\n", files[i].name);
+			return -1;
+		}
+	}
+	if(dedup && find_duplicates() == -1) {
+		return -1;
+	}
+	if(order_file && (num_hot = load_order(order_file)) == -1) {
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, PACK_MAGIC, PACK_MAGIC_LEN);
+	hdr.version = PACK_VERSION;
+	hdr.byte_order = PACK_BYTE_ORDER;
+	hdr.align = align;
+	hdr.block_size = block_size;
+	hdr.num_entries = num_files;
+	/* keep the hash table at most half full */
+	hdr.hash_size = 16;
+	while(hdr.hash_size < num_files * 2) hdr.hash_size <<= 1;
+
+	if(!(dir = calloc(num_files, sizeof *dir)) || !(htab = calloc(hdr.hash_size, sizeof *htab)) ||
+			!(order = malloc(num_files * sizeof *order))) {
+		perror("failed to allocate pack directory");
+		return -1;
+	}
+
+	for(i=0; i<num_files; i++) {
+		dir[i].hash = ass_hash64(files[i].name, strlen(files[i].name), 0);
+		dir[i].size = dir[i].stored_size = files[i].size;
+		dir[i].name_offs = hdr.names_size;
+		dir[i].name_len = strlen(files[i].name);
+		hdr.names_size += dir[i].name_len + 1;
+
+		idx = dir[i].hash & (hdr.hash_size - 1);
+		while(htab[idx]) idx = (idx + 1) & (hdr.hash_size - 1);
+		htab[idx] = i + 1;
+	}
+
+	hdr.dir_offs = sizeof hdr;
+	hdr.hash_offs = hdr.dir_offs + num_files * sizeof *dir;
+	hdr.names_offs = hdr.hash_offs + hdr.hash_size * sizeof *htab;
+	hdr.data_offs = ALIGN(hdr.names_offs + hdr.names_size, align);
+
+	if(!(fp = fopen(fname, "wb"))) {
+		fprintf(stderr, "failed to open %s for writing: %s\n", fname, strerror(errno));
+		return -1;
+	}
+
+	/* the size of everything before the file data is known, but not the
+	 * stored sizes of compressed files, so write the data first
+	 */
+	fseek(fp, hdr.data_offs, SEEK_SET);
+	offs = hdr.data_offs;
+	/* data in the order of the trace, then everything else in path order */
+	for(i=0; i<num_files; i++) {
+		order[i] = i;
+	}
+	if(num_hot) {
+		qsort(order, num_files, sizeof *order, cmp_layout);
+	}
+	for(n=0; n<num_files; n++) {
+		i = order[n];
+		/* identical files share the data, written where the first of them
+		 * in the layout goes
+		 */
+		j = files[i].dup_of >= 0 ? files[i].dup_of : i;
+		if(!dir[j].offset) {
+			/* no padding after the last file */
+			if(n > 0) {
+				write_pad(fp, ALIGN(offs, align) - offs);
+				offs = ALIGN(offs, align);
+			}
+			dir[j].offset = offs;
+			if(encoding != PACK_ENC_NONE && files[j].size > 0) {
+				if(write_encoded(fp, files + j, dir + j) == -1) {
+					goto err;
+				}
+			} else {
+				if(write_data(fp, files[j].path, files[j].size) == -1) {
+					goto err;
+				}
+			}
+			offs += dir[j].stored_size;
+		}
+		if(j != i) {
+			dir[i].offset = dir[j].offset;
+			dir[i].stored_size = dir[j].stored_size;
+			dir[i].flags = dir[j].flags;
+			dup_size += files[i].size;
+			num_dups++;
+		}
+		total_size += files[i].size;
+		if(files[i].rank >= 0) {
+			hot_end = offs;
+		}
+	}
+	hdr.data_size = offs - hdr.data_offs;
+	if(num_hot) {
+		hdr.hot_size = hot_end - hdr.data_offs;
+	}
+
+	rewind(fp);
+	fwrite(&hdr, sizeof hdr, 1, fp);
+	fwrite(dir, sizeof *dir, num_files, fp);
+	fwrite(htab, sizeof *htab, hdr.hash_size, fp);
+	for(i=0; i<num_files; i++) {
+		fwrite(files[i].name, 1, dir[i].name_len + 1, fp);
+	}
+	write_pad(fp, hdr.data_offs - (hdr.names_offs + hdr.names_size));
+
+	i = ferror(fp);
+	if(fclose(fp) != 0 || i) {
+		fprintf(stderr, "failed to write %s: %s\n", fname, strerror(errno));
+		remove(fname);
+		return -1;
+	}
+
+	printf("%s: %d files, %llu bytes of data, %llu stored\n", fname, num_files,
+			(unsigned long long)total_size, (unsigned long long)hdr.data_size);
+	if(num_dups) {
+		printf("  %d duplicates (%llu bytes) share the data of identical files\n", num_dups,
+				(unsigned long long)dup_size);
+	}
+	if(num_hot) {
+		printf("  %d files from the access trace first, %llu bytes read in at mount time\n", num_hot,
+				(unsigned long long)hdr.hot_size);
+	}
+	free(dir);
+	free(htab);
+	free(order);
+	return 0;
+
+err:
+	fclose(fp);
+	remove(fname);
+	free(dir);
+	free(htab);
+	free(order);
+	return -1;
+}
+
+/* ranks the files by their first access in a trace written by ass_trace, and
+ * returns how many of them it has. Paths in the trace which aren't in the
+ * pack are skipped: they're from other mounts, or the filesystem.
+ */
+static int load_order(const char *fname)
+{
+	FILE *fp;
+	char buf[1024], *name, *end;
+	int len, count = 0, plen = order_prefix ? strlen(order_prefix) : 0;
+	struct file *f;
+
+	if(!(fp = fopen(fname, "r"))) {
+		fprintf(stderr, "failed to open trace %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	while(fgets(buf, sizeof buf, fp)) {
+		len = strlen(buf);
+		end = buf + len;
+		while(end > buf && isspace((unsigned char)end[-1])) *--end = 0;
+
+		/* same prefix matching as ass_fopen */
+		if(plen && memcmp(buf, order_prefix, plen) != 0) {
+			continue;
+		}
+		name = buf + plen;
+		while(*name == '/' || *name == '\\') name++;
+
+		f = bsearch(name, files, num_files, sizeof *files, cmp_name_key);
+		if(f && f->rank < 0) {
+			f->rank = count++;
+		}
+	}
+	fclose(fp);
+
+	if(!count) {
+		fprintf(stderr, "warning: none of the files in %s are in the pack%s\n", fname,
+				order_prefix ? "" : ", try -prefix");
+	}
+	return count;
+}
+
+static int cmp_name_key(const void *key, const void *f)
+{
+	return strcmp(key, ((struct file*)f)->name);
+}
+
+static int cmp_layout(const void *a, const void *b)
+{
+	const struct file *fa = files + *(int*)a;
+	const struct file *fb = files + *(int*)b;
+
+	if(fa->rank != fb->rank) {
+		if(fa->rank < 0) return 1;
+		if(fb->rank < 0) return -1;
+		return fa->rank - fb->rank;
+	}
+	return *(int*)a - *(int*)b;
+}
+
+/* files with the same contents are stored once. Only files of the same size
+ * can be identical, so only those are hashed, and files with the same hash
+ * are compared byte by byte, to be sure. The earliest file in the pack (in
+ * name order) keeps the data, and the rest point to it.
+ */
+static int find_duplicates(void)
+{
+	int i, j, start, *order;
+
+	if(!(order = malloc(num_files * sizeof *order))) {
+		perror("failed to allocate memory");
+		return -1;
+	}
+	for(i=0; i<num_files; i++) {
+		order[i] = i;
+		files[i].chash = 0;
+	}
+
+	/* group by size first, and hash the files which share their size */
+	qsort(order, num_files, sizeof *order, cmp_contents);
+	for(i=0; i<num_files; i=j) {
+		for(j=i + 1; j<num_files && files[order[j]].size == files[order[i]].size; j++);
+		if(j - i > 1 && files[order[i]].size > 0) {
+			for(start=i; start<j; start++) {
+				if(hash_file(files + order[start]) == -1) {
+					free(order);
+					return -1;
+				}
+			}
+		}
+	}
+
+	/* now equal (size, hash) runs are adjacent, in file order */
+	qsort(order, num_files, sizeof *order, cmp_contents);
+	for(i=0; i<num_files; i=j) {
+		struct file *first = files + order[i];
+		for(j=i + 1; j<num_files; j++) {
+			struct file *f = files + order[j];
+			if(f->size != first->size || f->chash != first->chash) break;
+			if(first->size > 0 && same_contents(first, f) == 1) {
+				f->dup_of = order[i];
+			}
+		}
+	}
+	free(order);
+	return 0;
+}
+
+static int cmp_contents(const void *a, const void *b)
+{
+	const struct file *fa = files + *(int*)a;
+	const struct file *fb = files + *(int*)b;
+
+	if(fa->size != fb->size) return fa->size < fb->size ? -1 : 1;
+	if(fa->chash != fb->chash) return fa->chash < fb->chash ? -1 : 1;
+	return *(int*)a - *(int*)b;
+}
+
+static int hash_file(struct file *file)
+{
+	FILE *in;
+	static char buf[65536];
+	size_t sz;
+	struct ass_hash64_state hs;
+
+	if(!(in = fopen(file->path, "rb"))) {
+		fprintf(stderr, "failed to open %s: %s\n", file->path, strerror(errno));
+		return -1;
+	}
+	ass_hash64_init(&hs, 0);
+	while((sz = fread(buf, 1, sizeof buf, in)) > 0) {
+		ass_hash64_update(&hs, buf, sz);
+	}
+	fclose(in);
+	file->chash = ass_hash64_final(&hs);
+	return 0;
+}
+
+/* returns 1 if both files have the same contents, 0 if not, -1 on error */
+static int same_contents(struct file *a, struct file *b)
+{
+	FILE *fa, *fb;
+	static char bufa[65536], bufb[65536];
+	size_t sza, szb;
+	int res = 1;
+
+	if(!(fa = fopen(a->path, "rb"))) {
+		return -1;
+	}
+	if(!(fb = fopen(b->path, "rb"))) {
+		fclose(fa);
+		return -1;
+	}
+	do {
+		sza = fread(bufa, 1, sizeof bufa, fa);
+		szb = fread(bufb, 1, sizeof bufb, fb);
+		if(sza != szb || memcmp(bufa, bufb, sza) != 0) {
+			res = 0;
+			break;
+		}
+	} while(sza > 0);
+
+	fclose(fa);
+	fclose(fb);
+	return res;
+}
+
+static int write_data(FILE *fp, const char *path, uint64_t size)
+{
+	FILE *in;
+	static char buf[65536];
+	size_t sz;
+
+	if(!(in = fopen(path, "rb"))) {
+		fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while(size > 0 && (sz = fread(buf, 1, size < sizeof buf ? size : sizeof buf, in)) > 0) {
+		if(fwrite(buf, 1, sz, fp) < sz) {
+			fprintf(stderr, "failed to write: %s\n", strerror(errno));
+			fclose(in);
+			return -1;
+		}
+		size -= sz;
+	}
+	fclose(in);
+	if(size > 0) {
+		fprintf(stderr, "%s changed while adding it to the pack\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* compresses a file block by block. If it doesn't compress at all, it's
+ * stored as it is.
+ */
+static int write_encoded(FILE *fp, struct file *file, struct pack_entry *ent)
+{
+	FILE *in;
+	unsigned char *src, *dst, *sptr, *dptr, *out;
+	uint64_t *blktab;
+	long i, num_blocks, blen, clen, dst_max, bound;
+	uLongf zlen;
+
+	if(file->size != (size_t)file->size) {
+		fprintf(stderr, "%s: too large\n", file->path);
+		return -1;
+	}
+
+	num_blocks = PACK_NUM_BLOCKS(file, block_size);
+	bound = ASS_LZ4_BOUND(block_size);
+	if(compressBound(block_size) > bound) bound = compressBound(block_size);
+	dst_max = (num_blocks + 1) * sizeof *blktab + file->size + bound;
+
+	if(!(src = malloc(file->size)) || !(dst = malloc(dst_max))) {
+		fprintf(stderr, "%s: failed to allocate compression buffers\n", file->path);
+		free(src);
+		return -1;
+	}
+	if(!(in = fopen(file->path, "rb"))) {
+		fprintf(stderr, "failed to open %s: %s\n", file->path, strerror(errno));
+		goto err;
+	}
+	if(fread(src, 1, file->size, in) < file->size) {
+		fprintf(stderr, "failed to read %s\n", file->path);
+		fclose(in);
+		goto err;
+	}
+	fclose(in);
+
+	blktab = (uint64_t*)dst;
+	dptr = dst + (num_blocks + 1) * sizeof *blktab;
+	sptr = src;
+	for(i=0; i<num_blocks; i++) {
+		blen = file->size - i * block_size;
+		if(blen > block_size) blen = block_size;
+
+		blktab[i] = dptr - dst;
+		if(encoding == PACK_ENC_LZ4) {
+			clen = ass_lz4_compress(sptr, blen, dptr, blen - 1);
+		} else {
+			zlen = blen - 1;
+			clen = compress2(dptr, &zlen, sptr, blen, 9) == Z_OK ? zlen : 0;
+		}
+		if(clen <= 0 || clen >= blen) {
+			/* incompressible block */
+			memcpy(dptr, sptr, blen);
+			clen = blen;
+		}
+		dptr += clen;
+		sptr += blen;
+	}
+	blktab[num_blocks] = dptr - dst;
+
+	if(dptr - dst >= file->size) {
+		/* no gain, store it as is */
+		ent->flags = PACK_ENC_NONE;
+		ent->stored_size = file->size;
+		out = src;
+	} else {
+		ent->flags = encoding;
+		ent->stored_size = dptr - dst;
+		out = dst;
+	}
+	if(fwrite(out, 1, ent->stored_size, fp) < ent->stored_size) {
+		fprintf(stderr, "failed to write: %s\n", strerror(errno));
+		goto err;
+	}
+	free(src);
+	free(dst);
+	return 0;
+
+err:
+	free(src);
+	free(dst);
+	return -1;
+}
+
+static int write_pad(FILE *fp, uint64_t size)
+{
+	static const char zeros[PACK_DEF_ALIGN];
+
+	while(size > 0) {
+		size_t sz = size < sizeof zeros ? size : sizeof zeros;
+		if(fwrite(zeros, 1, sz, fp) < sz) {
+			return -1;
+		}
+		size -= sz;
+	}
+	return 0;
+}
+
+static const char *enc_name(int enc)
+{
+	switch(enc) {
+	case PACK_ENC_NONE:
+		return "stored";
+	case PACK_ENC_LZ4:
+		return "lz4";
+	case PACK_ENC_DEFLATE:
+		return "deflate";
+	default:
+		break;
+	}
+	return "unknown";
+}
+
+static int list_pack(const char *fname)
+{
+	FILE *fp;
+	struct pack_header hdr;
+	struct pack_entry ent;
+	char *names;
+	uint32_t i;
+
+	if(!(fp = fopen(fname, "rb"))) {
+		fprintf(stderr, "failed to open %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	if(fread(&hdr, sizeof hdr, 1, fp) < 1 || memcmp(hdr.magic, PACK_MAGIC, PACK_MAGIC_LEN) != 0 ||
+			hdr.byte_order != PACK_BYTE_ORDER) {
+		fprintf(stderr, "%s is not a pack file, or was built for a different byte order\n", fname);
+		fclose(fp);
+		return -1;
+	}
+	if(!(names = malloc(hdr.names_size + 1))) {
+		perror("failed to allocate memory");
+		fclose(fp);
+		return -1;
+	}
+	fseek(fp, hdr.names_offs, SEEK_SET);
+	fread(names, 1, hdr.names_size, fp);
+	names[hdr.names_size] = 0;
+
+	printf("pack version %u, %u files, alignment %u, block size %u\n", (unsigned int)hdr.version,
+			(unsigned int)hdr.num_entries, (unsigned int)hdr.align, (unsigned int)hdr.block_size);
+	if(hdr.hot_size) {
+		printf("hot prefix: %llu bytes\n", (unsigned long long)hdr.hot_size);
+	}
+	for(i=0; i<hdr.num_entries; i++) {
+		fseek(fp, hdr.dir_offs + i * sizeof ent, SEEK_SET);
+		if(fread(&ent, sizeof ent, 1, fp) < 1 || ent.name_offs >= hdr.names_size) {
+			fprintf(stderr, "truncated or corrupted pack\n");
+			break;
+		}
+		printf("%12llu %12llu %-8s %s\n", (unsigned long long)ent.size, (unsigned long long)ent.stored_size,
+				enc_name(ent.flags & PACK_ENC_MASK), names + ent.name_offs);
+	}
+	free(names);
+	fclose(fp);
+	return 0;
+}
@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+# Stand-in mirrors for mirrortest. Serves any number of ports from one process,
+# each one misbehaving in its own way:
+#
+#   mirrorsrv.py <log file> <port>:<mode>[:<delay>] ...
+#
+# modes:
+#   ok       serve the file
+#   trunc    announce the whole file, send half of it, and close the connection
+#   err      503 Service Unavailable
+#   missing  404 Not Found
+#   badenc   answers requests accepting only gzip with an encoding nobody
+#            asked for, and the rest with the file as it is
+# delay is in seconds, before responding (default 0).
+#
+# Paths look like /<mirror>/<name>-<size>.bin. The first component only tells
+# mirrors sharing a port apart, and the contents are generated from the rest,
+# the same way mirrortest.c checks them. Every request is logged as a line with
+# the port, the path and the status code, and "ready" is logged once all ports
+# are listening.
+
+import sys, time, threading, http.server, socketserver
+
+log_lock = threading.Lock()
+
+def log(line):
+	with log_lock:
+		logfile.write(line + "\n")
+		logfile.flush()
+
+def gen_data(name, size):
+	h = 2166136261
+	for c in name.encode():
+		h = ((h ^ c) * 16777619) & 0xffffffff
+	out = bytearray(size)
+	for i in range(size):
+		h = (h * 1103515245 + 12345) & 0xffffffff
+		out[i] = h >> 24
+	return bytes(out)
+
+def parse_path(path):
+	parts = path.split("/", 2)
+	if len(parts) < 3 or not parts[2].endswith(".bin") or "-" not in parts[2]:
+		return None, 0
+	name = parts[2]
+	try:
+		size = int(name[name.rindex("-") + 1:-4])
+	except ValueError:
+		return None, 0
+	return name, size
+
+class Handler(http.server.BaseHTTPRequestHandler):
+	protocol_version = "HTTP/1.1"
+
+	def do_GET(self):
+		self.respond(True)
+
+	def do_HEAD(self):
+		self.respond(False)
+
+	def respond(self, body):
+		port = self.server.server_address[1]
+		mode, delay = self.server.mode, self.server.delay
+		if delay > 0:
+			time.sleep(delay)
+
+		name, size = parse_path(self.path)
+		if mode == "err":
+			code = 503
+		elif mode == "missing" or name is None:
+			code = 404
+		else:
+			code = 200
+		log("%d %s %d" % (port, self.path, code))
+
+		if code != 200:
+			self.send_response(code)
+			self.send_header("Content-Length", "0")
+			self.end_headers()
+			return
+
+		data = gen_data(name, size)
+		self.send_response(200)
+		self.send_header("Content-Type", "application/octet-stream")
+		if mode == "badenc" and self.headers.get("Accept-Encoding", "") == "gzip":
+			self.send_header("Content-Encoding", "x-unknown")
+		self.send_header("Content-Length", str(len(data)))
+		self.end_headers()
+		if not body:
+			return
+		if mode == "trunc":
+			self.wfile.write(data[:len(data) // 2])
+			self.wfile.flush()
+			self.close_connection = True
+			return
+		self.wfile.write(data)
+
+	def log_message(self, *args):
+		pass
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+	daemon_threads = True
+	allow_reuse_address = True
+
+	def handle_error(self, request, client_address):
+		# clients hang up on purpose, e.g. on a hedged request another mirror won
+		if not isinstance(sys.exc_info()[1], ConnectionError):
+			super().handle_error(request, client_address)
+
+if len(sys.argv) < 3:
+	sys.stderr.write("usage: %s <log file> <port>:<mode>[:<delay>] ...\n" % sys.argv[0])
+	sys.exit(1)
+
+logfile = open(sys.argv[1], "w")
+for arg in sys.argv[2:]:
+	fields = arg.split(":")
+	srv = Server(("127.0.0.1", int(fields[0])), Handler)
+	srv.mode = fields[1] if len(fields) > 1 else "ok"
+	srv.delay = float(fields[2]) if len(fields) > 2 else 0.0
+	threading.Thread(target=srv.serve_forever, daemon=True).start()
+log("ready")
+
+while True:
+	time.sleep(3600)
@@ -0,0 +1,559 @@
+/* nftw */
+#define _XOPEN_SOURCE	700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/wait.h>
+#include "assfile.h"
+
+#define CHECK(x) \
+	do { \
+		if(!(x)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+			failed = 1; \
+		} \
+	} while(0)
+
+#define FILE_SIZE	30000
+
+/* stand-in mirrors, port offsets from the base port. See mirrorsrv.py */
+enum {
+	SRV_OK,
+	SRV_SLOW,		/* responds after SLOW_DELAY seconds */
+	SRV_LAGGY,		/* responds after LAGGY_DELAY seconds */
+	SRV_TRUNC,		/* sends half of every file */
+	SRV_ERR,		/* 503 */
+	SRV_MISSING,	/* 404 */
+	SRV_BADENC,		/* unknown content encoding when asked for gzip only */
+	SRV_DOWN,		/* nothing listens there */
+	NUM_SRV
+};
+#define SLOW_DELAY	1.0
+#define LAGGY_DELAY	0.2
+
+static int test_down(void);
+static int test_slow(void);
+static int test_trunc(void);
+static int test_err(void);
+static int test_missing(void);
+static int test_mask(void);
+static int test_hedge(void);
+static int test_encoding(void);
+static int add_mirrors(const char *prefix, const int *srv, int count);
+static int fetch(const char *prefix, const char *name, double *dur);
+static int count_hits(int srv, const char *name);
+static int capture_stderr(int capture);
+static int log_contains(const char *fname, const char *str);
+static void gen_data(const char *name, unsigned char *buf, long size);
+static int start_server(const char *srvpath);
+static void cleanup(void);
+static int rm_entry(const char *path, const struct stat *st, int type, struct FTW *ftw);
+static double get_time(void);
+void print_usage(const char *argv0);
+
+static int base_port = 18700;
+static char tmpdir[] = "/tmp/mirrortest.XXXXXX";
+static char logpath[64], errpath[64];
+static pid_t srv_pid;
+
+int main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		int (*func)(void);
+	} tests[] = {
+		{"down", test_down},
+		{"slow", test_slow},
+		{"truncated", test_trunc},
+		{"503", test_err},
+		{"404", test_missing},
+		{"32mirrors", test_mask},
+		{"hedge", test_hedge},
+		{"encoding", test_encoding}
+	};
+	int i, res = 0;
+	const char *srvpath = "mirrorsrv.py", *only = 0;
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-') {
+			if(strcmp(argv[i], "-port") == 0) {
+				if(!argv[++i] || (base_port = atoi(argv[i])) <= 0 || base_port > 65535 - NUM_SRV) {
+					fprintf(stderr, "-port must be followed by a valid port number\n");
+					return 1;
+				}
+
+			} else if(strcmp(argv[i], "-srv") == 0) {
+				if(!argv[++i]) {
+					fprintf(stderr, "-srv must be followed by the path of mirrorsrv.py\n");
+					return 1;
+				}
+				srvpath = argv[i];
+
+			} else if(strcmp(argv[i], "-help") == 0 || strcmp(argv[i], "-h") == 0) {
+				print_usage(argv[0]);
+				return 0;
+
+			} else {
+				fprintf(stderr, "invalid option: %s\n", argv[i]);
+				return 1;
+			}
+		} else {
+			only = argv[i];
+		}
+	}
+
+	/* a fresh mod_url cache, so that every file has to be downloaded */
+	if(!mkdtemp(tmpdir)) {
+		fprintf(stderr, "failed to create temporary directory: %s\n", strerror(errno));
+		return 1;
+	}
+	setenv("TMPDIR", tmpdir, 1);
+	/* registered before the library's own exit handler, so it runs after it */
+	atexit(cleanup);
+
+	if(start_server(srvpath) == -1) {
+		return 1;
+	}
+
+	for(i=0; i<(int)(sizeof tests / sizeof *tests); i++) {
+		if(only && strcmp(only, tests[i].name) != 0) {
+			continue;
+		}
+		printf("%-12s ", tests[i].name);
+		fflush(stdout);
+		if(tests[i].func() == -1) {
+			printf("FAILED\n");
+			res = 1;
+		} else {
+			printf("ok\n");
+		}
+	}
+	return res;
+}
+
+void print_usage(const char *argv0)
+{
+	printf("Usage: %s [options] [test]\n", argv0);
+	printf("Options:\n");
+	printf(" -port <n>      first of the %d ports used by the stand-in mirrors (default 18700)\n", NUM_SRV);
+	printf(" -srv <path>    path of mirrorsrv.py (default: current directory)\n");
+	printf(" -h,-help       print usage and exit\n");
+	printf("\nTests mod_url mirror selection and failover against local stand-in mirrors\n");
+	printf("(python3 mirrorsrv.py). Runs all tests, or only the one named.\n");
+}
+
+/* a mirror which refuses connections is skipped */
+static int test_down(void)
+{
+	static const int srv[] = {SRV_DOWN, SRV_OK};
+	int i, failed = 0;
+	char name[64];
+
+	if(add_mirrors("down", srv, 2) == -1) return -1;
+	for(i=0; i<4; i++) {
+		sprintf(name, "down%d-%d.bin", i, FILE_SIZE);
+		CHECK(fetch("down", name, 0) == 0);
+		CHECK(count_hits(SRV_OK, name) == 1);
+	}
+	return failed ? -1 : 0;
+}
+
+/* mirrors we know nothing about are tried first, but once a mirror turns out
+ * to be slow, requests go to the fast one
+ */
+static int test_slow(void)
+{
+	static const int srv[] = {SRV_SLOW, SRV_OK};
+	int i, failed = 0, slow = 0;
+	char name[64];
+
+	if(add_mirrors("slow", srv, 2) == -1) return -1;
+	for(i=0; i<6; i++) {
+		sprintf(name, "slow%d-%d.bin", i, FILE_SIZE);
+		CHECK(fetch("slow", name, 0) == 0);
+		slow += count_hits(SRV_SLOW, name);
+	}
+	CHECK(slow <= 1);
+	return failed ? -1 : 0;
+}
+
+/* a truncated body is never accepted, the file is fetched again from the other
+ * mirror, and the truncating mirror is avoided for a while
+ */
+static int test_trunc(void)
+{
+	static const int srv[] = {SRV_TRUNC, SRV_OK};
+	int i, failed = 0, trunc = 0;
+	char name[64];
+
+	if(add_mirrors("trunc", srv, 2) == -1) return -1;
+	for(i=0; i<4; i++) {
+		sprintf(name, "trunc%d-%d.bin", i, FILE_SIZE);
+		CHECK(fetch("trunc", name, 0) == 0);
+		trunc += count_hits(SRV_TRUNC, name);
+	}
+	CHECK(trunc == 1);
+	return failed ? -1 : 0;
+}
+
+/* a server error backs the mirror off */
+static int test_err(void)
+{
+	static const int srv[] = {SRV_ERR, SRV_OK};
+	int i, failed = 0, err = 0;
+	char name[64];
+
+	if(add_mirrors("err", srv, 2) == -1) return -1;
+	for(i=0; i<4; i++) {
+		sprintf(name, "err%d-%d.bin", i, FILE_SIZE);
+		CHECK(fetch("err", name, 0) == 0);
+		err += count_hits(SRV_ERR, name);
+	}
+	CHECK(err == 1);
+	return failed ? -1 : 0;
+}
+
+/* a mirror which doesn't have a file isn't broken: it's still asked first for
+ * every file, since it answers faster than the other one. Files no mirror has
+ * fail to open.
+ */
+static int test_missing(void)
+{
+	static const int srv[] = {SRV_MISSING, SRV_LAGGY};
+	int i, failed = 0;
+	char name[64];
+
+	if(add_mirrors("missing", srv, 2) == -1) return -1;
+	for(i=0; i<6; i++) {
+		sprintf(name, "missing%d-%d.bin", i, FILE_SIZE);
+		CHECK(fetch("missing", name, 0) == 0);
+		CHECK(count_hits(SRV_MISSING, name) == 1);
+	}
+	CHECK(fetch("missing", "nowhere.txt", 0) == -1);
+	CHECK(count_hits(SRV_LAGGY, "nowhere.txt") == 1);
+	return failed ? -1 : 0;
+}
+
+/* the most mirrors a mount can have, all but the last failing. Each one is
+ * tried once, and then avoided. Files no mirror has still fail to open, after
+ * asking each mirror once. With hedging, a slow response from the last mirror
+ * doesn't send the file off to another one, since they've all been tried
+ * (mod_url only says so in verbose mode).
+ */
+static int test_mask(void)
+{
+	int i, srv[32], failed = 0;
+
+	for(i=0; i<31; i++) {
+		srv[i] = SRV_ERR;
+	}
+	srv[31] = SRV_OK;
+
+	if(add_mirrors("mask", srv, 32) == -1) return -1;
+	CHECK(fetch("mask", "mask0-30000.bin", 0) == 0);
+	CHECK(count_hits(SRV_ERR, "mask0-30000.bin") == 31);
+	CHECK(count_hits(SRV_OK, "mask0-30000.bin") == 1);
+
+	CHECK(fetch("mask", "mask1-30000.bin", 0) == 0);
+	CHECK(count_hits(SRV_ERR, "mask1-30000.bin") == 0);
+
+	CHECK(fetch("mask", "none.txt", 0) == -1);
+	CHECK(count_hits(SRV_ERR, "none.txt") + count_hits(SRV_OK, "none.txt") == 32);
+
+	srv[31] = SRV_SLOW;
+	ass_set_option(ASS_URL_HEDGE, 400);
+	setenv("ASSFILE_VERBOSE", "1", 1);
+	if(capture_stderr(1) == -1) return -1;
+	if(add_mirrors("mask2", srv, 32) == -1) {
+		capture_stderr(0);
+		return -1;
+	}
+	CHECK(fetch("mask2", "mask2-30000.bin", 0) == 0);
+	capture_stderr(0);
+	setenv("ASSFILE_VERBOSE", "0", 1);
+	ass_set_option(ASS_URL_HEDGE, 0);
+	CHECK(!log_contains(errpath, "asking another mirror"));
+	return failed ? -1 : 0;
+}
+
+/* the first request goes to the slow mirror, which nobody has heard from yet.
+ * With ASS_URL_HEDGE, the other mirror is asked too after that long, and
+ * delivers first.
+ */
+static int test_hedge(void)
+{
+	static const int srv[] = {SRV_SLOW, SRV_OK};
+	int failed = 0;
+	double dur = 0;
+
+	ass_set_option(ASS_URL_HEDGE, 100);
+	if(add_mirrors("hedge", srv, 2) == -1) return -1;
+	CHECK(fetch("hedge", "hedge0-30000.bin", &dur) == 0);
+	CHECK(dur >= 0.1 && dur < SLOW_DELAY * 0.6);
+	CHECK(count_hits(SRV_OK, "hedge0-30000.bin") == 1);
+
+	ass_set_option(ASS_URL_HEDGE, 0);
+	if(add_mirrors("nohedge", srv, 2) == -1) return -1;
+	CHECK(fetch("nohedge", "hedge1-30000.bin", &dur) == 0);
+	CHECK(dur >= SLOW_DELAY * 0.9);
+	CHECK(count_hits(SRV_OK, "hedge1-30000.bin") == 0);
+	return failed ? -1 : 0;
+}
+
+/* with ASS_URL_CACHE_COMPRESSED, mod_url asks for gzip only, and keeps it as
+ * it comes. A response in any other encoding is fetched again from the same
+ * mirror, decoded, and the mirror isn't penalised for it: once both mirrors
+ * have been probed, the faster one serves every file.
+ */
+static int test_encoding(void)
+{
+	static const int srv[] = {SRV_BADENC, SRV_LAGGY};
+	int i, failed = 0;
+	char name[64];
+
+	ass_set_option(ASS_URL_CACHE_COMPRESSED, 1);
+	if(add_mirrors("enc", srv, 2) == -1) return -1;
+	for(i=0; i<5; i++) {
+		sprintf(name, "enc%d-%d.bin", i, FILE_SIZE);
+		CHECK(fetch("enc", name, 0) == 0);
+		CHECK(count_hits(SRV_BADENC, name) != 1);
+		if(i >= 2) {
+			CHECK(count_hits(SRV_BADENC, name) == 2);
+			CHECK(count_hits(SRV_LAGGY, name) == 0);
+		}
+	}
+	ass_set_option(ASS_URL_CACHE_COMPRESSED, 0);
+	return failed ? -1 : 0;
+}
+
+/* mirrors sharing a port are told apart by the first path component */
+static int add_mirrors(const char *prefix, const int *srv, int count)
+{
+	int i, res;
+	char **urls;
+
+	if(!(urls = malloc(count * sizeof *urls))) {
+		perror("failed to allocate mirror list");
+		return -1;
+	}
+	for(i=0; i<count; i++) {
+		if(!(urls[i] = malloc(64))) {
+			perror("failed to allocate mirror url");
+			while(--i >= 0) free(urls[i]);
+			free(urls);
+			return -1;
+		}
+		sprintf(urls[i], "http://127.0.0.1:%d/m%d", base_port + srv[i], i);
+	}
+
+	if((res = ass_add_url_mirrors(prefix, (const char**)urls, count)) == -1) {
+		fprintf(stderr, "failed to add mirrors for %s\n", prefix);
+	}
+	for(i=0; i<count; i++) {
+		free(urls[i]);
+	}
+	free(urls);
+	return res;
+}
+
+/* reads a file in full and checks its contents. Returns -1 if it fails to open,
+ * -2 if the contents are wrong
+ */
+static int fetch(const char *prefix, const char *name, double *dur)
+{
+	char path[128];
+	unsigned char *buf, *ref;
+	size_t size;
+	double t0;
+	ass_file *fp;
+	int res = 0;
+
+	if(!(buf = malloc(FILE_SIZE * 2)) || !(ref = malloc(FILE_SIZE))) {
+		perror("failed to allocate buffer");
+		abort();
+	}
+	sprintf(path, "%s/%s", prefix, name);
+
+	t0 = get_time();
+	if(!(fp = ass_fopen(path, "rb"))) {
+		res = -1;
+		goto end;
+	}
+	size = ass_fread(buf, 1, FILE_SIZE * 2, fp);
+	ass_fclose(fp);
+	if(dur) *dur = get_time() - t0;
+
+	gen_data(name, ref, FILE_SIZE);
+	if(size != FILE_SIZE || memcmp(buf, ref, FILE_SIZE) != 0) {
+		fprintf(stderr, "%s: got %ld bytes, wrong contents\n", path, (long)size);
+		res = -2;
+	}
+end:
+	free(buf);
+	free(ref);
+	return res;
+}
+
+/* requests for a file to any of the mirrors on a port, from the server log */
+static int count_hits(int srv, const char *name)
+{
+	FILE *fp;
+	char line[512], *path, *slash;
+	int port, count = 0;
+
+	if(!(fp = fopen(logpath, "r"))) {
+		fprintf(stderr, "failed to open server log: %s: %s\n", logpath, strerror(errno));
+		return -1;
+	}
+	while(fgets(line, sizeof line, fp)) {
+		if(sscanf(line, "%d", &port) != 1 || port != base_port + srv) {
+			continue;
+		}
+		if(!(path = strchr(line, ' ')) || !(slash = strchr(path + 2, '/'))) {
+			continue;
+		}
+		if(strncmp(slash + 1, name, strlen(name)) == 0 && slash[strlen(name) + 1] == ' ') {
+			count++;
+		}
+	}
+	fclose(fp);
+	return count;
+}
+
+/* redirects stderr to errpath, or back where it was */
+static int capture_stderr(int capture)
+{
+	static int saved_fd = -1;
+	int fd;
+
+	fflush(stderr);
+	if(capture) {
+		sprintf(errpath, "%s/stderr.log", tmpdir);
+		if((fd = open(errpath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+			fprintf(stderr, "failed to create %s: %s\n", errpath, strerror(errno));
+			return -1;
+		}
+		saved_fd = dup(2);
+		dup2(fd, 2);
+		close(fd);
+
+	} else if(saved_fd != -1) {
+		dup2(saved_fd, 2);
+		close(saved_fd);
+		saved_fd = -1;
+	}
+	return 0;
+}
+
+static int log_contains(const char *fname, const char *str)
+{
+	FILE *fp;
+	char line[1024];
+	int found = 0;
+
+	if(!(fp = fopen(fname, "r"))) {
+		return 0;
+	}
+	while(!found && fgets(line, sizeof line, fp)) {
+		found = strstr(line, str) != 0;
+	}
+	fclose(fp);
+	return found;
+}
+
+/* must match gen_data in mirrorsrv.py */
+static void gen_data(const char *name, unsigned char *buf, long size)
+{
+	long i;
+	unsigned int h = 2166136261u;
+
+	while(*name) {
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	}
+	for(i=0; i<size; i++) {
+		h = h * 1103515245u + 12345u;
+		buf[i] = h >> 24;
+	}
+}
+
+static int start_server(const char *srvpath)
+{
+	static const char *modes[NUM_SRV] = {"ok", "ok", "ok", "trunc", "err", "missing", "badenc", 0};
+	static const double delays[NUM_SRV] = {0, SLOW_DELAY, LAGGY_DELAY};
+	char *argv[NUM_SRV + 4], args[NUM_SRV][32];
+	char line[64];
+	int i, num = 0;
+	FILE *fp;
+	double t0;
+	struct timespec poll_interval = {0, 20000000};
+
+	sprintf(logpath, "%s/mirrorsrv.log", tmpdir);
+	argv[num++] = "python3";
+	argv[num++] = (char*)srvpath;
+	argv[num++] = logpath;
+	for(i=0; i<NUM_SRV; i++) {
+		if(!modes[i]) continue;	/* SRV_DOWN */
+		sprintf(args[i], "%d:%s:%g", base_port + i, modes[i], delays[i]);
+		argv[num++] = args[i];
+	}
+	argv[num] = 0;
+
+	if((srv_pid = fork()) == -1) {
+		perror("failed to fork");
+		return -1;
+	}
+	if(!srv_pid) {
+		execvp(argv[0], argv);
+		fprintf(stderr, "failed to run python3: %s\n", strerror(errno));
+		_exit(127);
+	}
+
+	/* wait for it to start listening */
+	t0 = get_time();
+	while(get_time() - t0 < 10.0) {
+		if(waitpid(srv_pid, &i, WNOHANG) == srv_pid) {
+			fprintf(stderr, "mirrorsrv.py failed to start\n");
+			srv_pid = 0;
+			return -1;
+		}
+		if((fp = fopen(logpath, "r"))) {
+			if(fgets(line, sizeof line, fp) && strcmp(line, "ready\n") == 0) {
+				fclose(fp);
+				return 0;
+			}
+			fclose(fp);
+		}
+		nanosleep(&poll_interval, 0);
+	}
+	fprintf(stderr, "timed out waiting for mirrorsrv.py to start\n");
+	return -1;
+}
+
+static void cleanup(void)
+{
+	if(srv_pid > 0) {
+		kill(srv_pid, SIGTERM);
+		waitpid(srv_pid, 0, 0);
+	}
+	nftw(tmpdir, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static int rm_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	remove(path);
+	return 0;
+}
+
+static double get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
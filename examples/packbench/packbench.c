@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "assfile.h"
+
+#define READ_SIZE	4096
+
+struct file {
+	char *path;			/* relative to the source directory */
+	long size;
+	long offs;			/* running total of the sizes of the files before it */
+};
+
+struct container {
+	const char *name, *ext;
+	const char *enc;	/* asspack -z argument, or null for a tarball */
+	char *fname;
+};
+
+static int add_dir(const char *dir, const char *rel);
+static int cmp_files(const void *a, const void *b);
+static int build(struct container *c, const char *srcdir);
+static int run(char **argv);
+static int evict(const char *fname);
+static int mount(struct container *c);
+static ass_file *open_file(struct file *f);
+static double read_seq(long *total);
+static double read_random(int count, unsigned int seed);
+static double get_time(void);
+void print_usage(const char *argv0);
+
+static struct container cont[] = {
+	{"tar", ".tar", 0},
+	{"pack, stored", "-stored.pack", "none"},
+	{"pack, lz4", "-lz4.pack", "lz4"},
+	{"pack, deflate", "-deflate.pack", "deflate"}
+};
+#define NUM_CONT	(int)(sizeof cont / sizeof *cont)
+
+static struct file *files;
+static int num_files, max_files;
+static long total_size;
+
+static const char *asspack = "../asspack/asspack";
+static const char *block_size;
+
+int main(int argc, char **argv)
+{
+	int i, nreads = 4000, keep = 0, rebuild = 1;
+	const char *srcdir = 0, *outdir = ".";
+	char *buf;
+	long total;
+	double tseq, trand;
+	struct stat st;
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-') {
+			if(strcmp(argv[i], "-o") == 0) {
+				if(!argv[++i]) goto missing_arg;
+				outdir = argv[i];
+
+			} else if(strcmp(argv[i], "-n") == 0) {
+				if(!argv[++i] || (nreads = atoi(argv[i])) <= 0) {
+					fprintf(stderr, "-n must be followed by a valid number\n");
+					return 1;
+				}
+
+			} else if(strcmp(argv[i], "-bs") == 0) {
+				if(!argv[++i]) goto missing_arg;
+				block_size = argv[i];
+
+			} else if(strcmp(argv[i], "-asspack") == 0) {
+				if(!argv[++i]) goto missing_arg;
+				asspack = argv[i];
+
+			} else if(strcmp(argv[i], "-keep") == 0) {
+				keep = 1;
+
+			} else if(strcmp(argv[i], "-reuse") == 0) {
+				rebuild = 0;
+				keep = 1;
+
+			} else if(strcmp(argv[i], "-help") == 0 || strcmp(argv[i], "-h") == 0) {
+				print_usage(argv[0]);
+				return 0;
+
+			} else {
+				fprintf(stderr, "invalid option: %s\n", argv[i]);
+				return 1;
+			}
+		} else {
+			if(srcdir) {
+				fprintf(stderr, "unexpected argument: %s\n", argv[i]);
+				return 1;
+			}
+			srcdir = argv[i];
+		}
+	}
+
+	if(!srcdir) {
+		print_usage(argv[0]);
+		return 1;
+	}
+	if(add_dir(srcdir, 0) == -1) {
+		return 1;
+	}
+	if(!num_files) {
+		fprintf(stderr, "no files under %s\n", srcdir);
+		return 1;
+	}
+	qsort(files, num_files, sizeof *files, cmp_files);
+	total = 0;
+	for(i=0; i<num_files; i++) {
+		files[i].offs = total;
+		total += files[i].size;
+	}
+	total_size = total;
+
+	for(i=0; i<NUM_CONT; i++) {
+		if(!(buf = malloc(strlen(outdir) + strlen(cont[i].ext) + 12))) {
+			perror("failed to allocate file name");
+			return 1;
+		}
+		sprintf(buf, "%s/packbench%s", outdir, cont[i].ext);
+		cont[i].fname = buf;
+
+		if(rebuild && build(cont + i, srcdir) == -1) {
+			return 1;
+		}
+	}
+
+	printf("%d files, %ld bytes, %d %d-byte random reads\n", num_files, total_size,
+			nreads, READ_SIZE);
+	printf("                    size   sequential read      4k random\n");
+
+	for(i=0; i<NUM_CONT; i++) {
+		if(stat(cont[i].fname, &st) == -1) {
+			fprintf(stderr, "%s: %s\n", cont[i].fname, strerror(errno));
+			return 1;
+		}
+
+		/* the page cache is dropped before each run, so that both read the
+		 * container from the disk
+		 */
+		if(evict(cont[i].fname) == -1 || mount(cont + i) == -1) {
+			return 1;
+		}
+		tseq = read_seq(&total);
+		ass_clear();
+
+		if(evict(cont[i].fname) == -1 || mount(cont + i) == -1) {
+			return 1;
+		}
+		trand = read_random(nreads, 1);
+		ass_clear();
+
+		if(tseq < 0.0 || trand < 0.0) {
+			return 1;
+		}
+		printf("%-15s %8.1fmb   %10.0f mb/s   %9.0fms\n", cont[i].name,
+				st.st_size / 1048576.0, total / 1048576.0 / tseq, trand * 1000.0);
+	}
+
+	if(!keep) {
+		for(i=0; i<NUM_CONT; i++) {
+			remove(cont[i].fname);
+		}
+	}
+	return 0;
+
+missing_arg:
+	fprintf(stderr, "%s must be followed by an argument\n", argv[i - 1]);
+	return 1;
+}
+
+void print_usage(const char *argv0)
+{
+	printf("Usage: %s [options] <dir>\n", argv0);
+	printf("Options:\n");
+	printf(" -o <dir>         where to build the containers (default: current directory)\n");
+	printf(" -n <n>           number of random reads (default 4000)\n");
+	printf(" -bs <n>          compression block size, passed to asspack\n");
+	printf(" -asspack <path>  asspack program (default: ../asspack/asspack)\n");
+	printf(" -keep            keep the containers afterwards\n");
+	printf(" -reuse           use the containers kept by a previous run, instead of building them\n");
+	printf(" -h,-help         print usage and exit\n");
+	printf("\nBuilds a tarball and stored, lz4 and deflate packs out of the files under\n");
+	printf("dir, and times reading them all back through the library: once in full, in\n");
+	printf("order, and once with %d-byte reads at random offsets, spread over the files by\n", READ_SIZE);
+	printf("size. Each container is evicted from the page cache before every run, so the\n");
+	printf("times include reading it from the disk.\n");
+}
+
+/* collects every regular file under dir, with its path relative to the top */
+static int add_dir(const char *dir, const char *rel)
+{
+	DIR *dp;
+	struct dirent *dent;
+	struct stat st;
+	char *path, *relpath;
+	void *tmp;
+
+	if(!(dp = opendir(dir))) {
+		fprintf(stderr, "failed to open directory: %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+
+	while((dent = readdir(dp))) {
+		if(strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0) {
+			continue;
+		}
+		path = malloc(strlen(dir) + strlen(dent->d_name) + 2);
+		relpath = malloc((rel ? strlen(rel) : 0) + strlen(dent->d_name) + 2);
+		if(!path || !relpath) {
+			perror("failed to allocate path");
+			goto err;
+		}
+		sprintf(path, "%s/%s", dir, dent->d_name);
+		if(rel) {
+			sprintf(relpath, "%s/%s", rel, dent->d_name);
+		} else {
+			strcpy(relpath, dent->d_name);
+		}
+
+		if(stat(path, &st) == -1) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			goto err;
+		}
+		if(S_ISDIR(st.st_mode)) {
+			if(add_dir(path, relpath) == -1) {
+				goto err;
+			}
+			free(relpath);
+
+		} else if(S_ISREG(st.st_mode)) {
+			if(num_files >= max_files) {
+				int newsz = max_files ? max_files * 2 : 64;
+				if(!(tmp = realloc(files, newsz * sizeof *files))) {
+					perror("failed to resize file list");
+					goto err;
+				}
+				files = tmp;
+				max_files = newsz;
+			}
+			files[num_files].path = relpath;
+			files[num_files++].size = st.st_size;
+		} else {
+			free(relpath);
+		}
+		free(path);
+	}
+	closedir(dp);
+	return 0;
+
+err:
+	free(path);
+	free(relpath);
+	closedir(dp);
+	return -1;
+}
+
+static int cmp_files(const void *a, const void *b)
+{
+	return strcmp(((struct file*)a)->path, ((struct file*)b)->path);
+}
+
+/* the tarball gets the files in the same order asspack puts them in the packs */
+static int build(struct container *c, const char *srcdir)
+{
+	int i, res;
+	char *argv[16], *listname;
+	FILE *fp;
+
+	if(!c->enc) {
+		if(!(listname = malloc(strlen(c->fname) + 6))) {
+			perror("failed to allocate file name");
+			return -1;
+		}
+		sprintf(listname, "%s.list", c->fname);
+		if(!(fp = fopen(listname, "w"))) {
+			fprintf(stderr, "failed to create file list: %s: %s\n", listname, strerror(errno));
+			free(listname);
+			return -1;
+		}
+		for(i=0; i<num_files; i++) {
+			fprintf(fp, "%s\n", files[i].path);
+		}
+		fclose(fp);
+
+		argv[0] = "tar";
+		argv[1] = "-cf";
+		argv[2] = c->fname;
+		argv[3] = "-C";
+		argv[4] = (char*)srcdir;
+		argv[5] = "-T";
+		argv[6] = listname;
+		argv[7] = 0;
+		res = run(argv);
+		remove(listname);
+		free(listname);
+
+	} else {
+		i = 0;
+		argv[i++] = (char*)asspack;
+		argv[i++] = "-o";
+		argv[i++] = c->fname;
+		argv[i++] = "-z";
+		argv[i++] = (char*)c->enc;
+		if(block_size) {
+			argv[i++] = "-bs";
+			argv[i++] = (char*)block_size;
+		}
+		argv[i++] = "-C";
+		argv[i++] = (char*)srcdir;
+		argv[i++] = ".";
+		argv[i] = 0;
+		res = run(argv);
+	}
+	return res;
+}
+
+static int run(char **argv)
+{
+	pid_t pid;
+	int status;
+
+	if((pid = fork()) == -1) {
+		perror("failed to fork");
+		return -1;
+	}
+	if(!pid) {
+		int fd = open("/dev/null", O_WRONLY);	/* asspack prints a summary */
+		if(fd != -1) dup2(fd, 1);
+		execvp(argv[0], argv);
+		fprintf(stderr, "failed to run %s: %s\n", argv[0], strerror(errno));
+		_exit(127);
+	}
+
+	if(waitpid(pid, &status, 0) == -1) {
+		perror("waitpid failed");
+		return -1;
+	}
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s failed\n", argv[0]);
+		return -1;
+	}
+	return 0;
+}
+
+/* drops the cached pages of a file. This only works for pages no process has
+ * mapped, so it must be called while the file isn't mounted.
+ */
+static int evict(const char *fname)
+{
+	int fd, res;
+
+	if((fd = open(fname, O_RDONLY)) == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	fdatasync(fd);
+	if((res = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED)) != 0) {
+		fprintf(stderr, "posix_fadvise failed: %s: %s\n", fname, strerror(res));
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+static int mount(struct container *c)
+{
+	int res = c->enc ? ass_add_pack("bench", c->fname) : ass_add_archive("bench", c->fname);
+	if(res == -1) {
+		fprintf(stderr, "failed to mount %s\n", c->fname);
+	}
+	return res;
+}
+
+static ass_file *open_file(struct file *f)
+{
+	char *path;
+	ass_file *fp;
+
+	if(!(path = malloc(strlen(f->path) + 7))) {
+		perror("failed to allocate path");
+		return 0;
+	}
+	sprintf(path, "bench/%s", f->path);
+	if(!(fp = ass_fopen(path, "rb"))) {
+		fprintf(stderr, "failed to open %s\n", path);
+	}
+	free(path);
+	return fp;
+}
+
+/* reads every file in full, in the order they're stored */
+static double read_seq(long *total)
+{
+	int i;
+	size_t sz;
+	double t0;
+	ass_file *fp;
+	static char buf[65536];
+
+	*total = 0;
+	t0 = get_time();
+	for(i=0; i<num_files; i++) {
+		if(!(fp = open_file(files + i))) {
+			return -1.0;
+		}
+		while((sz = ass_fread(buf, 1, sizeof buf, fp)) > 0) {
+			*total += sz;
+		}
+		ass_fclose(fp);
+	}
+	if(*total != total_size) {
+		fprintf(stderr, "read %ld bytes, expected %ld\n", *total, total_size);
+		return -1.0;
+	}
+	return get_time() - t0;
+}
+
+/* reads at random offsets into the concatenation of all files, so that larger
+ * files get proportionally more reads. The same seed gives the same offsets
+ * for every container.
+ */
+static double read_random(int count, unsigned int seed)
+{
+	int i, lo, hi, mid;
+	long offs, size;
+	double t0;
+	ass_file *fp;
+	char buf[READ_SIZE];
+
+	srand(seed);
+	t0 = get_time();
+	for(i=0; i<count; i++) {
+		offs = (long)(((double)rand() / ((double)RAND_MAX + 1.0)) * total_size);
+
+		lo = 0;
+		hi = num_files - 1;
+		while(lo < hi) {
+			mid = (lo + hi + 1) / 2;
+			if(files[mid].offs <= offs) {
+				lo = mid;
+			} else {
+				hi = mid - 1;
+			}
+		}
+		offs -= files[lo].offs;
+		size = files[lo].size - offs < READ_SIZE ? files[lo].size - offs : READ_SIZE;
+
+		if(!(fp = open_file(files + lo))) {
+			return -1.0;
+		}
+		if(ass_fseek(fp, offs, SEEK_SET) == -1 || ass_fread(buf, 1, size, fp) != size) {
+			fprintf(stderr, "failed to read %ld bytes at %ld from %s\n", size, offs,
+					files[lo].path);
+			ass_fclose(fp);
+			return -1.0;
+		}
+		ass_fclose(fp);
+	}
+	return get_time() - t0;
+}
+
+static double get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
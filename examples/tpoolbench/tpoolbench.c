@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "tpool.h"
+
+#define FANOUT	4
+
+static double run_flat(struct thread_pool *tp, int njobs);
+static double run_fanout(struct thread_pool *tp, int depth);
+static int run_contention(int nworkers, int njobs, unsigned int flags, int repeat);
+static double contention(struct thread_pool *tp, int nsub, int njobs);
+static void *submit_thread(void *cls);
+static void empty_work(void *cls);
+static void fanout_work(void *cls);
+static double get_time(void);
+void print_usage(const char *argv0);
+
+static struct thread_pool *pool;
+static int fanout_jobs;
+
+/* contention test: the submitting threads start together */
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static int start_flag, jobs_per_thread;
+
+int main(int argc, char **argv)
+{
+	int i, j, nthr = 0, njobs = 0, depth = 9, repeat = 3, submitters = 0;
+	unsigned int flags = 0;
+	double flat, fanout, rate;
+	static const int def_threads[] = {1, 2, 4, 8, 16, 32, 64};
+	struct thread_pool *tp;
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-') {
+			if(strcmp(argv[i], "-t") == 0) {
+				if(!argv[++i] || (nthr = atoi(argv[i])) <= 0) goto invalid_arg;
+
+			} else if(strcmp(argv[i], "-jobs") == 0) {
+				if(!argv[++i] || (njobs = atoi(argv[i])) <= 0) goto invalid_arg;
+
+			} else if(strcmp(argv[i], "-depth") == 0) {
+				if(!argv[++i] || (depth = atoi(argv[i])) <= 0 || depth > 12) goto invalid_arg;
+
+			} else if(strcmp(argv[i], "-repeat") == 0) {
+				if(!argv[++i] || (repeat = atoi(argv[i])) <= 0) goto invalid_arg;
+
+			} else if(strcmp(argv[i], "-submitters") == 0) {
+				submitters = 1;
+
+			} else if(strcmp(argv[i], "-ws") == 0) {
+				flags |= ASS_TPOOL_WORKSTEAL;
+
+			} else if(strcmp(argv[i], "-help") == 0 || strcmp(argv[i], "-h") == 0) {
+				print_usage(argv[0]);
+				return 0;
+
+			} else {
+				fprintf(stderr, "invalid option: %s\n", argv[i]);
+				return 1;
+			}
+		} else {
+			fprintf(stderr, "unexpected argument: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if(submitters) {
+		return run_contention(nthr ? nthr : 4, njobs ? njobs : 400000, flags, repeat);
+	}
+	if(!njobs) njobs = 200000;
+
+	printf("%d processors, %s queues, best of %d runs\n", ass_tpool_num_processors(),
+			flags & ASS_TPOOL_WORKSTEAL ? "work-stealing" : "shared", repeat);
+	printf("threads   flat jobs/s   fanout jobs/s\n");
+
+	for(i=0; i<(int)(sizeof def_threads / sizeof *def_threads); i++) {
+		int n = nthr ? nthr : def_threads[i];
+
+		if(!(tp = ass_tpool_create_flags(n, flags))) {
+			fprintf(stderr, "failed to create a pool of %d threads\n", n);
+			return 1;
+		}
+		flat = fanout = 0.0;
+		for(j=0; j<repeat; j++) {
+			if((rate = run_flat(tp, njobs)) > flat) flat = rate;
+			if((rate = run_fanout(tp, depth)) > fanout) fanout = rate;
+		}
+		ass_tpool_destroy(tp);
+
+		printf("%7d   %11.0f   %13.0f\n", n, flat, fanout);
+		if(nthr) break;
+	}
+	return 0;
+
+invalid_arg:
+	fprintf(stderr, "%s must be followed by a valid number\n", argv[i - 1]);
+	return 1;
+}
+
+void print_usage(const char *argv0)
+{
+	printf("Usage: %s [options]\n", argv0);
+	printf("Options:\n");
+	printf(" -t <n>         only run with n worker threads (default: 1 to 64)\n");
+	printf(" -jobs <n>      number of jobs in the flat test (default 200000), or the\n");
+	printf("                contention test (default 400000)\n");
+	printf(" -depth <n>     depth of the fanout tree (default 9: 349525 jobs)\n");
+	printf(" -repeat <n>    runs per thread count, the best one is reported (default 3)\n");
+	printf(" -submitters    run the contention test instead, -t sets the workers (default 4)\n");
+	printf(" -ws            use per-worker queues with work stealing (ASS_TPOOL_WORKSTEAL)\n");
+	printf(" -h,-help       print usage and exit\n");
+	printf("\nMeasures thread pool overhead with empty jobs, in jobs per second.\n");
+	printf(" flat:   all jobs are enqueued by the main thread, then it waits for them\n");
+	printf(" fanout: a tree of jobs, each one enqueues %d more from its worker thread\n", FANOUT);
+	printf(" contention: the jobs are split between 1 to 64 threads enqueueing at once\n");
+}
+
+/* the main thread enqueues all the jobs */
+static double run_flat(struct thread_pool *tp, int njobs)
+{
+	int i;
+	double t0 = get_time();
+
+	for(i=0; i<njobs; i++) {
+		ass_tpool_enqueue(tp, 0, empty_work, 0);
+	}
+	ass_tpool_wait(tp);
+	return njobs / (get_time() - t0);
+}
+
+/* the workers enqueue the jobs, as they run their parents */
+static double run_fanout(struct thread_pool *tp, int depth)
+{
+	double t0 = get_time();
+
+	pool = tp;
+	fanout_jobs = 0;
+	ass_tpool_enqueue(tp, (void*)(intptr_t)depth, fanout_work, 0);
+	ass_tpool_wait(tp);
+	return fanout_jobs / (get_time() - t0);
+}
+
+/* njobs split between a varying number of threads, all enqueueing at once */
+static int run_contention(int nworkers, int njobs, unsigned int flags, int repeat)
+{
+	static const int def_submitters[] = {1, 2, 4, 8, 16, 32, 64};
+	int i, j;
+	double best, rate;
+	struct thread_pool *tp;
+
+	if(!(tp = ass_tpool_create_flags(nworkers, flags))) {
+		fprintf(stderr, "failed to create a pool of %d threads\n", nworkers);
+		return 1;
+	}
+	printf("%d processors, %d workers, %s queues, %d jobs, best of %d runs\n",
+			ass_tpool_num_processors(), nworkers, flags & ASS_TPOOL_WORKSTEAL ?
+			"work-stealing" : "shared", njobs, repeat);
+	printf("submitters   jobs/s\n");
+
+	for(i=0; i<(int)(sizeof def_submitters / sizeof *def_submitters); i++) {
+		best = 0.0;
+		for(j=0; j<repeat; j++) {
+			if((rate = contention(tp, def_submitters[i], njobs)) < 0.0) {
+				ass_tpool_destroy(tp);
+				return 1;
+			}
+			if(rate > best) best = rate;
+		}
+		printf("%10d   %6.0f\n", def_submitters[i], best);
+	}
+	ass_tpool_destroy(tp);
+	return 0;
+}
+
+static double contention(struct thread_pool *tp, int nsub, int njobs)
+{
+	int i;
+	pthread_t thr[64];
+	double t0;
+
+	pool = tp;
+	jobs_per_thread = njobs / nsub;
+	start_flag = 0;
+	for(i=0; i<nsub; i++) {
+		if(pthread_create(thr + i, 0, submit_thread, 0) != 0) {
+			fprintf(stderr, "failed to create submitting thread\n");
+			return -1.0;
+		}
+	}
+
+	t0 = get_time();
+	pthread_mutex_lock(&start_lock);
+	start_flag = 1;
+	pthread_cond_broadcast(&start_cond);
+	pthread_mutex_unlock(&start_lock);
+
+	for(i=0; i<nsub; i++) {
+		pthread_join(thr[i], 0);
+	}
+	ass_tpool_wait(tp);
+	return jobs_per_thread * nsub / (get_time() - t0);
+}
+
+static void *submit_thread(void *cls)
+{
+	int i;
+
+	pthread_mutex_lock(&start_lock);
+	while(!start_flag) {
+		pthread_cond_wait(&start_cond, &start_lock);
+	}
+	pthread_mutex_unlock(&start_lock);
+
+	for(i=0; i<jobs_per_thread; i++) {
+		ass_tpool_enqueue(pool, 0, empty_work, 0);
+	}
+	return 0;
+}
+
+static void empty_work(void *cls)
+{
+}
+
+static void fanout_work(void *cls)
+{
+	int i, depth = (intptr_t)cls;
+
+	__atomic_add_fetch(&fanout_jobs, 1, __ATOMIC_RELAXED);
+	if(depth > 0) {
+		for(i=0; i<FANOUT; i++) {
+			ass_tpool_enqueue(pool, (void*)(intptr_t)(depth - 1), fanout_work, 0);
+		}
+	}
+}
+
+static double get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "tpool.h"
+
+#define CHECK(x) \
+	do { \
+		if(!(x)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+			failed = 1; \
+		} \
+	} while(0)
+
+static int test_prio(unsigned int flags);
+static int test_cancel(unsigned int flags);
+static int test_deps(unsigned int flags);
+static int test_stress(unsigned int flags);
+static void block_worker(struct thread_pool *tp);
+static struct tpool_job *submit_gate(struct thread_pool *tp);
+static void unblock_worker(void);
+static void gate_work(void *cls);
+static void record_work(void *cls);
+static void count_work(void *cls);
+static void *stress_thread(void *cls);
+
+static pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static int gate_open, gate_entered;
+
+/* order in which record_work jobs ran */
+static int order[64];
+static int num_order;
+static pthread_mutex_t order_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int counter;
+
+int main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		int (*func)(unsigned int);
+	} tests[] = {
+		{"priorities", test_prio},
+		{"cancellation", test_cancel},
+		{"dependencies", test_deps},
+		{"stress", test_stress}
+	};
+	int i, j, res = 0;
+	unsigned int flags[] = {0, ASS_TPOOL_WORKSTEAL};
+
+	for(i=0; i<2; i++) {
+		for(j=0; j<(int)(sizeof tests / sizeof *tests); j++) {
+			if(argc > 1 && strcmp(argv[1], tests[j].name) != 0) {
+				continue;
+			}
+			printf("%-14s %-14s ", tests[j].name, flags[i] ? "work-stealing" : "shared");
+			fflush(stdout);
+			if(tests[j].func(flags[i]) == -1) {
+				printf("FAILED\n");
+				res = 1;
+			} else {
+				printf("ok\n");
+			}
+		}
+	}
+	return res;
+}
+
+/* with the single worker busy, jobs queued in mixed priorities must run
+ * highest priority first, and in submission order within each priority
+ */
+static int test_prio(unsigned int flags)
+{
+	static const int prio[] = {
+		ASS_TPOOL_PRIO_LOW, ASS_TPOOL_PRIO_IDLE, ASS_TPOOL_PRIO_NORMAL, ASS_TPOOL_PRIO_HIGH,
+		ASS_TPOOL_PRIO_LOW, ASS_TPOOL_PRIO_HIGH, ASS_TPOOL_PRIO_NORMAL, ASS_TPOOL_PRIO_IDLE
+	};
+	int i, failed = 0, num = sizeof prio / sizeof *prio;
+	struct thread_pool *tp;
+	struct tpool_job *raised;
+
+	if(!(tp = ass_tpool_create_flags(1, flags))) return -1;
+	num_order = 0;
+
+	block_worker(tp);
+	for(i=0; i<num; i++) {
+		CHECK(ass_tpool_enqueue_prio(tp, (void*)(intptr_t)i, record_work, 0, prio[i]) == 0);
+	}
+	/* raised after it was queued, it goes behind the high priority jobs */
+	raised = ass_tpool_submit(tp, (void*)(intptr_t)num, record_work, 0, ASS_TPOOL_PRIO_IDLE);
+	CHECK(raised && ass_tpool_set_prio(tp, raised, ASS_TPOOL_PRIO_HIGH) == 0);
+	unblock_worker();
+	ass_tpool_wait(tp);
+
+	CHECK(num_order == num + 1);
+	if(num_order == num + 1) {
+		static const int expect[] = {3, 5, 8, 2, 6, 0, 4, 1, 7};
+		for(i=0; i<num_order; i++) {
+			CHECK(order[i] == expect[i]);
+		}
+	}
+	CHECK(ass_tpool_set_prio(tp, raised, ASS_TPOOL_PRIO_LOW) == -1);
+	ass_tpool_job_release(raised);
+	ass_tpool_destroy(tp);
+	return failed ? -1 : 0;
+}
+
+/* cancelled jobs never run, running and finished jobs can't be cancelled */
+static int test_cancel(unsigned int flags)
+{
+	int i, failed = 0;
+	struct thread_pool *tp;
+	struct tpool_job *jobs[16], *gate;
+
+	if(!(tp = ass_tpool_create_flags(1, flags))) return -1;
+	num_order = 0;
+
+	gate = submit_gate(tp);
+	CHECK(ass_tpool_cancel(tp, gate) == -1);	/* running */
+
+	for(i=0; i<16; i++) {
+		jobs[i] = ass_tpool_submit(tp, (void*)(intptr_t)i, record_work, 0, i & 3);
+		CHECK(jobs[i] != 0);
+	}
+	for(i=0; i<16; i+=2) {
+		CHECK(ass_tpool_cancel(tp, jobs[i]) == 0);
+		CHECK(ass_tpool_job_done(jobs[i]));
+	}
+	CHECK(ass_tpool_cancel(tp, jobs[0]) == -1);	/* already cancelled */
+	CHECK(ass_tpool_pending_jobs(tp) == 9);
+
+	unblock_worker();
+	for(i=0; i<16; i++) {
+		CHECK(ass_tpool_job_wait(jobs[i]) == (i & 1 ? 0 : -1));
+		CHECK(ass_tpool_cancel(tp, jobs[i]) == -1);
+	}
+	CHECK(ass_tpool_job_wait(gate) == 0);
+	ass_tpool_wait(tp);
+
+	CHECK(num_order == 8);
+	for(i=0; i<num_order; i++) {
+		CHECK(order[i] & 1);
+	}
+	for(i=0; i<16; i++) {
+		ass_tpool_job_release(jobs[i]);
+	}
+	ass_tpool_job_release(gate);
+	ass_tpool_destroy(tp);
+	return failed ? -1 : 0;
+}
+
+/* a diamond a -> b,c -> d runs in dependency order, and cancelling a job
+ * cancels everything which depends on it, directly or not
+ */
+static int test_deps(unsigned int flags)
+{
+	int i, j, failed = 0, pos[4];
+	struct thread_pool *tp;
+	struct tpool_job *a, *b, *c, *d, *deps[2], *gate;
+
+	if(!(tp = ass_tpool_create_flags(4, flags))) return -1;
+
+	for(i=0; i<100; i++) {
+		num_order = 0;
+		a = ass_tpool_submit(tp, (void*)0, record_work, 0, ASS_TPOOL_PRIO_LOW);
+		b = ass_tpool_submit_after(tp, (void*)1, record_work, 0, ASS_TPOOL_PRIO_HIGH, &a, 1);
+		deps[0] = a;
+		deps[1] = 0;	/* ignored */
+		c = ass_tpool_submit_after(tp, (void*)2, record_work, 0, ASS_TPOOL_PRIO_NORMAL, deps, 2);
+		deps[0] = b;
+		deps[1] = c;
+		d = ass_tpool_submit_after(tp, (void*)3, record_work, 0, ASS_TPOOL_PRIO_HIGH, deps, 2);
+		CHECK(a && b && c && d);
+
+		CHECK(ass_tpool_job_wait(d) == 0);
+		CHECK(num_order == 4);
+		for(j=0; j<num_order; j++) {
+			pos[order[j]] = j;
+		}
+		CHECK(pos[0] == 0 && pos[3] == 3);
+
+		ass_tpool_job_release(a);
+		ass_tpool_job_release(b);
+		ass_tpool_job_release(c);
+		ass_tpool_job_release(d);
+		if(failed) break;
+	}
+
+	/* cancellation propagates down the chain. The chain waits for a gate job,
+	 * so that none of it can start before the cancel.
+	 */
+	num_order = 0;
+	gate = submit_gate(tp);
+	a = ass_tpool_submit_after(tp, (void*)0, record_work, 0, ASS_TPOOL_PRIO_NORMAL, &gate, 1);
+	b = ass_tpool_submit_after(tp, (void*)1, record_work, 0, ASS_TPOOL_PRIO_NORMAL, &a, 1);
+	c = ass_tpool_submit_after(tp, (void*)2, record_work, 0, ASS_TPOOL_PRIO_NORMAL, &b, 1);
+	CHECK(ass_tpool_cancel(tp, a) == 0);
+	d = ass_tpool_submit_after(tp, (void*)3, record_work, 0, ASS_TPOOL_PRIO_NORMAL, &c, 1);
+	unblock_worker();
+	CHECK(ass_tpool_job_wait(gate) == 0);
+	CHECK(ass_tpool_job_wait(a) == -1);
+	CHECK(ass_tpool_job_wait(b) == -1);
+	CHECK(ass_tpool_job_wait(c) == -1);
+	CHECK(!d || ass_tpool_job_wait(d) == -1);
+	ass_tpool_wait(tp);
+	CHECK(num_order == 0);
+	ass_tpool_job_release(a);
+	ass_tpool_job_release(b);
+	ass_tpool_job_release(c);
+	ass_tpool_job_release(d);
+	ass_tpool_job_release(gate);
+
+	ass_tpool_destroy(tp);
+	return failed ? -1 : 0;
+}
+
+#define STRESS_THREADS	8
+#define STRESS_JOBS		20000
+
+/* several threads submit, chain, cancel and reprioritize jobs at once. Every
+ * job must either run exactly once or be cancelled, never both. Meant to be
+ * run under the thread sanitizer (make tsan).
+ */
+static int test_stress(unsigned int flags)
+{
+	int i, failed = 0, ran[STRESS_THREADS], total = 0;
+	pthread_t thr[STRESS_THREADS];
+	struct thread_pool *tp;
+	void *res;
+
+	if(!(tp = ass_tpool_create_flags(4, flags))) return -1;
+	counter = 0;
+
+	for(i=0; i<STRESS_THREADS; i++) {
+		pthread_create(thr + i, 0, stress_thread, tp);
+	}
+	for(i=0; i<STRESS_THREADS; i++) {
+		pthread_join(thr[i], &res);
+		ran[i] = (intptr_t)res;
+		total += ran[i];
+	}
+	ass_tpool_wait(tp);
+	CHECK(ass_tpool_pending_jobs(tp) == 0);
+	CHECK(counter == total);
+	ass_tpool_destroy(tp);
+	return failed ? -1 : 0;
+}
+
+/* returns how many of its jobs ran */
+static void *stress_thread(void *cls)
+{
+	struct thread_pool *tp = cls;
+	struct tpool_job *prev = 0, *job;
+	int i, nran = 0, cancelled;
+	unsigned int seed = (uintptr_t)&prev;
+
+	for(i=0; i<STRESS_JOBS; i++) {
+		if(prev && rand_r(&seed) % 4 == 0) {
+			job = ass_tpool_submit_after(tp, 0, count_work, 0, rand_r(&seed) % ASS_TPOOL_NUM_PRIO, &prev, 1);
+		} else {
+			job = ass_tpool_submit(tp, 0, count_work, 0, rand_r(&seed) % ASS_TPOOL_NUM_PRIO);
+		}
+		if(!job) continue;
+
+		switch(rand_r(&seed) % 8) {
+		case 0:
+			ass_tpool_cancel(tp, job);
+			break;
+		case 1:
+			ass_tpool_set_prio(tp, job, rand_r(&seed) % ASS_TPOOL_NUM_PRIO);
+			break;
+		default:
+			break;
+		}
+
+		if(prev) {
+			cancelled = ass_tpool_job_wait(prev) == -1;
+			nran += !cancelled;
+			ass_tpool_job_release(prev);
+		}
+		prev = job;
+	}
+	if(prev) {
+		nran += ass_tpool_job_wait(prev) == 0;
+		ass_tpool_job_release(prev);
+	}
+	return (void*)(intptr_t)nran;
+}
+
+/* occupies the worker of a single-thread pool until unblock_worker, so that
+ * jobs queued meanwhile are all waiting in the queue
+ */
+static void block_worker(struct thread_pool *tp)
+{
+	ass_tpool_job_release(submit_gate(tp));
+}
+
+/* submits a job which blocks its worker until unblock_worker, and returns
+ * once it's running
+ */
+static struct tpool_job *submit_gate(struct thread_pool *tp)
+{
+	struct tpool_job *job;
+
+	gate_open = gate_entered = 0;
+	if(!(job = ass_tpool_submit(tp, 0, gate_work, 0, ASS_TPOOL_PRIO_HIGH))) {
+		fprintf(stderr, "failed to submit gate job\n");
+		abort();
+	}
+
+	pthread_mutex_lock(&gate_lock);
+	while(!gate_entered) {
+		pthread_cond_wait(&gate_cond, &gate_lock);
+	}
+	pthread_mutex_unlock(&gate_lock);
+	return job;
+}
+
+static void unblock_worker(void)
+{
+	pthread_mutex_lock(&gate_lock);
+	gate_open = 1;
+	pthread_cond_broadcast(&gate_cond);
+	pthread_mutex_unlock(&gate_lock);
+}
+
+static void gate_work(void *cls)
+{
+	pthread_mutex_lock(&gate_lock);
+	gate_entered = 1;
+	pthread_cond_broadcast(&gate_cond);
+	while(!gate_open) {
+		pthread_cond_wait(&gate_cond, &gate_lock);
+	}
+	pthread_mutex_unlock(&gate_lock);
+}
+
+static void record_work(void *cls)
+{
+	pthread_mutex_lock(&order_lock);
+	if(num_order < (int)(sizeof order / sizeof *order)) {
+		order[num_order++] = (intptr_t)cls;
+	}
+	pthread_mutex_unlock(&order_lock);
+}
+
+static void count_work(void *cls)
+{
+	__atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+}
@@ -19,38 +19,210 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "assfile_impl.h"
+#include "tpool.h"
 
 int ass_errno;
 
 /* declared in assfile_impl.h */
-int ass_mod_url_max_threads;
+int ass_num_threads = 8;
 char ass_mod_url_cachedir[512];
+int ass_mod_url_cache_max_mb;
+int ass_mod_url_cache_max_files;
+int ass_mod_url_mem_threshold = 65536;
+int ass_mod_url_mem_max_kb = 16384;
+int ass_mod_url_preconnect;
+int ass_mod_url_hedge_ms;
+int ass_mod_url_prefetch_kbps;
+int ass_block_cache_max_kb = 16384;
 int ass_verbose;
 
 static int add_fop(const char *prefix, int type, struct ass_fileops *fop);
+static struct mount *add_mount(const char *prefix, int type, struct ass_fileops *fop);
+static int add_lazy(const char *prefix, int type, const char **args, int num_args);
+static int finish_lazy(struct mount *m);
+static void load_lazy(struct mount *m);
+static void lazy_job(void *cls);
+static void free_lazy(struct mount *m);
 static const char *match_prefix(const char *str, const char *prefix);
 static void upd_verbose_flag(void);
+static void reg_cleanup(void);
+static void release_thread_pool(void);
+static void *read_all(ass_file *fp, long *size);
+static void trace_open(const char *fname);
+static void init_trace_env(void);
+static void close_trace(void);
 
-#define DEF_FLAGS	(1 << ASS_OPEN_FALLTHROUGH)
+#define DEF_FLAGS	((1 << ASS_OPEN_FALLTHROUGH) | (1 << ASS_URL_WRITEBEHIND) | (1 << ASS_URL_COMPRESSION))
 
 static unsigned int assflags = DEF_FLAGS;
 static struct mount *mlist;
 
+static struct thread_pool *tpool;
+static pthread_mutex_t tpool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int lazy_mount_mode = ASS_MOUNT_NOW;
+
+/* arguments of a mount which hasn't been loaded yet */
+struct lazy_mount {
+	pthread_mutex_t lock;
+	int done;
+	char **args;		/* archive or pack path, or urls */
+	int num_args;
+	char **patches;		/* ass_add_patch calls before it was loaded */
+	int num_patches;
+	struct tpool_job *job;		/* ASS_MOUNT_BACKGROUND */
+	struct thread_pool *tpool;
+};
+
+/* access trace, see ass_trace. trace_fp is only changed with trace_lock held,
+ * but ass_fopen checks it without locking, so that opens don't contend on
+ * trace_lock unless tracing is enabled.
+ */
+static FILE *trace_fp;
+static int trace_overridden;
+static pthread_once_t trace_env_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void ass_set_option(int opt, int val)
 {
-	if(val) {
-		assflags |= 1 << opt;
-	} else {
-		assflags &= ~(1 << opt);
+	switch(opt) {
+	case ASS_URL_CACHE_SIZE:
+		ass_mod_url_cache_max_mb = val;
+		break;
+
+	case ASS_URL_CACHE_FILES:
+		ass_mod_url_cache_max_files = val;
+		break;
+
+	case ASS_URL_MEM_THRESHOLD:
+		ass_mod_url_mem_threshold = val;
+		break;
+
+	case ASS_URL_MEM_SIZE:
+		ass_mod_url_mem_max_kb = val;
+		break;
+
+	case ASS_NUM_THREADS:
+		ass_num_threads = val;
+		break;
+
+	case ASS_URL_PRECONNECT:
+		ass_mod_url_preconnect = val;
+		break;
+
+	case ASS_URL_HEDGE:
+		ass_mod_url_hedge_ms = val;
+		break;
+
+	case ASS_URL_PREFETCH_RATE:
+		ass_mod_url_prefetch_kbps = val;
+		break;
+
+	case ASS_BLOCK_CACHE_SIZE:
+		ass_block_cache_max_kb = val;
+		break;
+
+	case ASS_LAZY_MOUNT:
+		lazy_mount_mode = val;
+		break;
+
+	default:
+		if(val) {
+			assflags |= 1 << opt;
+		} else {
+			assflags &= ~(1 << opt);
+		}
 	}
 }
 
 int ass_get_option(int opt)
 {
+	switch(opt) {
+	case ASS_URL_CACHE_SIZE:
+		return ass_mod_url_cache_max_mb;
+
+	case ASS_URL_CACHE_FILES:
+		return ass_mod_url_cache_max_files;
+
+	case ASS_URL_MEM_THRESHOLD:
+		return ass_mod_url_mem_threshold;
+
+	case ASS_URL_MEM_SIZE:
+		return ass_mod_url_mem_max_kb;
+
+	case ASS_NUM_THREADS:
+		return ass_num_threads;
+
+	case ASS_URL_PRECONNECT:
+		return ass_mod_url_preconnect;
+
+	case ASS_URL_HEDGE:
+		return ass_mod_url_hedge_ms;
+
+	case ASS_URL_PREFETCH_RATE:
+		return ass_mod_url_prefetch_kbps;
+
+	case ASS_BLOCK_CACHE_SIZE:
+		return ass_block_cache_max_kb;
+
+	case ASS_LAZY_MOUNT:
+		return lazy_mount_mode;
+
+	default:
+		break;
+	}
 	return assflags & (1 << opt);
 }
 
+void ass_set_thread_pool(struct thread_pool *tp)
+{
+	pthread_mutex_lock(&tpool_lock);
+	if(tp) {
+		ass_tpool_addref(tp);
+	}
+	if(tpool) {
+		ass_tpool_release(tpool);
+	}
+	tpool = tp;
+	reg_cleanup();
+	pthread_mutex_unlock(&tpool_lock);
+}
+
+struct thread_pool *ass_get_thread_pool(void)
+{
+	struct thread_pool *tp;
+
+	pthread_mutex_lock(&tpool_lock);
+	if(!tpool) {
+		/* the creation reference becomes ours */
+		if((tpool = ass_tpool_create(ass_num_threads))) {
+			ass_tpool_set_name(tpool, "assfile");
+			reg_cleanup();
+		}
+	}
+	tp = tpool;
+	pthread_mutex_unlock(&tpool_lock);
+	return tp;
+}
+
+static void reg_cleanup(void)
+{
+	static int done;
+
+	if(!done) {
+		atexit(release_thread_pool);
+		done = 1;
+	}
+}
+
+static void release_thread_pool(void)
+{
+	ass_set_thread_pool(0);
+}
+
 int ass_add_path(const char *prefix, const char *path)
 {
 	return add_fop(prefix, MOD_PATH, ass_alloc_path(path));
@@ -58,12 +230,114 @@ int ass_add_path(const char *prefix, const char *path)
 
 int ass_add_archive(const char *prefix, const char *arfile)
 {
+	if(lazy_mount_mode != ASS_MOUNT_NOW) {
+		return add_lazy(prefix, MOD_ARCHIVE, &arfile, 1);
+	}
 	return add_fop(prefix, MOD_ARCHIVE, ass_alloc_archive(arfile));
 }
 
+int ass_add_pack(const char *prefix, const char *packfile)
+{
+	if(lazy_mount_mode != ASS_MOUNT_NOW) {
+		return add_lazy(prefix, MOD_PACK, &packfile, 1);
+	}
+	return add_fop(prefix, MOD_PACK, ass_alloc_pack(packfile));
+}
+
+int ass_add_patch(const char *prefix, const char *patchfile)
+{
+	struct mount *m = mlist;
+	struct ass_fileops *fop;
+
+	upd_verbose_flag();
+
+	/* the latest mount with the same prefix */
+	while(m) {
+		if(m->prefix ? prefix && strcmp(m->prefix, prefix) == 0 : !prefix) {
+			break;
+		}
+		m = m->next;
+	}
+	if(!m || (m->type != MOD_ARCHIVE && m->type != MOD_PACK && m->type != MOD_PATCH)) {
+		fprintf(stderr, "assfile: ass_add_patch: no archive or pack mount with prefix: %s\n",
+				prefix ? prefix : "<none>");
+		return -1;
+	}
+
+	if(m->lazy) {
+		struct lazy_mount *lz = m->lazy;
+		struct stat st;
+		char **tmp;
+		int res = 0;
+
+		pthread_mutex_lock(&lz->lock);
+		if(!lz->done) {
+			/* not loaded yet, the patch is applied when it is */
+			if(stat(patchfile, &st) == -1) {
+				fprintf(stderr, "assfile: ass_add_patch: %s: %s\n", patchfile, strerror(errno));
+				res = -1;
+			} else if(!(tmp = realloc(lz->patches, (lz->num_patches + 1) * sizeof *tmp)) ||
+					!(tmp[lz->num_patches] = strdup(patchfile))) {
+				if(tmp) lz->patches = tmp;
+				perror("assfile: ass_add_patch: failed to allocate memory");
+				res = -1;
+			} else {
+				lz->patches = tmp;
+				lz->num_patches++;
+			}
+			pthread_mutex_unlock(&lz->lock);
+			return res;
+		}
+		pthread_mutex_unlock(&lz->lock);
+		if(!m->fop) {
+			return -1;	/* failed to load */
+		}
+	}
+
+	if(m->type != MOD_PATCH) {
+		/* the base becomes the bottom layer of a patch mount */
+		if(!(fop = ass_alloc_patch(m->type, m->fop))) {
+			return -1;
+		}
+		m->fop = fop;
+		m->type = MOD_PATCH;
+	}
+	return ass_add_patch_layer(m->fop, patchfile);
+}
+
 int ass_add_url(const char *prefix, const char *url)
 {
-	return add_fop(prefix, MOD_URL, ass_alloc_url(url));
+	return ass_add_url_mirrors(prefix, &url, 1);
+}
+
+int ass_add_url_mirrors(const char *prefix, const char **urls, int count)
+{
+	if(lazy_mount_mode != ASS_MOUNT_NOW) {
+		return add_lazy(prefix, MOD_URL, urls, count);
+	}
+	return add_fop(prefix, MOD_URL, ass_alloc_url(urls, count));
+}
+
+int ass_url_prefetch(const char *prefix, const char *manifest)
+{
+	struct mount *m = mlist;
+
+	while(m) {
+		if(m->type == MOD_URL && (m->prefix ? prefix && strcmp(m->prefix, prefix) == 0 : !prefix)) {
+			if(m->lazy && finish_lazy(m) == -1) {
+				return -1;
+			}
+			return ass_prefetch_url(m->fop, manifest);
+		}
+		m = m->next;
+	}
+	fprintf(stderr, "assfile: ass_url_prefetch: no url mount with prefix: %s\n", prefix ? prefix : "<none>");
+	return -1;
+}
+
+int ass_url_prefetch_wait(void)
+{
+	return ass_prefetch_url_wait();
 }
 
 int ass_add_user(const char *prefix, struct ass_fileops *fop)
@@ -73,23 +347,27 @@ int ass_add_user(const char *prefix, struct ass_fileops *fop)
 
 static int add_fop(const char *prefix, int type, struct ass_fileops *fop)
 {
-	struct mount *m;
-
 	upd_verbose_flag();
 
 	if(!fop) {
 		fprintf(stderr, "assfile: failed to allocate asset source\n");
 		return -1;
 	}
+	return add_mount(prefix, type, fop) ? 0 : -1;
+}
+
+static struct mount *add_mount(const char *prefix, int type, struct ass_fileops *fop)
+{
+	struct mount *m;
 
 	if(!(m = malloc(sizeof *m))) {
 		perror("assfile: failed to allocate mount node");
-		return -1;
+		return 0;
 	}
 	if(prefix) {
 		if(!(m->prefix = malloc(strlen(prefix) + 1))) {
 			free(m);
-			return -1;
+			return 0;
 		}
 		strcpy(m->prefix, prefix);
 	} else {
@@ -97,10 +375,151 @@ static int add_fop(const char *prefix, int type, struct ass_fileops *fop)
 	}
 	m->fop = fop;
 	m->type = type;
+	m->lazy = 0;
 
 	m->next = mlist;
 	mlist = m;
+	return m;
+}
+
+/* adds a mount without loading it, see ASS_LAZY_MOUNT */
+static int add_lazy(const char *prefix, int type, const char **args, int num_args)
+{
+	int i;
+	struct mount *m;
+	struct lazy_mount *lz;
+	struct thread_pool *tp;
+	struct stat st;
+
+	upd_verbose_flag();
+
+	/* missing files at least can be reported right away */
+	if(type != MOD_URL && stat(args[0], &st) == -1) {
+		fprintf(stderr, "assfile: failed to mount %s: %s\n", args[0], strerror(errno));
+		ass_errno = errno;
+		return -1;
+	}
+
+	if(!(lz = calloc(1, sizeof *lz)) || !(lz->args = calloc(num_args, sizeof *lz->args))) {
+		perror("assfile: failed to allocate lazy mount");
+		free(lz);
+		return -1;
+	}
+	for(i=0; i<num_args; i++) {
+		if(!(lz->args[i] = strdup(args[i]))) {
+			perror("assfile: failed to allocate lazy mount");
+			goto err;
+		}
+		lz->num_args++;
+	}
+	pthread_mutex_init(&lz->lock, 0);
+
+	if(!(m = add_mount(prefix, type, 0))) {
+		pthread_mutex_destroy(&lz->lock);
+		goto err;
+	}
+	m->lazy = lz;
+
+	if(lazy_mount_mode == ASS_MOUNT_BACKGROUND && (tp = ass_get_thread_pool())) {
+		if((lz->job = ass_tpool_submit(tp, m, lazy_job, 0, ASS_TPOOL_PRIO_LOW))) {
+			lz->tpool = tp;
+			ass_tpool_addref(tp);
+		}
+	}
 	return 0;
+
+err:
+	for(i=0; i<lz->num_args; i++) {
+		free(lz->args[i]);
+	}
+	free(lz->args);
+	free(lz);
+	return -1;
+}
+
+/* loads a lazy mount, if it hasn't been loaded yet. Whichever gets here first
+ * of ass_fopen or the background job loads it, and the other waits for it.
+ * Returns -1 if it failed to load.
+ */
+static int finish_lazy(struct mount *m)
+{
+	struct lazy_mount *lz = m->lazy;
+
+	pthread_mutex_lock(&lz->lock);
+	if(!lz->done) {
+		load_lazy(m);
+		lz->done = 1;
+	}
+	pthread_mutex_unlock(&lz->lock);
+	return m->fop ? 0 : -1;
+}
+
+static void load_lazy(struct mount *m)
+{
+	int i;
+	struct lazy_mount *lz = m->lazy;
+	struct ass_fileops *fop, *pfop;
+
+	switch(m->type) {
+	case MOD_ARCHIVE:
+		fop = ass_alloc_archive(lz->args[0]);
+		break;
+	case MOD_PACK:
+		fop = ass_alloc_pack(lz->args[0]);
+		break;
+	case MOD_URL:
+		fop = ass_alloc_url((const char**)lz->args, lz->num_args);
+		break;
+	default:
+		fop = 0;
+	}
+	if(!fop) {
+		fprintf(stderr, "assfile: failed to load lazy mount: %s\n", lz->args[0]);
+		return;
+	}
+
+	if(lz->num_patches) {
+		if(!(pfop = ass_alloc_patch(m->type, fop))) {
+			fprintf(stderr, "assfile: failed to apply patches to lazy mount: %s\n", lz->args[0]);
+		} else {
+			fop = pfop;
+			m->type = MOD_PATCH;
+			for(i=0; i<lz->num_patches; i++) {
+				ass_add_patch_layer(fop, lz->patches[i]);
+			}
+		}
+	}
+	m->fop = fop;
+}
+
+static void lazy_job(void *cls)
+{
+	finish_lazy(cls);
+}
+
+static void free_lazy(struct mount *m)
+{
+	int i;
+	struct lazy_mount *lz = m->lazy;
+
+	if(lz->job) {
+		if(ass_tpool_cancel(lz->tpool, lz->job) == -1) {
+			ass_tpool_job_wait(lz->job);
+		}
+		ass_tpool_job_release(lz->job);
+		ass_tpool_release(lz->tpool);
+	}
+	for(i=0; i<lz->num_args; i++) {
+		free(lz->args[i]);
+	}
+	free(lz->args);
+	for(i=0; i<lz->num_patches; i++) {
+		free(lz->patches[i]);
+	}
+	free(lz->patches);
+	pthread_mutex_destroy(&lz->lock);
+	free(lz);
+	m->lazy = 0;
 }
 
 void ass_clear(void)
@@ -109,6 +528,13 @@ void ass_clear(void)
 		struct mount *m = mlist;
 		mlist = mlist->next;
 
+		if(m->lazy) {
+			free_lazy(m);
+			if(!m->fop) {
+				goto done;	/* never loaded, or failed to */
+			}
+		}
+
 		switch(m->type) {
 		case MOD_PATH:
 			ass_free_path(m->fop);
@@ -116,13 +542,21 @@ void ass_clear(void)
 		case MOD_ARCHIVE:
 			ass_free_archive(m->fop);
 			break;
+		case MOD_PACK:
+			ass_free_pack(m->fop);
+			break;
 		case MOD_URL:
 			ass_free_url(m->fop);
 			break;
+		case MOD_PATCH:
+			ass_free_patch(m->fop);
+			free(m->fop);
+			break;
 		default:
 			break;
 		}
 
+done:
 		free(m->prefix);
 		free(m);
 	}
@@ -131,6 +565,7 @@ void ass_clear(void)
 ass_file *ass_fopen(const char *fname, const char *mode)
 {
 	struct mount *m;
+	struct ass_fileops *fop;
 	void *mfile;
 	ass_file *file;
 	FILE *fp;
@@ -140,18 +575,25 @@ ass_file *ass_fopen(const char *fname, const char *mode)
 
 	m = mlist;
 	while(m) {
-		if((after_prefix = match_prefix(fname, m->prefix))) {
+		if((after_prefix = match_prefix(fname, m->prefix)) && (!m->lazy || finish_lazy(m) == 0)) {
 			while(*after_prefix && (*after_prefix == '/' || *after_prefix == '\\')) {
 				after_prefix++;
 			}
-			if((mfile = m->fop->open(after_prefix, m->fop->udata))) {
+			fop = m->fop;
+			if(m->type == MOD_PATCH) {
+				/* the file is opened from the layer with its newest version */
+				fop = ass_patch_lookup(m->fop, after_prefix);
+			}
+			if(fop && (mfile = fop->open(after_prefix, fop->udata))) {
 				if(!(file = malloc(sizeof *file))) {
 					perror("assfile: ass_fopen failed to allocate file structure");
-					m->fop->close(mfile, m->fop->udata);
+					fop->close(mfile, fop->udata);
 					return 0;
 				}
 				file->file = mfile;
-				file->fop = m->fop;
+				file->fop = fop;
+				file->map = 0;
+				trace_open(fname);
 				return file;
 			} else {
 				if(!(assflags & (1 << ASS_OPEN_FALLTHROUGH))) {
@@ -172,6 +614,8 @@ ass_file *ass_fopen(const char *fname, const char *mode)
 		}
 		file->file = fp;
 		file->fop = 0;
+		file->map = 0;
+		trace_open(fname);
 		return file;
 	}
 	ass_errno = errno;
@@ -197,6 +641,7 @@ void ass_fclose(ass_file *fp)
 	} else {
 		fclose(fp->file);
 	}
+	free(fp->map);
 	free(fp);
 }
 
@@ -260,6 +705,153 @@ char *ass_fgets(char *s, int size, ass_file *fp)
 	return ptr == s ? 0 : s;
 }
 
+void *ass_load(const char *fname, long *size)
+{
+	ass_file *fp;
+	void *buf;
+
+	if(!(fp = ass_fopen(fname, "rb"))) {
+		return 0;
+	}
+	buf = read_all(fp, size);
+	ass_fclose(fp);
+	return buf;
+}
+
+const void *ass_fmap(ass_file *fp, long *size)
+{
+	const void *ptr;
+	long sz, pos;
+
+	if(fp->map) {
+		if(size) *size = fp->map_size;
+		return fp->map;
+	}
+	if(fp->fop && (ptr = ass_map_pack(fp->fop, fp->file, &sz))) {
+		if(size) *size = sz;
+		return ptr;
+	}
+
+	/* no way to map it, make a copy instead */
+	if((pos = ass_ftell(fp)) == -1 || ass_fseek(fp, 0, SEEK_SET) == -1) {
+		return 0;
+	}
+	fp->map = read_all(fp, &fp->map_size);
+	ass_fseek(fp, pos, SEEK_SET);
+	if(fp->map && size) {
+		*size = fp->map_size;
+	}
+	return fp->map;
+}
+
+/* reads everything from the current position to the end of the file */
+static void *read_all(ass_file *fp, long *size)
+{
+	char *buf, *tmp;
+	long len = 0, max, start, rd;
+	int known = 0;
+
+	if((start = ass_ftell(fp)) >= 0 && (max = ass_fseek(fp, 0, SEEK_END)) >= start &&
+			ass_fseek(fp, start, SEEK_SET) == start) {
+		max -= start;
+		known = 1;
+	} else {
+		max = 0;	/* size unknown, read until EOF */
+	}
+	if(!(buf = malloc(max + 1))) {
+		ass_errno = ENOMEM;
+		return 0;
+	}
+
+	for(;;) {
+		if(len >= max) {
+			if(known) break;
+			max = max ? max * 2 : 65536;
+			if(!(tmp = realloc(buf, max + 1))) {
+				ass_errno = ENOMEM;
+				free(buf);
+				return 0;
+			}
+			buf = tmp;
+		}
+		if(!(rd = ass_fread(buf + len, 1, max - len, fp))) {
+			break;
+		}
+		len += rd;
+	}
+
+	buf[len] = 0;
+	if(size) *size = len;
+	return buf;
+}
+
+int ass_trace(const char *fname)
+{
+	int res = 0;
+	FILE *fp = 0;
+
+	if(fname && !(fp = fopen(fname, "w"))) {
+		fprintf(stderr, "assfile: failed to open trace file: %s: %s\n", fname, strerror(errno));
+		ass_errno = errno;
+		res = -1;
+	}
+
+	if(fp) {
+		/* keep the trace complete, even if the program doesn't exit cleanly */
+		setvbuf(fp, 0, _IOLBF, 0);
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	trace_overridden = 1;	/* overrides ASSFILE_TRACE */
+	if(trace_fp) {
+		fclose(trace_fp);
+	}
+	__atomic_store_n(&trace_fp, fp, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_lock);
+	return res;
+}
+
+static void trace_open(const char *fname)
+{
+	pthread_once(&trace_env_once, init_trace_env);
+	if(!__atomic_load_n(&trace_fp, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	if(trace_fp) {
+		fprintf(trace_fp, "%s\n", fname);
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void init_trace_env(void)
+{
+	const char *env;
+	FILE *fp;
+
+	if(!(env = getenv("ASSFILE_TRACE")) || !*env) {
+		return;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	if(!trace_overridden) {	/* unless ass_trace was called first */
+		if((fp = fopen(env, "w"))) {
+			setvbuf(fp, 0, _IOLBF, 0);
+			__atomic_store_n(&trace_fp, fp, __ATOMIC_RELEASE);
+			atexit(close_trace);
+		} else {
+			fprintf(stderr, "assfile: failed to open trace file: %s: %s\n", env, strerror(errno));
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void close_trace(void)
+{
+	ass_trace(0);
+}
+
 
 static void upd_verbose_flag(void)
 {
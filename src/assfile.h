@@ -34,9 +34,45 @@ struct ass_fileops {
 
 /* options (ass_set_option/ass_get_option) */
 enum {
-	ASS_OPEN_FALLTHROUGH	/* try all matching handlers if the first fails to open the file */
+	ASS_OPEN_FALLTHROUGH,	/* try all matching handlers if the first fails to open the file */
+	ASS_URL_CACHE_SIZE,		/* mod_url disk cache budget in megabytes (default 0: unlimited) */
+	ASS_URL_CACHE_FILES,	/* mod_url disk cache budget in number of files (default 0: unlimited) */
+	ASS_URL_MEM_THRESHOLD,	/* mod_url files up to this size in bytes are kept in memory (default 64k) */
+	ASS_URL_MEM_SIZE,		/* mod_url in-memory cache budget in kilobytes (default 16mb) */
+	ASS_URL_WRITEBEHIND,	/* also write files kept in memory to the disk cache (default on) */
+	ASS_NUM_THREADS,		/* size of the library-wide I/O thread pool (default 8) */
+	ASS_URL_PRECONNECT,		/* mod_url connections to warm up in the background by ass_add_url (default 0) */
+	ASS_URL_HEDGE,			/* mod_url milliseconds to wait for a mirror to respond, before asking another (default 0: never) */
+	ASS_URL_OFFLINE,		/* mod_url serves files only from the cache, without network access (default off) */
+	ASS_URL_PREFETCH_RATE,	/* mod_url bandwidth cap for prefetching in kilobytes per second (default 0: unlimited) */
+	ASS_URL_COMPRESSION,	/* mod_url asks servers for compressed transfers (gzip, br, zstd) (default on) */
+	ASS_URL_CACHE_COMPRESSED,	/* mod_url keeps gzip transfers compressed in the disk cache, decoding on read (default off) */
+	ASS_BLOCK_CACHE_SIZE,	/* memory budget in kilobytes for decompressed archive/pack blocks (default 16mb, 0: no cache) */
+	ASS_LAZY_MOUNT			/* when archive, pack and url mounts are loaded, see below (default ASS_MOUNT_NOW) */
 };
 
+/* ASS_LAZY_MOUNT values. Lazy mounts only record their arguments when they're
+ * added, and are loaded by the first ass_fopen which matches their prefix.
+ * Background mounts also start loading on the thread pool right away, at low
+ * priority, and ass_fopen waits for them if they haven't finished. Failing to
+ * load is reported then, and the mount is skipped from then on, as if it had
+ * never been added.
+ */
+enum {
+	ASS_MOUNT_NOW,
+	ASS_MOUNT_ON_USE,
+	ASS_MOUNT_BACKGROUND
+};
+
+/* block cache counters, see ass_block_cache_stats */
+struct ass_cache_stats {
+	unsigned long hits, misses;	/* block lookups which found the block decompressed, or didn't */
+	unsigned long evictions;	/* blocks dropped to stay within the memory budget */
+	unsigned long size, count;	/* bytes and blocks currently in the cache */
+};
+
+struct thread_pool;	/* see tpool.h, installed as assfile_tpool.h */
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -46,13 +82,68 @@ extern int ass_errno;
 void ass_set_option(int opt, int val);
 int ass_get_option(int opt);
 
+/* all asynchronous work done by the library (downloads, cache maintenance,
+ * etc) runs on a single library-wide thread pool. By default it's created on
+ * first use, with ASS_NUM_THREADS threads. Applications with their own pool
+ * can pass it to ass_set_thread_pool instead, before adding any mounts; the
+ * library holds a reference to it (ass_tpool_addref) while it's in use.
+ */
+void ass_set_thread_pool(struct thread_pool *tpool);
+struct thread_pool *ass_get_thread_pool(void);
+
 /* add a handler for a specific path prefixes. 0 matches every path */
 int ass_add_path(const char *prefix, const char *path);
 int ass_add_archive(const char *prefix, const char *arfile);
+/* mount a pack file built with the asspack tool (see examples/asspack) */
+int ass_add_pack(const char *prefix, const char *packfile);
+/* mount a patch archive (tarball, zip or pack) over the archive or pack
+ * mounted last with the same prefix. Patches add and replace files, and
+ * delete them with whiteouts: an empty .wh.<name> file deletes <name> (and
+ * everything under it, for directories), and an empty .wh..wh..opq file
+ * deletes everything under its directory. Any number of patches can be
+ * stacked; they're merged into one index, so opening a file costs the same
+ * with or without them.
+ */
+int ass_add_patch(const char *prefix, const char *patchfile);
 int ass_add_url(const char *prefix, const char *url);
+/* like ass_add_url, with multiple mirrors serving the same files. Each request
+ * goes to the mirror which has been the fastest so far, and is retried on the
+ * next best if it fails. See also ASS_URL_HEDGE.
+ */
+int ass_add_url_mirrors(const char *prefix, const char **urls, int count);
+/* download all files listed in a manifest to the cache of the url mount
+ * added with the same prefix, in the background. The manifest is fetched
+ * through the mount, and has one line per file, with its size in bytes, the
+ * XXH64 hash (seed 0) of its contents as 16 lowercase hex digits, and its path
+ * relative to the mount. For instance, a file abc.txt containing "abc" is
+ * listed as: 3 44bc2cf5ad770999 abc.txt
+ * Sizes and hashes are of the file contents, even if the server sends them
+ * compressed. Files in the manifest are served from the cache from then on,
+ * if they are there. Returns the number of files queued for download, or -1
+ * on error. ass_url_prefetch_wait waits for all prefetch downloads to finish,
+ * and returns the number of files which failed.
+ */
+int ass_url_prefetch(const char *prefix, const char *manifest);
+int ass_url_prefetch_wait(void);
 int ass_add_user(const char *prefix, struct ass_fileops *cb);
 void ass_clear(void);
 
+/* compressed archive and pack entries are decompressed in blocks, which are
+ * kept in a cache shared by all open files, within the ASS_BLOCK_CACHE_SIZE
+ * budget. The counters are cumulative since the start of the program.
+ */
+void ass_block_cache_stats(struct ass_cache_stats *st);
+
+/* records the path of every file opened with ass_fopen to a text file, one
+ * per line, in the order they're opened, or stops recording if fname is
+ * null. Setting the ASSFILE_TRACE environment variable to a file name does
+ * the same from the first ass_fopen. Traces are used to lay out archives and
+ * packs with the files a program needs first at the start, and in order (see
+ * examples/asslayout and asspack -order). Returns -1 if the file can't be
+ * created.
+ */
+int ass_trace(const char *fname);
+
 ass_file *ass_fopen(const char *fname, const char *mode);
 void ass_fclose(ass_file *fp);
 long ass_fseek(ass_file *fp, long offs, int whence);
@@ -64,6 +155,23 @@ size_t ass_fread(void *buf, size_t size, size_t count, ass_file *fp);
 int ass_fgetc(ass_file *fp);
 char *ass_fgets(char *s, int size, ass_file *fp);
 
+/* loads a whole file into memory, with a single read where possible, which
+ * lets compressed pack entries decompress on all threads of the thread pool.
+ * Returns a buffer allocated with malloc, with a zero byte after the data,
+ * and stores the size of the data (without the zero) to size, if non-null.
+ * Returns null on failure.
+ */
+void *ass_load(const char *fname, long *size);
+
+/* returns a read-only pointer to the whole contents of an open file, valid
+ * until it's closed, and stores its size to size, if non-null. Uncompressed
+ * files in packs are not copied: the pointer is into the memory-mapped pack,
+ * and files with identical contents, which asspack stores only once, share
+ * the same pages. Anything else is read into a buffer, freed by ass_fclose.
+ * Returns null on failure.
+ */
+const void *ass_fmap(ass_file *fp, long *size);
+
 #ifdef __cplusplus
 }
 #endif
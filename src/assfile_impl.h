@@ -25,12 +25,18 @@ typedef struct ass_file ass_file;
 struct ass_file {
 	void *file;
 	struct ass_fileops *fop;
+	void *map;		/* ass_fmap copy of the whole file, if it couldn't be mapped */
+	long map_size;
 };
 
+struct lazy_mount;
+
 struct mount {
 	char *prefix;
 	struct ass_fileops *fop;
 	int type;
+	/* lazy mounts (see ASS_LAZY_MOUNT) have a null fop until they're loaded */
+	struct lazy_mount *lazy;
 
 	struct mount *next;
 };
@@ -38,20 +44,52 @@ struct mount {
 enum {
 	MOD_PATH,
 	MOD_ARCHIVE,
+	MOD_PACK,
 	MOD_URL,
-	MOD_USER
+	MOD_USER,
+	MOD_PATCH	/* archive or pack with patches over it, see mod_patch.c */
 };
 
+/* callback for listing the paths of all files in an archive or pack */
+typedef void (*ass_list_func)(const char *path, void *cls);
+
 /* implemented in mod_*.c files */
 struct ass_fileops *ass_alloc_path(const char *path);
 void ass_free_path(struct ass_fileops *fop);
 struct ass_fileops *ass_alloc_archive(const char *fname);
 void ass_free_archive(struct ass_fileops *fop);
-struct ass_fileops *ass_alloc_url(const char *url);
+void ass_list_archive(struct ass_fileops *fop, ass_list_func func, void *cls);
+struct ass_fileops *ass_alloc_pack(const char *fname);
+void ass_free_pack(struct ass_fileops *fop);
+void ass_list_pack(struct ass_fileops *fop, ass_list_func func, void *cls);
+/* returns a pointer to the data of an uncompressed pack file, or null if fp
+ * isn't one
+ */
+const void *ass_map_pack(struct ass_fileops *fop, void *fp, long *size);
+/* patch mounts take over the base mount's file operations, and add layers
+ * over them. Files aren't opened through the patch mount's own operations:
+ * ass_patch_lookup finds the layer with the newest version of a file, or
+ * returns null if there's no such file, or it was deleted by a patch.
+ */
+struct ass_fileops *ass_alloc_patch(int base_type, struct ass_fileops *base);
+int ass_add_patch_layer(struct ass_fileops *fop, const char *fname);
+struct ass_fileops *ass_patch_lookup(struct ass_fileops *fop, const char *path);
+void ass_free_patch(struct ass_fileops *fop);
+struct ass_fileops *ass_alloc_url(const char **urls, int count);
 void ass_free_url(struct ass_fileops *fop);
+int ass_prefetch_url(struct ass_fileops *fop, const char *manifest);
+int ass_prefetch_url_wait(void);
 
-extern int ass_mod_url_max_threads;
+extern int ass_num_threads;
 extern char ass_mod_url_cachedir[512];
+extern int ass_mod_url_cache_max_mb;
+extern int ass_mod_url_cache_max_files;
+extern int ass_mod_url_mem_threshold;
+extern int ass_mod_url_mem_max_kb;
+extern int ass_mod_url_preconnect;
+extern int ass_mod_url_hedge_ms;
+extern int ass_mod_url_prefetch_kbps;
+extern int ass_block_cache_max_kb;
 
 extern int ass_verbose;
 
@@ -0,0 +1,224 @@
+/*
+assfile - library for accessing assets with an fopen/fread-like interface
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "assfile_impl.h"
+#include "blkcache.h"
+
+#define HTAB_SIZE	4096
+
+static unsigned int hash_key(const void *mount, long entry, long block);
+static void unlink_blk(struct bcache_blk *blk);
+static void remove_blk(struct bcache_blk *blk);
+static void free_blk(struct bcache_blk *blk);
+static void shrink(void);
+
+static pthread_mutex_t bc_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bcache_blk *htab[HTAB_SIZE];
+static struct bcache_blk *lru_head, *lru_tail;
+static struct ass_cache_stats stats;
+
+
+int bcache_enabled(void)
+{
+	return ass_block_cache_max_kb > 0;
+}
+
+struct bcache_blk *bcache_get(const void *mount, long entry, long block)
+{
+	struct bcache_blk *blk;
+
+	pthread_mutex_lock(&bc_lock);
+	blk = htab[hash_key(mount, entry, block)];
+	while(blk) {
+		if(blk->mount == mount && blk->entry == entry && blk->block == block) {
+			blk->nref++;
+			/* move to the most recently used end */
+			if(blk != lru_tail) {
+				unlink_blk(blk);
+				blk->prev = lru_tail;
+				lru_tail->next = blk;
+				lru_tail = blk;
+			}
+			break;
+		}
+		blk = blk->hnext;
+	}
+	if(blk) {
+		stats.hits++;
+	} else {
+		stats.misses++;
+	}
+	pthread_mutex_unlock(&bc_lock);
+	return blk;
+}
+
+struct bcache_blk *bcache_add(const void *mount, long entry, long block, unsigned char *data, long size)
+{
+	struct bcache_blk *blk, *old;
+	unsigned int idx = hash_key(mount, entry, block);
+
+	if(!(blk = malloc(sizeof *blk))) {
+		return 0;
+	}
+	blk->mount = mount;
+	blk->entry = entry;
+	blk->block = block;
+	blk->data = data;
+	blk->size = size;
+	blk->nref = 2;	/* one for the cache, one for the caller */
+
+	pthread_mutex_lock(&bc_lock);
+
+	/* another file might have decompressed the same block concurrently,
+	 * replace it; whoever uses it keeps it until they release it.
+	 */
+	old = htab[idx];
+	while(old) {
+		if(old->mount == mount && old->entry == entry && old->block == block) {
+			remove_blk(old);
+			break;
+		}
+		old = old->hnext;
+	}
+
+	blk->hnext = htab[idx];
+	htab[idx] = blk;
+	blk->next = 0;
+	blk->prev = lru_tail;
+	if(lru_tail) {
+		lru_tail->next = blk;
+	} else {
+		lru_head = blk;
+	}
+	lru_tail = blk;
+	stats.size += size;
+	stats.count++;
+
+	shrink();
+	pthread_mutex_unlock(&bc_lock);
+	return blk;
+}
+
+void bcache_release(struct bcache_blk *blk)
+{
+	int nref;
+
+	pthread_mutex_lock(&bc_lock);
+	nref = --blk->nref;
+	pthread_mutex_unlock(&bc_lock);
+
+	if(nref <= 0) {
+		free_blk(blk);
+	}
+}
+
+void bcache_purge(const void *mount)
+{
+	struct bcache_blk *blk, *next;
+
+	pthread_mutex_lock(&bc_lock);
+	blk = lru_head;
+	while(blk) {
+		next = blk->next;
+		if(blk->mount == mount) {
+			remove_blk(blk);
+		}
+		blk = next;
+	}
+	pthread_mutex_unlock(&bc_lock);
+}
+
+void ass_block_cache_stats(struct ass_cache_stats *st)
+{
+	pthread_mutex_lock(&bc_lock);
+	*st = stats;
+	pthread_mutex_unlock(&bc_lock);
+}
+
+static unsigned int hash_key(const void *mount, long entry, long block)
+{
+	uint64_t x = (uintptr_t)mount ^ ((uint64_t)entry << 20) ^ (uint64_t)block;
+
+	/* 64bit mix (from splitmix64), so that neighbouring blocks spread out */
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return (x ^ (x >> 31)) % HTAB_SIZE;
+}
+
+static void unlink_blk(struct bcache_blk *blk)
+{
+	if(blk->prev) {
+		blk->prev->next = blk->next;
+	} else {
+		lru_head = blk->next;
+	}
+	if(blk->next) {
+		blk->next->prev = blk->prev;
+	} else {
+		lru_tail = blk->prev;
+	}
+	blk->prev = blk->next = 0;
+}
+
+/* takes a block out of the cache, and drops the cache's reference to it.
+ * called with bc_lock held.
+ */
+static void remove_blk(struct bcache_blk *blk)
+{
+	struct bcache_blk **link = htab + hash_key(blk->mount, blk->entry, blk->block);
+
+	while(*link != blk) {
+		link = &(*link)->hnext;
+	}
+	*link = blk->hnext;
+	unlink_blk(blk);
+	stats.size -= blk->size;
+	stats.count--;
+	if(--blk->nref <= 0) {
+		free_blk(blk);
+	}
+}
+
+static void free_blk(struct bcache_blk *blk)
+{
+	free(blk->data);
+	free(blk);
+}
+
+/* drop unreferenced blocks, least recently used first, until the cache is
+ * within its memory budget. called with bc_lock held.
+ */
+static void shrink(void)
+{
+	struct bcache_blk *blk, *next;
+	unsigned long maxsz = (unsigned long)ass_block_cache_max_kb << 10;
+
+	blk = lru_head;
+	while(blk && stats.size > maxsz) {
+		next = blk->next;
+		if(blk->nref <= 1) {
+			remove_blk(blk);
+			stats.evictions++;
+		}
+		blk = next;
+	}
+}
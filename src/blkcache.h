@@ -0,0 +1,53 @@
+/*
+assfile - library for accessing assets with an fopen/fread-like interface
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef BLKCACHE_H_
+#define BLKCACHE_H_
+
+/* Process-wide cache of decompressed blocks of archive and pack entries,
+ * shared by all open files. Blocks are keyed by the mount they came from (its
+ * private data pointer), the entry index within it, and the block number.
+ * Blocks are reference counted; unreferenced blocks are dropped in LRU order
+ * when the cache exceeds its memory budget (ASS_BLOCK_CACHE_SIZE).
+ */
+struct bcache_blk {
+	const void *mount;
+	long entry, block;
+	unsigned char *data;
+	long size;
+	int nref;
+
+	struct bcache_blk *prev, *next;		/* LRU list */
+	struct bcache_blk *hnext;			/* hash bucket chain */
+};
+
+/* non-zero if the cache has a memory budget, and should be used */
+int bcache_enabled(void);
+
+/* returns a new reference to the cached block, or null */
+struct bcache_blk *bcache_get(const void *mount, long entry, long block);
+/* add a block (data allocated with malloc) to the cache. The cache takes
+ * ownership of data on success, and returns a new reference to the block. On
+ * failure it returns null, and data still belongs to the caller.
+ */
+struct bcache_blk *bcache_add(const void *mount, long entry, long block, unsigned char *data, long size);
+void bcache_release(struct bcache_blk *blk);
+
+/* drops all blocks of a mount, called when it goes away */
+void bcache_purge(const void *mount);
+
+#endif	/* BLKCACHE_H_ */
@@ -0,0 +1,701 @@
+/*
+assfile - library for accessing assets with an fopen/fread-like interface
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef __MSVCRT__
+#include <malloc.h>
+#else
+#include <alloca.h>
+#endif
+
+#include "assfile_impl.h"
+#include "diskcache.h"
+#include "hash.h"
+
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#endif
+
+#define JOURNAL_NAME	"journal"
+#define LOCK_NAME		"lock"
+#define MAX_NAME_LEN	127
+
+/* byte 0 of the lock file guards the journal, cache file locks are mapped to
+ * the bytes after it. Different names can map to the same byte, so those are
+ * reference counted within the process, see struct key_lock.
+ */
+#define JOURNAL_LOCK_OFFS	0
+#define KEY_LOCK_OFFS(name)	(1 + hash_name(name) % 0x7ffffff0)
+
+/* evict down to this fraction of the budget, so that we don't end up evicting
+ * a single file after every download once the cache fills up
+ */
+#define EVICT_LOW_MARK(x)	((x) - (x) / 10)
+
+struct entry {
+	char *name;
+	unsigned long size;
+	struct entry *prev, *next;	/* LRU list, head is the least recently used */
+	struct entry *hnext;		/* hash bucket chain */
+};
+
+/* a cache file lock byte held (or being locked) by threads of this process.
+ * fcntl locks belong to the process, so the byte is only unlocked when the
+ * last of them is done with it.
+ */
+struct key_lock {
+	long offs;
+	int count, pending;
+	struct key_lock *next;
+};
+
+static struct entry *find_entry(const char *name, struct entry ***prevlink);
+static struct entry *add_entry(const char *name, unsigned long size);
+static void touch_entry(const char *name, unsigned long size);
+static void remove_entry(const char *name);
+static void unlink_lru(struct entry *e);
+static void append_lru(struct entry *e);
+static void free_entry(struct entry *e);
+static void clear_entries(void);
+static int grow_table(void);
+static unsigned int hash_name(const char *name);
+static int open_journal(void);
+static int sync_journal(void);
+static void scan_dir(const char *subdir);
+static void compact_journal(void);
+static int over_budget(unsigned long sz_slack, int count_slack);
+static int lock_range(long offs, int wait);
+static void unlock_range(long offs);
+
+static pthread_mutex_t dc_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *cachedir, *jname;
+static FILE *journal;
+static long journal_pos;
+static int journal_records;
+static int lock_fd = -1;
+
+static struct key_lock *key_locks;
+static pthread_mutex_t key_locks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct entry **htab;
+static int htab_size;
+static struct entry *lru_head, *lru_tail;
+static int num_entries;
+static unsigned long total_size;
+static int evict_pending;
+
+
+int dcache_init(const char *dir)
+{
+	char *lockname;
+	int len = strlen(dir);
+
+	if(!(cachedir = malloc(len + 1)) || !(jname = malloc(len + strlen(JOURNAL_NAME) + 2))) {
+		free(cachedir);
+		cachedir = 0;
+		return -1;
+	}
+	memcpy(cachedir, dir, len + 1);
+	sprintf(jname, "%s/%s", dir, JOURNAL_NAME);
+
+	if(grow_table() == -1) {
+		goto err;
+	}
+
+#ifndef WIN32
+	lockname = alloca(len + strlen(LOCK_NAME) + 2);
+	sprintf(lockname, "%s/%s", dir, LOCK_NAME);
+	if((lock_fd = open(lockname, O_RDWR | O_CREAT, 0666)) == -1) {
+		fprintf(stderr, "assfile: failed to open cache lock file: %s: %s\n", lockname, strerror(errno));
+		goto err;
+	}
+#endif
+
+	lock_range(JOURNAL_LOCK_OFFS, 1);
+	if(open_journal() == -1) {
+		unlock_range(JOURNAL_LOCK_OFFS);
+		goto err;
+	}
+	if(journal_records == 0 && journal_pos == 0) {
+		/* new journal, start by indexing whatever is already in the cache */
+		scan_dir(0);
+	}
+	if(journal_records > num_entries * 2 + 256) {
+		compact_journal();
+	}
+	unlock_range(JOURNAL_LOCK_OFFS);
+	return 0;
+
+err:
+	free(cachedir);
+	free(jname);
+	cachedir = jname = 0;
+	return -1;
+}
+
+void dcache_shutdown(void)
+{
+	pthread_mutex_lock(&dc_lock);
+	if(journal) {
+		fclose(journal);
+		journal = 0;
+	}
+#ifndef WIN32
+	if(lock_fd >= 0) {
+		close(lock_fd);
+		lock_fd = -1;
+	}
+#endif
+	clear_entries();
+	free(htab);
+	htab = 0;
+	htab_size = 0;
+	free(cachedir);
+	free(jname);
+	cachedir = jname = 0;
+	pthread_mutex_unlock(&dc_lock);
+
+	/* closing lock_fd released them all */
+	pthread_mutex_lock(&key_locks_lock);
+	while(key_locks) {
+		struct key_lock *kl = key_locks;
+		key_locks = key_locks->next;
+		free(kl);
+	}
+	pthread_mutex_unlock(&key_locks_lock);
+}
+
+int dcache_touch(const char *name, unsigned long size)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&dc_lock);
+	if(!journal) goto end;
+
+	lock_range(JOURNAL_LOCK_OFFS, 1);
+	if(sync_journal() == -1) {
+		unlock_range(JOURNAL_LOCK_OFFS);
+		goto end;
+	}
+
+	touch_entry(name, size);
+
+	fprintf(journal, "+ %s %lu\n", name, size);
+	fflush(journal);
+	journal_pos = ftell(journal);
+	journal_records++;
+	unlock_range(JOURNAL_LOCK_OFFS);
+
+	if(!evict_pending && over_budget(0, 0)) {
+		evict_pending = 1;
+		res = 1;
+	}
+end:
+	pthread_mutex_unlock(&dc_lock);
+	return res;
+}
+
+void dcache_evict(void)
+{
+	struct entry *e;
+	char *path;
+	unsigned long maxsz;
+	int nevict = 0;
+
+	pthread_mutex_lock(&dc_lock);
+	evict_pending = 0;
+	if(!journal) {
+		pthread_mutex_unlock(&dc_lock);
+		return;
+	}
+
+	path = alloca(strlen(cachedir) + MAX_NAME_LEN + 2);
+
+	lock_range(JOURNAL_LOCK_OFFS, 1);
+	if(sync_journal() == -1) {
+		unlock_range(JOURNAL_LOCK_OFFS);
+		pthread_mutex_unlock(&dc_lock);
+		return;
+	}
+
+	maxsz = (unsigned long)ass_mod_url_cache_max_mb << 20;
+	while(lru_head && over_budget(maxsz - EVICT_LOW_MARK(maxsz),
+				ass_mod_url_cache_max_files - EVICT_LOW_MARK(ass_mod_url_cache_max_files))) {
+		e = lru_head;
+
+		sprintf(path, "%s/%s", cachedir, e->name);
+		if(remove(path) == -1 && errno != ENOENT) {
+			fprintf(stderr, "assfile: failed to evict cache file: %s: %s\n", path, strerror(errno));
+		}
+		fprintf(journal, "- %s\n", e->name);
+		journal_records++;
+		remove_entry(e->name);
+		nevict++;
+	}
+	fflush(journal);
+	journal_pos = ftell(journal);
+
+	if(ass_verbose && nevict) {
+		fprintf(stderr, "assfile: evicted %d files from the cache (%d files, %lu bytes left)\n",
+				nevict, num_entries, total_size);
+	}
+
+	if(journal_records > num_entries * 2 + 256) {
+		compact_journal();
+	}
+	unlock_range(JOURNAL_LOCK_OFFS);
+	pthread_mutex_unlock(&dc_lock);
+}
+
+void dcache_remove(const char *name)
+{
+	pthread_mutex_lock(&dc_lock);
+	if(journal) {
+		lock_range(JOURNAL_LOCK_OFFS, 1);
+		if(sync_journal() != -1) {
+			remove_entry(name);
+
+			fprintf(journal, "- %s\n", name);
+			fflush(journal);
+			journal_pos = ftell(journal);
+			journal_records++;
+		}
+		unlock_range(JOURNAL_LOCK_OFFS);
+	}
+	pthread_mutex_unlock(&dc_lock);
+}
+
+int dcache_lock(const char *name, int wait)
+{
+	long offs = KEY_LOCK_OFFS(name);
+	struct key_lock *kl, dummy, *prev;
+	int res;
+
+	pthread_mutex_lock(&key_locks_lock);
+	kl = key_locks;
+	while(kl && kl->offs != offs) {
+		kl = kl->next;
+	}
+	if(!kl) {
+		if(!(kl = malloc(sizeof *kl))) {
+			pthread_mutex_unlock(&key_locks_lock);
+			return lock_range(offs, wait);
+		}
+		kl->offs = offs;
+		kl->count = kl->pending = 0;
+		kl->next = key_locks;
+		key_locks = kl;
+	}
+	kl->pending++;
+	pthread_mutex_unlock(&key_locks_lock);
+
+	/* succeeds right away if another thread of ours holds it */
+	res = lock_range(offs, wait);
+
+	pthread_mutex_lock(&key_locks_lock);
+	kl->pending--;
+	if(res != -1) {
+		kl->count++;
+	} else if(!kl->count && !kl->pending) {
+		unlock_range(offs);
+		dummy.next = key_locks;
+		prev = &dummy;
+		while(prev->next != kl) prev = prev->next;
+		prev->next = kl->next;
+		key_locks = dummy.next;
+		free(kl);
+	}
+	pthread_mutex_unlock(&key_locks_lock);
+	return res;
+}
+
+void dcache_unlock(const char *name)
+{
+	long offs = KEY_LOCK_OFFS(name);
+	struct key_lock *kl, dummy, *prev;
+
+	pthread_mutex_lock(&key_locks_lock);
+	dummy.next = key_locks;
+	prev = &dummy;
+	while(prev->next && prev->next->offs != offs) {
+		prev = prev->next;
+	}
+	if(!(kl = prev->next)) {
+		unlock_range(offs);		/* locked without a key_lock node */
+	} else if(--kl->count <= 0 && !kl->pending) {
+		unlock_range(offs);
+		prev->next = kl->next;
+		key_locks = dummy.next;
+		free(kl);
+	}
+	pthread_mutex_unlock(&key_locks_lock);
+}
+
+/* checks if the cache exceeds its budget, with the slack values subtracted
+ * from the limits. A zero limit means unlimited.
+ */
+static int over_budget(unsigned long sz_slack, int count_slack)
+{
+	unsigned long maxsz = (unsigned long)ass_mod_url_cache_max_mb << 20;
+	int maxfiles = ass_mod_url_cache_max_files;
+
+	if(maxsz > 0 && total_size > maxsz - sz_slack) {
+		return 1;
+	}
+	if(maxfiles > 0 && num_entries > maxfiles - count_slack) {
+		return 1;
+	}
+	return 0;
+}
+
+static struct entry *find_entry(const char *name, struct entry ***prevlink)
+{
+	struct entry **link = htab + hash_name(name) % htab_size;
+
+	while(*link) {
+		if(strcmp((*link)->name, name) == 0) {
+			if(prevlink) *prevlink = link;
+			return *link;
+		}
+		link = &(*link)->hnext;
+	}
+	return 0;
+}
+
+static struct entry *add_entry(const char *name, unsigned long size)
+{
+	struct entry *e;
+	unsigned int idx;
+
+	if(num_entries >= htab_size * 2) {
+		grow_table();
+	}
+
+	if(!(e = malloc(sizeof *e)) || !(e->name = malloc(strlen(name) + 1))) {
+		free(e);
+		return 0;
+	}
+	strcpy(e->name, name);
+	e->size = size;
+
+	idx = hash_name(name) % htab_size;
+	e->hnext = htab[idx];
+	htab[idx] = e;
+	append_lru(e);
+
+	num_entries++;
+	total_size += size;
+	return e;
+}
+
+/* add a new entry, or update an existing one and make it the most recently used */
+static void touch_entry(const char *name, unsigned long size)
+{
+	struct entry *e;
+
+	if((e = find_entry(name, 0))) {
+		total_size = total_size - e->size + size;
+		e->size = size;
+		unlink_lru(e);
+		append_lru(e);
+	} else {
+		add_entry(name, size);
+	}
+}
+
+static void remove_entry(const char *name)
+{
+	struct entry *e, **prevlink;
+
+	if((e = find_entry(name, &prevlink))) {
+		*prevlink = e->hnext;
+		unlink_lru(e);
+		num_entries--;
+		total_size -= e->size;
+		free_entry(e);
+	}
+}
+
+static void unlink_lru(struct entry *e)
+{
+	if(e->prev) {
+		e->prev->next = e->next;
+	} else {
+		lru_head = e->next;
+	}
+	if(e->next) {
+		e->next->prev = e->prev;
+	} else {
+		lru_tail = e->prev;
+	}
+	e->prev = e->next = 0;
+}
+
+static void append_lru(struct entry *e)
+{
+	e->next = 0;
+	e->prev = lru_tail;
+	if(lru_tail) {
+		lru_tail->next = e;
+	} else {
+		lru_head = e;
+	}
+	lru_tail = e;
+}
+
+static void free_entry(struct entry *e)
+{
+	free(e->name);
+	free(e);
+}
+
+static void clear_entries(void)
+{
+	while(lru_head) {
+		struct entry *e = lru_head;
+		lru_head = lru_head->next;
+		free_entry(e);
+	}
+	lru_tail = 0;
+	if(htab) {
+		memset(htab, 0, htab_size * sizeof *htab);
+	}
+	num_entries = 0;
+	total_size = 0;
+}
+
+static int grow_table(void)
+{
+	int i, newsz = htab_size ? htab_size * 2 : 1024;
+	struct entry **newtab, *e;
+
+	if(!(newtab = calloc(newsz, sizeof *newtab))) {
+		return -1;
+	}
+	for(i=0; i<htab_size; i++) {
+		while(htab[i]) {
+			e = htab[i];
+			htab[i] = e->hnext;
+
+			e->hnext = newtab[hash_name(e->name) % newsz];
+			newtab[hash_name(e->name) % newsz] = e;
+		}
+	}
+	free(htab);
+	htab = newtab;
+	htab_size = newsz;
+	return 0;
+}
+
+static unsigned int hash_name(const char *name)
+{
+	return (unsigned int)ass_hash64(name, strlen(name), 0);
+}
+
+/* (re)opens the journal and replays it from the start. the journal is
+ * shared by all processes using the same cache directory.
+ */
+static int open_journal(void)
+{
+	if(journal) {
+		fclose(journal);
+	}
+	if(!(journal = fopen(jname, "a+"))) {
+		fprintf(stderr, "assfile: failed to open cache journal: %s: %s\n", jname, strerror(errno));
+		return -1;
+	}
+	clear_entries();
+	journal_pos = 0;
+	journal_records = 0;
+	if(sync_journal() == -1) {
+		return -1;
+	}
+
+	if(ass_verbose) {
+		fprintf(stderr, "assfile: cache journal: %d files, %lu bytes\n", num_entries, total_size);
+	}
+	return 0;
+}
+
+/* catch up with records appended to the journal by other processes since we
+ * last looked at it. called with dc_lock held and the journal locked.
+ * Returns -1 if the journal had to be reopened and that failed (for instance
+ * the cache directory was deleted), leaving journal null: no more journaling.
+ */
+static int sync_journal(void)
+{
+	char buf[MAX_NAME_LEN + 64], name[MAX_NAME_LEN + 1];
+	unsigned long size;
+	struct stat st_path, st_open;
+
+	/* if another process compacted the journal, start over */
+	if(stat(jname, &st_path) == -1 || fstat(fileno(journal), &st_open) == -1 ||
+			st_path.st_ino != st_open.st_ino) {
+		return open_journal();
+	}
+
+	fseek(journal, journal_pos, SEEK_SET);
+	while(fgets(buf, sizeof buf, journal)) {
+		journal_records++;
+
+		if(buf[0] == '+' && sscanf(buf + 1, "%127s %lu", name, &size) == 2) {
+			touch_entry(name, size);
+		} else if(buf[0] == '-' && sscanf(buf + 1, "%127s", name) == 1) {
+			remove_entry(name);
+		}
+		/* ignore anything else, it might be a partial write from a crash */
+	}
+	journal_pos = ftell(journal);
+	return 0;
+}
+
+#ifndef WIN32
+/* index the files in the cache directory and its shard subdirectories */
+static void scan_dir(const char *subdir)
+{
+	DIR *dir;
+	struct dirent *dent;
+	struct stat st;
+	char *path, *name;
+	int dirlen = strlen(cachedir) + (subdir ? strlen(subdir) + 1 : 0);
+
+	path = alloca(dirlen + MAX_NAME_LEN + 2);
+	if(subdir) {
+		sprintf(path, "%s/%s", cachedir, subdir);
+	} else {
+		strcpy(path, cachedir);
+	}
+	if(!(dir = opendir(path))) {
+		return;
+	}
+	name = path + strlen(cachedir) + 1;
+
+	while((dent = readdir(dir))) {
+		/* skip dotfiles, temporary files, and our own files */
+		if(strchr(dent->d_name, '.') || strlen(dent->d_name) > MAX_NAME_LEN - 3 ||
+				strcmp(dent->d_name, JOURNAL_NAME) == 0 || strcmp(dent->d_name, LOCK_NAME) == 0) {
+			continue;
+		}
+		sprintf(path + dirlen, "/%s", dent->d_name);
+		if(stat(path, &st) == -1) {
+			continue;
+		}
+		if(S_ISDIR(st.st_mode)) {
+			if(!subdir) scan_dir(dent->d_name);
+		} else if(S_ISREG(st.st_mode)) {
+			add_entry(name, st.st_size);
+		}
+	}
+	closedir(dir);
+
+	/* force the journal to be rewritten with the scanned entries */
+	journal_records = num_entries * 2 + 257;
+}
+#else
+static void scan_dir(const char *subdir)
+{
+}
+#endif
+
+/* rewrite the journal with one record per live entry, in LRU order.
+ * called with dc_lock held and the journal locked.
+ */
+static void compact_journal(void)
+{
+	char *tmpname;
+	FILE *fp;
+	struct entry *e;
+
+	tmpname = alloca(strlen(jname) + 5);
+	sprintf(tmpname, "%s.tmp", jname);
+
+	if(!(fp = fopen(tmpname, "w"))) {
+		return;
+	}
+	e = lru_head;
+	while(e) {
+		fprintf(fp, "+ %s %lu\n", e->name, e->size);
+		e = e->next;
+	}
+	if(fclose(fp) != 0) {
+		remove(tmpname);
+		return;
+	}
+
+	fclose(journal);
+#ifdef WIN32
+	remove(jname);
+#endif
+	if(rename(tmpname, jname) == -1) {
+		remove(tmpname);
+	}
+	if((journal = fopen(jname, "a+"))) {
+		fseek(journal, 0, SEEK_END);
+		journal_pos = ftell(journal);
+	}
+	journal_records = num_entries;
+}
+
+#ifndef WIN32
+/* fcntl record locks are per-process, they only keep other processes out */
+static int lock_range(long offs, int wait)
+{
+	struct flock flk;
+
+	if(lock_fd < 0) return 0;
+
+	flk.l_type = F_WRLCK;
+	flk.l_whence = SEEK_SET;
+	flk.l_start = offs;
+	flk.l_len = 1;
+
+	while(fcntl(lock_fd, wait ? F_SETLKW : F_SETLK, &flk) == -1) {
+		if(errno != EINTR) return -1;
+	}
+	return 0;
+}
+
+static void unlock_range(long offs)
+{
+	struct flock flk;
+
+	if(lock_fd < 0) return;
+
+	flk.l_type = F_UNLCK;
+	flk.l_whence = SEEK_SET;
+	flk.l_start = offs;
+	flk.l_len = 1;
+	fcntl(lock_fd, F_SETLK, &flk);
+}
+#else
+static int lock_range(long offs, int wait)
+{
+	return 0;
+}
+
+static void unlock_range(long offs)
+{
+}
+#endif
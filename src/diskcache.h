@@ -0,0 +1,52 @@
+/*
+assfile - library for accessing assets with an fopen/fread-like interface
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef DISKCACHE_H_
+#define DISKCACHE_H_
+
+/* Bookkeeping for the mod_url disk cache directory. Every cache file added or
+ * accessed is recorded in an append-only journal in the cache directory, so
+ * that the LRU order and total size can be recovered at startup by replaying
+ * the journal, without having to stat every file in the cache.
+ *
+ * The cache directory can be shared by multiple processes. Each process
+ * catches up with records appended by the others before modifying the
+ * journal, and access to it is serialized with a file lock.
+ */
+
+int dcache_init(const char *dir);
+void dcache_shutdown(void);
+
+/* record that the cache file "name" (relative to the cache directory) was
+ * added or accessed, and move it to the most-recently-used end of the list.
+ * returns 1 if the cache went over budget and dcache_evict should be called.
+ */
+int dcache_touch(const char *name, unsigned long size);
+
+/* forget about a cache file which was removed or renamed */
+void dcache_remove(const char *name);
+
+/* remove least recently used files until the cache is within budget */
+void dcache_evict(void);
+
+/* lock the cache file "name" against other processes. if wait is 0, return
+ * -1 immediately if another process holds the lock.
+ */
+int dcache_lock(const char *name, int wait);
+void dcache_unlock(const char *name);
+
+#endif	/* DISKCACHE_H_ */
@@ -0,0 +1,214 @@
+/*
+assfile - library for accessing assets with an fopen/fread-like interface
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include "hash.h"
+
+#define P1	0x9e3779b185ebca87ULL
+#define P2	0xc2b2ae3d27d4eb4fULL
+#define P3	0x165667b19e3779f9ULL
+#define P4	0x85ebca77c2b2ae63ULL
+#define P5	0x27d4eb2f165667c5ULL
+
+#define ROTL(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LE64(x)	__builtin_bswap64(x)
+#define LE32(x)	__builtin_bswap32(x)
+#else
+#define LE64(x)	(x)
+#define LE32(x)	(x)
+#endif
+
+static inline uint64_t read64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof v);
+	return LE64(v);
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof v);
+	return LE32(v);
+}
+
+static inline uint64_t xround(uint64_t acc, uint64_t in)
+{
+	acc += in * P2;
+	acc = ROTL(acc, 31);
+	return acc * P1;
+}
+
+static inline uint64_t xmerge(uint64_t acc, uint64_t v)
+{
+	acc ^= xround(0, v);
+	return acc * P1 + P4;
+}
+
+static inline uint64_t merge_lanes(uint64_t v1, uint64_t v2, uint64_t v3, uint64_t v4)
+{
+	uint64_t h = ROTL(v1, 1) + ROTL(v2, 7) + ROTL(v3, 12) + ROTL(v4, 18);
+	h = xmerge(h, v1);
+	h = xmerge(h, v2);
+	h = xmerge(h, v3);
+	return xmerge(h, v4);
+}
+
+static uint64_t finalize(uint64_t h, const unsigned char *p, const unsigned char *end);
+
+uint64_t ass_hash64(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = data;
+	const unsigned char *end = p + len;
+	uint64_t h, v1, v2, v3, v4;
+
+	if(len >= 32) {
+		const unsigned char *limit = end - 32;
+		v1 = seed + P1 + P2;
+		v2 = seed + P2;
+		v3 = seed;
+		v4 = seed - P1;
+
+		do {
+			v1 = xround(v1, read64(p));
+			v2 = xround(v2, read64(p + 8));
+			v3 = xround(v3, read64(p + 16));
+			v4 = xround(v4, read64(p + 24));
+			p += 32;
+		} while(p <= limit);
+
+		h = merge_lanes(v1, v2, v3, v4);
+	} else {
+		h = seed + P5;
+	}
+
+	h += (uint64_t)len;
+	return finalize(h, p, end);
+}
+
+void ass_hash64_init(struct ass_hash64_state *st, uint64_t seed)
+{
+	st->v[0] = seed + P1 + P2;
+	st->v[1] = seed + P2;
+	st->v[2] = seed;
+	st->v[3] = seed - P1;
+	st->seed = seed;
+	st->total_len = 0;
+	st->buf_len = 0;
+}
+
+void ass_hash64_update(struct ass_hash64_state *st, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	const unsigned char *end = p + len;
+	uint64_t v1, v2, v3, v4;
+	int n;
+
+	st->total_len += len;
+
+	if(st->buf_len) {
+		/* complete the partial stripe left over from last time */
+		n = 32 - st->buf_len;
+		if(len < n) {
+			memcpy(st->buf + st->buf_len, p, len);
+			st->buf_len += len;
+			return;
+		}
+		memcpy(st->buf + st->buf_len, p, n);
+		p += n;
+		st->v[0] = xround(st->v[0], read64(st->buf));
+		st->v[1] = xround(st->v[1], read64(st->buf + 8));
+		st->v[2] = xround(st->v[2], read64(st->buf + 16));
+		st->v[3] = xround(st->v[3], read64(st->buf + 24));
+		st->buf_len = 0;
+	}
+
+	if(p + 32 <= end) {
+		v1 = st->v[0];
+		v2 = st->v[1];
+		v3 = st->v[2];
+		v4 = st->v[3];
+		do {
+			v1 = xround(v1, read64(p));
+			v2 = xround(v2, read64(p + 8));
+			v3 = xround(v3, read64(p + 16));
+			v4 = xround(v4, read64(p + 24));
+			p += 32;
+		} while(p + 32 <= end);
+		st->v[0] = v1;
+		st->v[1] = v2;
+		st->v[2] = v3;
+		st->v[3] = v4;
+	}
+
+	if(p < end) {
+		st->buf_len = end - p;
+		memcpy(st->buf, p, st->buf_len);
+	}
+}
+
+uint64_t ass_hash64_final(struct ass_hash64_state *st)
+{
+	uint64_t h;
+
+	if(st->total_len >= 32) {
+		h = merge_lanes(st->v[0], st->v[1], st->v[2], st->v[3]);
+	} else {
+		h = st->seed + P5;
+	}
+	h += st->total_len;
+	return finalize(h, st->buf, st->buf + st->buf_len);
+}
+
+/* mixes in the last few bytes, less than a full stripe, and scrambles the bits */
+static uint64_t finalize(uint64_t h, const unsigned char *p, const unsigned char *end)
+{
+	while(p + 8 <= end) {
+		h ^= xround(0, read64(p));
+		h = ROTL(h, 27) * P1 + P4;
+		p += 8;
+	}
+	if(p + 4 <= end) {
+		h ^= (uint64_t)read32(p) * P1;
+		h = ROTL(h, 23) * P2 + P3;
+		p += 4;
+	}
+	while(p < end) {
+		h ^= *p++ * P5;
+		h = ROTL(h, 11) * P1;
+	}
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
+
+void ass_hash64_str(uint64_t hash, char *buf)
+{
+	static const char hexdig[] = "0123456789abcdef";
+	int i;
+
+	for(i=0; i<16; i++) {
+		buf[i] = hexdig[(hash >> (60 - i * 4)) & 0xf];
+	}
+	buf[16] = 0;
+}
@@ -0,0 +1,44 @@
+/*
+assfile - library for accessing assets with an fopen/fread-like interface
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef ASSFILE_HASH_H_
+#define ASSFILE_HASH_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/* fast non-cryptographic 64-bit hash (XXH64 algorithm) */
+uint64_t ass_hash64(const void *data, size_t len, uint64_t seed);
+
+/* incremental version, for data arriving in pieces. Produces the same hash as
+ * ass_hash64 would for all the data in one go.
+ */
+struct ass_hash64_state {
+	uint64_t v[4], seed;
+	uint64_t total_len;
+	unsigned char buf[32];
+	int buf_len;
+};
+
+void ass_hash64_init(struct ass_hash64_state *st, uint64_t seed);
+void ass_hash64_update(struct ass_hash64_state *st, const void *data, size_t len);
+uint64_t ass_hash64_final(struct ass_hash64_state *st);
+
+/* writes the hash as 16 lowercase hex digits and a terminator to buf */
+void ass_hash64_str(uint64_t hash, char *buf);
+
+#endif	/* ASSFILE_HASH_H_ */
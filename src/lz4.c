@@ -0,0 +1,220 @@
+/*
+assfile - library for accessing assets with an fopen/fread-like interface
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include <inttypes.h>
+#include "lz4.h"
+
+#define MIN_MATCH		4
+#define LAST_LITERALS	5		/* the last 5 bytes are always literals */
+#define MF_LIMIT		12		/* and the last match starts at least 12 bytes before the end */
+#define MAX_DIST		65535
+#define HASH_LOG		14
+
+static uint32_t read32(const unsigned char *p)
+{
+	uint32_t x;
+	memcpy(&x, p, 4);
+	return x;
+}
+
+static uint32_t hash4(uint32_t x)
+{
+	return (x * 2654435761u) >> (32 - HASH_LOG);
+}
+
+/* writes the remainder of a length which didn't fit in the token */
+static unsigned char *write_len(unsigned char *op, int len)
+{
+	while(len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+int ass_lz4_compress(const void *src, int srcsz, void *dst, int dstmax)
+{
+	uint32_t htab[1 << HASH_LOG];
+	const unsigned char *base = src;
+	const unsigned char *ip = base, *anchor = base, *ref;
+	const unsigned char *end = base + srcsz;
+	const unsigned char *mflimit = end - MF_LIMIT;
+	const unsigned char *matchlimit = end - LAST_LITERALS;
+	unsigned char *op = dst, *oend = op + dstmax, *token;
+	int litlen, len;
+	uint32_t h;
+
+	if(srcsz > MF_LIMIT) {
+		memset(htab, 0, sizeof htab);
+
+		while(ip < mflimit) {
+			h = hash4(read32(ip));
+			ref = base + htab[h];
+			htab[h] = ip - base;
+
+			if(ref >= ip || ip - ref > MAX_DIST || read32(ref) != read32(ip)) {
+				ip++;
+				continue;
+			}
+
+			/* extend the match in both directions */
+			while(ip > anchor && ref > base && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			len = MIN_MATCH;
+			while(ip + len < matchlimit && ip[len] == ref[len]) {
+				len++;
+			}
+
+			litlen = ip - anchor;
+			if(oend - op < 1 + litlen + litlen / 255 + 1 + 2 + (len - MIN_MATCH) / 255 + 1) {
+				return 0;
+			}
+			token = op++;
+			if(litlen >= 15) {
+				*token = 15 << 4;
+				op = write_len(op, litlen - 15);
+			} else {
+				*token = litlen << 4;
+			}
+			memcpy(op, anchor, litlen);
+			op += litlen;
+
+			*op++ = (ip - ref) & 0xff;
+			*op++ = (ip - ref) >> 8;
+
+			if(len - MIN_MATCH >= 15) {
+				*token |= 15;
+				op = write_len(op, len - MIN_MATCH - 15);
+			} else {
+				*token |= len - MIN_MATCH;
+			}
+
+			ip += len;
+			anchor = ip;
+		}
+	}
+
+	/* the rest as literals */
+	litlen = end - anchor;
+	if(oend - op < 1 + litlen + litlen / 255 + 1) {
+		return 0;
+	}
+	token = op++;
+	if(litlen >= 15) {
+		*token = 15 << 4;
+		op = write_len(op, litlen - 15);
+	} else {
+		*token = litlen << 4;
+	}
+	memcpy(op, anchor, litlen);
+	op += litlen;
+
+	return op - (unsigned char*)dst;
+}
+
+/* reads the remainder of a length which didn't fit in the token */
+static const unsigned char *read_len(const unsigned char *ip, const unsigned char *iend, int *len, int max)
+{
+	int b;
+
+	do {
+		if(ip >= iend) return 0;
+		b = *ip++;
+		*len += b;
+		if(*len > max) return 0;
+	} while(b == 255);
+	return ip;
+}
+
+int ass_lz4_decompress(const void *src, int srcsz, void *dst, int dstmax)
+{
+	const unsigned char *ip = src, *iend = ip + srcsz;
+	unsigned char *op = dst, *oend = op + dstmax, *ref, *mend;
+	int token, len, dist;
+
+	while(ip < iend) {
+		token = *ip++;
+
+		len = token >> 4;
+		if(len < 15 && iend - ip >= 16 && oend - op >= 16) {
+			/* short literal run, far from the ends of the buffers: a fixed
+			 * size copy is a lot faster than memcpy with a variable size.
+			 */
+			memcpy(op, ip, 16);
+		} else {
+			if(len == 15 && !(ip = read_len(ip, iend, &len, dstmax))) {
+				return -1;
+			}
+			if(len > iend - ip || len > oend - op) {
+				return -1;
+			}
+			memcpy(op, ip, len);
+		}
+		op += len;
+		ip += len;
+
+		if(ip >= iend) break;	/* the last sequence has no match */
+
+		if(iend - ip < 2) {
+			return -1;
+		}
+		dist = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if(!dist || dist > op - (unsigned char*)dst) {
+			return -1;
+		}
+
+		if((len = token & 15) == 15 && !(ip = read_len(ip, iend, &len, dstmax))) {
+			return -1;
+		}
+		len += MIN_MATCH;
+		if(len > oend - op) {
+			return -1;
+		}
+
+		ref = op - dist;
+		if(len <= 16 && dist >= 16 && oend - op >= 16) {
+			/* short match, same trick as with the literals */
+			memcpy(op, ref, 16);
+			op += len;
+		} else if(dist >= 8 && oend - op >= len + 8) {
+			/* copy 8 bytes at a time, possibly a bit more than needed. It works
+			 * for overlapping matches too, as long as they're 8 bytes apart.
+			 */
+			mend = op + len;
+			do {
+				memcpy(op, ref, 8);
+				op += 8;
+				ref += 8;
+			} while(op < mend);
+			op = mend;
+		} else if(dist >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			/* overlapping copy, repeats the last dist bytes */
+			while(len-- > 0) {
+				*op++ = *ref++;
+			}
+		}
+	}
+	return op - (unsigned char*)dst;
+}
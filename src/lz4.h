@@ -0,0 +1,36 @@
+/*
+assfile - library for accessing assets with an fopen/fread-like interface
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef ASSFILE_LZ4_H_
+#define ASSFILE_LZ4_H_
+
+/* LZ4 block format compression (https://github.com/lz4/lz4), without the
+ * frame format. Compression is the fast greedy variant.
+ */
+
+/* the largest compressed size of srcsz bytes of incompressible data */
+#define ASS_LZ4_BOUND(srcsz)	((srcsz) + (srcsz) / 255 + 16)
+
+/* returns the compressed size, or 0 if it doesn't fit in dstmax bytes */
+int ass_lz4_compress(const void *src, int srcsz, void *dst, int dstmax);
+
+/* returns the decompressed size, or -1 if the data are corrupted, or don't
+ * fit in dstmax bytes
+ */
+int ass_lz4_decompress(const void *src, int srcsz, void *dst, int dstmax);
+
+#endif	/* ASSFILE_LZ4_H_ */
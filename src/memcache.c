@@ -0,0 +1,193 @@
+/*
+assfile - library for accessing assets with an fopen/fread-like interface
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "assfile_impl.h"
+#include "memcache.h"
+
+#define HTAB_SIZE	512
+
+static void unlink_buf(struct mcache_buf *buf);
+static void free_buf(struct mcache_buf *buf);
+static void shrink(void);
+
+static pthread_mutex_t mc_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mcache_buf *htab[HTAB_SIZE];
+static struct mcache_buf *lru_head, *lru_tail;
+static long total_size;
+
+
+struct mcache_buf *mcache_get(uint64_t key)
+{
+	struct mcache_buf *buf;
+
+	pthread_mutex_lock(&mc_lock);
+	buf = htab[key % HTAB_SIZE];
+	while(buf) {
+		if(buf->key == key) {
+			buf->nref++;
+			/* move to the most recently used end */
+			if(buf != lru_tail) {
+				unlink_buf(buf);
+				buf->prev = lru_tail;
+				lru_tail->next = buf;
+				lru_tail = buf;
+			}
+			break;
+		}
+		buf = buf->hnext;
+	}
+	pthread_mutex_unlock(&mc_lock);
+	return buf;
+}
+
+struct mcache_buf *mcache_add(uint64_t key, char *data, long size)
+{
+	struct mcache_buf *buf, **link;
+	unsigned int idx = key % HTAB_SIZE;
+
+	if(!(buf = malloc(sizeof *buf))) {
+		return 0;
+	}
+	buf->key = key;
+	buf->data = data;
+	buf->size = size;
+	buf->nref = 2;	/* one for the cache, one for the caller */
+
+	pthread_mutex_lock(&mc_lock);
+
+	/* replace any older buffer for the same key, whoever still uses it keeps
+	 * the old data until they release it.
+	 */
+	link = htab + idx;
+	while(*link) {
+		struct mcache_buf *old = *link;
+		if(old->key == key) {
+			*link = old->hnext;
+			unlink_buf(old);
+			total_size -= old->size;
+			if(--old->nref <= 0) {
+				free_buf(old);
+			}
+			break;
+		}
+		link = &old->hnext;
+	}
+
+	buf->hnext = htab[idx];
+	htab[idx] = buf;
+	buf->next = 0;
+	buf->prev = lru_tail;
+	if(lru_tail) {
+		lru_tail->next = buf;
+	} else {
+		lru_head = buf;
+	}
+	lru_tail = buf;
+	total_size += size;
+
+	shrink();
+	pthread_mutex_unlock(&mc_lock);
+	return buf;
+}
+
+void mcache_addref(struct mcache_buf *buf)
+{
+	pthread_mutex_lock(&mc_lock);
+	buf->nref++;
+	pthread_mutex_unlock(&mc_lock);
+}
+
+void mcache_release(struct mcache_buf *buf)
+{
+	int nref;
+
+	pthread_mutex_lock(&mc_lock);
+	nref = --buf->nref;
+	pthread_mutex_unlock(&mc_lock);
+
+	if(nref <= 0) {
+		free_buf(buf);
+	}
+}
+
+void mcache_clear(void)
+{
+	struct mcache_buf *buf;
+
+	pthread_mutex_lock(&mc_lock);
+	while(lru_head) {
+		buf = lru_head;
+		lru_head = lru_head->next;
+		if(--buf->nref <= 0) {
+			free_buf(buf);
+		}
+	}
+	lru_tail = 0;
+	memset(htab, 0, sizeof htab);
+	total_size = 0;
+	pthread_mutex_unlock(&mc_lock);
+}
+
+static void unlink_buf(struct mcache_buf *buf)
+{
+	if(buf->prev) {
+		buf->prev->next = buf->next;
+	} else {
+		lru_head = buf->next;
+	}
+	if(buf->next) {
+		buf->next->prev = buf->prev;
+	} else {
+		lru_tail = buf->prev;
+	}
+	buf->prev = buf->next = 0;
+}
+
+static void free_buf(struct mcache_buf *buf)
+{
+	free(buf->data);
+	free(buf);
+}
+
+/* drop unreferenced buffers, least recently used first, until the cache is
+ * within its memory budget. called with mc_lock held.
+ */
+static void shrink(void)
+{
+	struct mcache_buf *buf, *next, **link;
+	long maxsz = (long)ass_mod_url_mem_max_kb << 10;
+
+	buf = lru_head;
+	while(buf && total_size > maxsz) {
+		next = buf->next;
+		if(buf->nref <= 1) {
+			link = htab + buf->key % HTAB_SIZE;
+			while(*link != buf) {
+				link = &(*link)->hnext;
+			}
+			*link = buf->hnext;
+			unlink_buf(buf);
+			total_size -= buf->size;
+			free_buf(buf);
+		}
+		buf = next;
+	}
+}
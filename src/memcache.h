@@ -0,0 +1,48 @@
+/*
+assfile - library for accessing assets with an fopen/fread-like interface
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef MEMCACHE_H_
+#define MEMCACHE_H_
+
+#include <inttypes.h>
+
+/* In-memory cache of small downloaded files, shared by everyone opening the
+ * same url. Buffers are reference counted; unreferenced buffers are dropped
+ * in LRU order when the cache exceeds its memory budget.
+ */
+struct mcache_buf {
+	uint64_t key;
+	char *data;
+	long size;
+	int nref;
+
+	struct mcache_buf *prev, *next;		/* LRU list */
+	struct mcache_buf *hnext;			/* hash bucket chain */
+};
+
+/* returns a new reference to the cached buffer for key, or null */
+struct mcache_buf *mcache_get(uint64_t key);
+/* add data (allocated with malloc) to the cache. the cache takes ownership of
+ * data. returns a new reference to the buffer, or null on failure.
+ */
+struct mcache_buf *mcache_add(uint64_t key, char *data, long size);
+void mcache_addref(struct mcache_buf *buf);
+void mcache_release(struct mcache_buf *buf);
+
+void mcache_clear(void);
+
+#endif	/* MEMCACHE_H_ */
@@ -21,17 +21,35 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <errno.h>
 #include "assfile_impl.h"
 #include "tar.h"
+#include "zfile.h"
+#include "blkcache.h"
 
 struct file_info {
 	struct tar_entry *tarent;
 	long roffs;
 	int eof;
+	/* compressed tarballs and deflated zip entries: per-file decompression
+	 * state, reading the stream from zbase, created on first use
+	 */
+	int compressed;
+	struct zfile *zf;
+	long zbase;
+	struct bcache_blk *cblk;	/* our reference to the current cached block */
 };
 
+/* deflated zip entries get a restart point every ZIP_SPAN bytes as they're
+ * read, so that seeking back doesn't start over from the beginning
+ */
+#define ZIP_SPAN	(256 * 1024)
+/* compressed data goes through the block cache in blocks of this size */
+#define CACHE_BLOCK_SIZE	65536
+
 static void *fop_open(const char *fname, void *udata);
 static void fop_close(void *fp, void *udata);
 static long fop_seek(void *fp, long offs, int whence, void *udata);
 static long fop_read(void *fp, void *buf, long size, void *udata);
+static int open_stream(struct tar *tar, struct file_info *file);
+static long read_cached(struct tar *tar, struct file_info *file, unsigned char *buf, long size);
 
 
 struct ass_fileops *ass_alloc_archive(const char *fname)
@@ -60,37 +78,80 @@ struct ass_fileops *ass_alloc_archive(const char *fname)
 
 void ass_free_archive(struct ass_fileops *fop)
 {
+	bcache_purge(fop->udata);
 	close_tar(fop->udata);
 	free(fop->udata);
 	fop->udata = 0;
 }
 
-static void *fop_open(const char *fname, void *udata)
+void ass_list_archive(struct ass_fileops *fop, ass_list_func func, void *cls)
 {
 	int i;
+	struct tar *tar = fop->udata;
+
+	for(i=0; i<tar->num_files; i++) {
+		func(tar->files[i].path, cls);
+	}
+}
+
+static void *fop_open(const char *fname, void *udata)
+{
 	struct file_info *file;
 	struct tar *tar = udata;
+	struct tar_entry *ent;
 
-	for(i=0; i<tar->num_files; i++) {
-		if(strcmp(fname, tar->files[i].path) == 0) {
-			if(!(file = malloc(sizeof *file))) {
-				ass_errno = ENOMEM;
-				return 0;
-			}
-			file->tarent = tar->files + i;
-			file->roffs = 0;
-			file->eof = 0;
-			return file;
-		}
+	if(!(ent = find_tar_entry(tar, fname))) {
+		ass_errno = ENOENT;
+		return 0;
+	}
+	if(resolve_tar_entry(tar, ent) == -1) {
+		ass_errno = EIO;
+		return 0;
 	}
 
-	ass_errno = ENOENT;
+	if(!(file = malloc(sizeof *file))) {
+		ass_errno = ENOMEM;
+		return 0;
+	}
+	file->tarent = ent;
+	file->roffs = 0;
+	file->eof = 0;
+	file->compressed = tar->zidx || ent->method == ARC_DEFLATED;
+	file->zf = 0;
+	file->zbase = 0;
+	file->cblk = 0;
+	return file;
+}
+
+/* decompression state is only needed when a read misses the block cache */
+static int open_stream(struct tar *tar, struct file_info *file)
+{
+	if(file->zf) return 0;
+
+	if(tar->zidx) {
+		if(!(file->zf = zf_open(tar->fp, 0))) {
+			return -1;
+		}
+		zf_use_index(file->zf, tar->zidx);
+		file->zbase = file->tarent->offset;
+	} else {
+		if(!(file->zf = zf_open_raw(tar->fp, file->tarent->offset))) {
+			return -1;
+		}
+		zf_build_index(file->zf, ZIP_SPAN);
+	}
 	return 0;
 }
 
 static void fop_close(void *fp, void *udata)
 {
-	free(fp);
+	struct file_info *file = fp;
+
+	if(file->cblk) {
+		bcache_release(file->cblk);
+	}
+	zf_close(file->zf);
+	free(file);
 }
 
 static long fop_seek(void *fp, long offs, int whence, void *udata)
@@ -143,6 +204,22 @@ static long fop_read(void *fp, void *buf, long size, void *udata)
 		newoffs = file->tarent->size;
 	}
 
+	if(file->compressed) {
+		if(bcache_enabled()) {
+			return read_cached(tar, file, buf, size);
+		}
+		/* sequential reads continue decompressing where the last one stopped,
+		 * anything else starts from the closest access point
+		 */
+		if(open_stream(tar, file) == -1 || zf_seek(file->zf, file->zbase + file->roffs, SEEK_SET) == -1 ||
+				(size = zf_read(file->zf, buf, size)) == -1) {
+			fprintf(stderr, "assfile mod_archive: fop_read failed to read compressed data\n");
+			return -1;
+		}
+		file->roffs += size;
+		return size;
+	}
+
 	if(fseek(tar->fp, file->tarent->offset + file->roffs, SEEK_SET) == -1) {
 		fprintf(stderr, "assfile mod_archive: fop_read failed to seek to %ld (%ld + %ld)\n",
 				file->tarent->offset + file->roffs, file->tarent->offset, file->roffs);
@@ -155,3 +232,50 @@ static long fop_read(void *fp, void *buf, long size, void *udata)
 	file->roffs = newoffs;
 	return size;
 }
+
+static long read_cached(struct tar *tar, struct file_info *file, unsigned char *buf, long size)
+{
+	long blk, boffs, blen, n, total = 0;
+	long fsize = file->tarent->size;
+	long entidx = file->tarent - tar->files;
+	unsigned char *data;
+
+	while(size > 0) {
+		blk = file->roffs / CACHE_BLOCK_SIZE;
+		boffs = file->roffs % CACHE_BLOCK_SIZE;
+		blen = fsize - blk * CACHE_BLOCK_SIZE;
+		if(blen > CACHE_BLOCK_SIZE) blen = CACHE_BLOCK_SIZE;
+		n = blen - boffs < size ? blen - boffs : size;
+
+		if(!file->cblk || file->cblk->block != blk) {
+			if(file->cblk) {
+				bcache_release(file->cblk);
+			}
+			if(!(file->cblk = bcache_get(tar, entidx, blk))) {
+				if(!(data = malloc(blen))) {
+					break;
+				}
+				if(open_stream(tar, file) == -1 ||
+						zf_seek(file->zf, file->zbase + blk * CACHE_BLOCK_SIZE, SEEK_SET) == -1 ||
+						zf_read(file->zf, data, blen) != blen ||
+						!(file->cblk = bcache_add(tar, entidx, blk, data, blen))) {
+					fprintf(stderr, "assfile mod_archive: fop_read failed to read compressed data\n");
+					free(data);
+					break;
+				}
+			}
+		}
+		memcpy(buf, file->cblk->data + boffs, n);
+
+		buf += n;
+		size -= n;
+		total += n;
+		file->roffs += n;
+	}
+
+	if(!total && size > 0) {
+		ass_errno = EIO;
+		return -1;
+	}
+	return total;
+}
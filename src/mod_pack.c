@@ -0,0 +1,686 @@
+/*
+assfile - library for accessing assets with an fopen/fread-like interface
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "assfile_impl.h"
+#include "pack.h"
+#include "hash.h"
+#include "lz4.h"
+#include "blkcache.h"
+#include "tpool.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+struct pack {
+	unsigned char *map;
+	uint64_t map_size;
+#ifdef WIN32
+	HANDLE fmap;
+#endif
+
+	struct pack_header *hdr;
+	struct pack_entry *dir;
+	uint32_t *htab;
+	const char *names;
+};
+
+/* reads covering at least this many whole blocks decompress them on the
+ * thread pool, in jobs of at least PAR_JOB_BLOCKS blocks
+ */
+#define PAR_MIN_BLOCKS	8
+#define PAR_JOB_BLOCKS	2
+
+/* a range of blocks decompressed by a thread pool job */
+struct decode_job {
+	struct file_info *file;
+	long blk, count;
+	unsigned char *dest;
+	int res;
+	struct tpool_job *job;
+};
+
+struct file_info {
+	struct pack *pack;
+	struct pack_entry *ent;
+	const char *name;
+	const unsigned char *data;
+	long roffs;
+
+	/* compressed files are decompressed one block at a time, and only the
+	 * blocks touched by reads
+	 */
+	int enc;
+	const uint64_t *blktab;
+	long num_blocks, blksz;
+	unsigned char *blkbuf;
+	long cur_blk;			/* block currently in blkbuf, or -1 */
+	/* or, with the block cache enabled, our reference to the current block */
+	struct bcache_blk *cblk;
+};
+
+static void *fop_open(const char *fname, void *udata);
+static void fop_close(void *fp, void *udata);
+static long fop_seek(void *fp, long offs, int whence, void *udata);
+static long fop_read(void *fp, void *buf, long size, void *udata);
+
+static int map_pack(struct pack *pack, const char *fname);
+static void unmap_pack(struct pack *pack);
+static void prefetch(struct pack *pack, uint64_t offs, uint64_t size);
+static int check_pack(struct pack *pack, const char *fname);
+static int check_entry(struct pack *pack, struct pack_entry *ent);
+static long read_encoded(struct file_info *file, unsigned char *buf, long size);
+static int decode_block(struct file_info *file, long blk, unsigned char *dest);
+static struct bcache_blk *get_block(struct file_info *file, long blk, long blen);
+static long decode_parallel(struct file_info *file, long blk, long count, unsigned char *dest);
+static void decode_job(void *cls);
+
+
+struct ass_fileops *ass_alloc_pack(const char *fname)
+{
+	struct ass_fileops *fop;
+	struct pack *pack;
+
+	if(!(pack = calloc(1, sizeof *pack))) {
+		return 0;
+	}
+	if(map_pack(pack, fname) == -1) {
+		free(pack);
+		return 0;
+	}
+	if(check_pack(pack, fname) == -1) {
+		unmap_pack(pack);
+		free(pack);
+		return 0;
+	}
+
+	if(!(fop = malloc(sizeof *fop))) {
+		unmap_pack(pack);
+		free(pack);
+		return 0;
+	}
+	if(pack->hdr->hot_size) {
+		prefetch(pack, pack->hdr->data_offs, pack->hdr->hot_size);
+	}
+
+	fop->udata = pack;
+	fop->open = fop_open;
+	fop->close = fop_close;
+	fop->seek = fop_seek;
+	fop->read = fop_read;
+	return fop;
+}
+
+const void *ass_map_pack(struct ass_fileops *fop, void *fp, long *size)
+{
+	struct file_info *file = fp;
+
+	if(fop->open != fop_open || file->enc != PACK_ENC_NONE) {
+		return 0;
+	}
+	*size = file->ent->size;
+	return file->data;
+}
+
+void ass_list_pack(struct ass_fileops *fop, ass_list_func func, void *cls)
+{
+	uint32_t i;
+	struct pack *pack = fop->udata;
+
+	for(i=0; i<pack->hdr->num_entries; i++) {
+		if(check_entry(pack, pack->dir + i) == 0) {
+			func(pack->names + pack->dir[i].name_offs, cls);
+		}
+	}
+}
+
+void ass_free_pack(struct ass_fileops *fop)
+{
+	bcache_purge(fop->udata);
+	unmap_pack(fop->udata);
+	free(fop->udata);
+	fop->udata = 0;
+}
+
+/* everything we're going to use directly from the mapping must be within the
+ * file, so that a truncated or corrupted pack can't make us read past it.
+ * Only the header is checked at mount time; entries are checked when they are
+ * looked up, so that mounting doesn't have to touch the whole directory.
+ */
+static int check_pack(struct pack *pack, const char *fname)
+{
+	struct pack_header *hdr = (struct pack_header*)pack->map;
+	struct pack_entry *ent;
+	uint64_t size = pack->map_size;
+
+	if(size < sizeof *hdr || memcmp(hdr->magic, PACK_MAGIC, PACK_MAGIC_LEN) != 0) {
+		fprintf(stderr, "assfile: %s is not a pack file\n", fname);
+		return -1;
+	}
+	if(hdr->byte_order != PACK_BYTE_ORDER) {
+		fprintf(stderr, "assfile: %s was built for a different byte order\n", fname);
+		return -1;
+	}
+	if(hdr->version != PACK_VERSION) {
+		fprintf(stderr, "assfile: %s: unsupported pack version: %u\n", fname, (unsigned int)hdr->version);
+		return -1;
+	}
+	if(hdr->hash_size & (hdr->hash_size - 1) || hdr->hash_size <= hdr->num_entries ||
+			hdr->dir_offs & 7 || hdr->hash_offs & 3 ||
+			hdr->dir_offs > size || (uint64_t)hdr->num_entries * sizeof *ent > size - hdr->dir_offs ||
+			hdr->hash_offs > size || (uint64_t)hdr->hash_size * sizeof *pack->htab > size - hdr->hash_offs ||
+			hdr->names_offs > size || hdr->names_size > size - hdr->names_offs) {
+		goto corrupt;
+	}
+
+	pack->hdr = hdr;
+	pack->dir = (struct pack_entry*)(pack->map + hdr->dir_offs);
+	pack->htab = (uint32_t*)(pack->map + hdr->hash_offs);
+	pack->names = (const char*)pack->map + hdr->names_offs;
+	return 0;
+
+corrupt:
+	fprintf(stderr, "assfile: %s: corrupted pack file\n", fname);
+	return -1;
+}
+
+static int check_entry(struct pack *pack, struct pack_entry *ent)
+{
+	uint64_t names_size = pack->hdr->names_size;
+
+	if(ent->name_offs >= names_size || ent->name_len >= names_size - ent->name_offs ||
+			pack->names[ent->name_offs + ent->name_len] != 0 ||
+			ent->offset > pack->map_size || ent->stored_size > pack->map_size - ent->offset) {
+		fprintf(stderr, "assfile: mod_pack: corrupted directory entry %d\n", (int)(ent - pack->dir));
+		return -1;
+	}
+	return 0;
+}
+
+static struct pack_entry *find_entry(struct pack *pack, const char *fname)
+{
+	uint64_t hash;
+	uint32_t i, idx, mask = pack->hdr->hash_size - 1;
+	struct pack_entry *ent;
+
+	hash = ass_hash64(fname, strlen(fname), 0);
+	idx = hash & mask;
+	for(i=0; i<=mask && pack->htab[idx]; i++) {
+		if(pack->htab[idx] <= pack->hdr->num_entries) {
+			ent = pack->dir + pack->htab[idx] - 1;
+			if(ent->hash == hash && check_entry(pack, ent) != -1 &&
+					strcmp(pack->names + ent->name_offs, fname) == 0) {
+				return ent;
+			}
+		}
+		idx = (idx + 1) & mask;
+	}
+	return 0;
+}
+
+static void *fop_open(const char *fname, void *udata)
+{
+	struct file_info *file;
+	struct pack_entry *ent;
+	struct pack *pack = udata;
+
+	if(!(ent = find_entry(pack, fname))) {
+		ass_errno = ENOENT;
+		return 0;
+	}
+
+	if(!(file = calloc(1, sizeof *file))) {
+		ass_errno = ENOMEM;
+		return 0;
+	}
+	file->pack = pack;
+	file->ent = ent;
+	file->name = pack->names + ent->name_offs;
+	file->data = pack->map + ent->offset;
+	file->roffs = 0;
+
+	switch((file->enc = ent->flags & PACK_ENC_MASK)) {
+	case PACK_ENC_NONE:
+		if(ent->stored_size != ent->size) {
+			goto corrupt;
+		}
+		break;
+
+#ifdef HAVE_ZLIB
+	case PACK_ENC_DEFLATE:
+#endif
+	case PACK_ENC_LZ4:
+		file->blksz = pack->hdr->block_size;
+		if(file->blksz <= 0 || file->blksz > PACK_MAX_BLOCK_SIZE) {
+			goto corrupt;
+		}
+		file->num_blocks = PACK_NUM_BLOCKS(ent, file->blksz);
+		if((file->num_blocks + 1) * sizeof *file->blktab > ent->stored_size || (ent->offset & 7)) {
+			goto corrupt;
+		}
+		file->blktab = (const uint64_t*)file->data;
+		if(!bcache_enabled() && !(file->blkbuf = malloc(file->blksz))) {
+			free(file);
+			ass_errno = ENOMEM;
+			return 0;
+		}
+		file->cur_blk = -1;
+		break;
+
+	default:
+		fprintf(stderr, "assfile: mod_pack: unsupported encoding (%d) for %s\n", file->enc, fname);
+		free(file);
+		ass_errno = EINVAL;
+		return 0;
+	}
+	return file;
+
+corrupt:
+	fprintf(stderr, "assfile: mod_pack: corrupted directory entry for %s\n", fname);
+	free(file);
+	ass_errno = EIO;
+	return 0;
+}
+
+static void fop_close(void *fp, void *udata)
+{
+	struct file_info *file = fp;
+
+	if(file->cblk) {
+		bcache_release(file->cblk);
+	}
+	free(file->blkbuf);
+	free(file);
+}
+
+static long fop_seek(void *fp, long offs, int whence, void *udata)
+{
+	long newoffs;
+	struct file_info *file = fp;
+
+	switch(whence) {
+	case SEEK_SET:
+		newoffs = offs;
+		break;
+
+	case SEEK_CUR:
+		newoffs = file->roffs + offs;
+		break;
+
+	case SEEK_END:
+		newoffs = file->ent->size + offs;
+		break;
+
+	default:
+		ass_errno = EINVAL;
+		return -1;
+	}
+
+	if(newoffs < 0) {
+		ass_errno = EINVAL;
+		return -1;
+	}
+
+	file->roffs = newoffs;
+	return newoffs;
+}
+
+static long fop_read(void *fp, void *buf, long size, void *udata)
+{
+	struct file_info *file = fp;
+	long fsize = file->ent->size;
+
+	if(file->roffs >= fsize) {
+		return 0;
+	}
+	if(size > fsize - file->roffs) {
+		size = fsize - file->roffs;
+	}
+	if(file->enc != PACK_ENC_NONE) {
+		return read_encoded(file, buf, size);
+	}
+	memcpy(buf, file->data + file->roffs, size);
+	file->roffs += size;
+	return size;
+}
+
+static long read_encoded(struct file_info *file, unsigned char *buf, long size)
+{
+	long blk, boffs, blen, n, total = 0;
+	long fsize = file->ent->size;
+
+	while(size > 0) {
+		blk = file->roffs / file->blksz;
+		boffs = file->roffs % file->blksz;
+		blen = fsize - blk * file->blksz;
+		if(blen > file->blksz) blen = file->blksz;
+		n = blen - boffs < size ? blen - boffs : size;
+
+		if(!boffs && size / file->blksz >= PAR_MIN_BLOCKS) {
+			/* large read, decompress all whole blocks in parallel, straight to
+			 * the destination. They bypass the block cache, which they'd only
+			 * flush anyway.
+			 */
+			if((n = decode_parallel(file, blk, size / file->blksz, buf)) <= 0) {
+				break;
+			}
+			buf += n;
+			size -= n;
+			total += n;
+			file->roffs += n;
+			continue;
+		}
+
+		if(!file->blkbuf) {
+			/* shared block cache */
+			if(!file->cblk || file->cblk->block != blk) {
+				if(file->cblk) {
+					bcache_release(file->cblk);
+				}
+				if(!(file->cblk = get_block(file, blk, blen))) {
+					break;
+				}
+			}
+			memcpy(buf, file->cblk->data + boffs, n);
+		} else if(n == blen && blk != file->cur_blk) {
+			/* whole block wanted, decompress it straight to the destination */
+			if(decode_block(file, blk, buf) == -1) {
+				break;
+			}
+		} else {
+			if(blk != file->cur_blk) {
+				if(decode_block(file, blk, file->blkbuf) == -1) {
+					file->cur_blk = -1;
+					break;
+				}
+				file->cur_blk = blk;
+			}
+			memcpy(buf, file->blkbuf + boffs, n);
+		}
+
+		buf += n;
+		size -= n;
+		total += n;
+		file->roffs += n;
+	}
+
+	if(!total && size > 0) {
+		ass_errno = EIO;
+		return -1;
+	}
+	return total;
+}
+
+static struct bcache_blk *get_block(struct file_info *file, long blk, long blen)
+{
+	struct bcache_blk *cblk;
+	unsigned char *data;
+	/* keyed by data offset rather than entry, so that entries sharing the
+	 * same data (see asspack deduplication) share cached blocks too
+	 */
+	long entidx = file->ent->offset;
+
+	if((cblk = bcache_get(file->pack, entidx, blk))) {
+		return cblk;
+	}
+
+	if(!(data = malloc(blen))) {
+		return 0;
+	}
+	if(decode_block(file, blk, data) == -1 || !(cblk = bcache_add(file->pack, entidx, blk, data, blen))) {
+		free(data);
+		return 0;
+	}
+	return cblk;
+}
+
+/* decompresses count whole blocks starting from blk, returns the number of
+ * bytes written to dest, or -1 on failure
+ */
+static long decode_parallel(struct file_info *file, long blk, long count, unsigned char *dest)
+{
+	struct thread_pool *tp;
+	struct decode_job *jobs;
+	long i, njobs, per_job, end = blk + count;
+	int nthr, res = 0;
+
+	if(!(tp = ass_get_thread_pool()) || (nthr = ass_tpool_num_threads(tp)) <= 1) {
+		nthr = 1;
+	}
+	/* a few jobs per thread, so that blocks which take longer to decompress
+	 * don't leave the other threads idle at the end
+	 */
+	per_job = count / (nthr * 4);
+	if(per_job < PAR_JOB_BLOCKS) per_job = PAR_JOB_BLOCKS;
+	njobs = (count + per_job - 1) / per_job;
+
+	if(!(jobs = malloc(njobs * sizeof *jobs))) {
+		return -1;
+	}
+	for(i=0; i<njobs; i++) {
+		jobs[i].file = file;
+		jobs[i].blk = blk + i * per_job;
+		jobs[i].count = end - jobs[i].blk < per_job ? end - jobs[i].blk : per_job;
+		jobs[i].dest = dest + i * per_job * file->blksz;
+		jobs[i].res = 0;
+		/* job 0 runs on this thread, as does any job we fail to submit */
+		jobs[i].job = i > 0 && nthr > 1 ? ass_tpool_submit(tp, jobs + i, decode_job, 0, ASS_TPOOL_PRIO_HIGH) : 0;
+	}
+
+	for(i=0; i<njobs; i++) {
+		if(!jobs[i].job) {
+			decode_job(jobs + i);
+		}
+	}
+	/* then take back jobs the pool hasn't started yet, from the end of the
+	 * queue, rather than wait for busy workers to get to them
+	 */
+	for(i=njobs - 1; i>0; i--) {
+		if(jobs[i].job && ass_tpool_cancel(tp, jobs[i].job) == 0) {
+			ass_tpool_job_release(jobs[i].job);
+			jobs[i].job = 0;
+			decode_job(jobs + i);
+		}
+	}
+	for(i=0; i<njobs; i++) {
+		if(jobs[i].job) {
+			if(ass_tpool_job_wait(jobs[i].job) == -1) {
+				jobs[i].res = -1;
+			}
+			ass_tpool_job_release(jobs[i].job);
+		}
+		if(jobs[i].res == -1) {
+			res = -1;
+		}
+	}
+	free(jobs);
+
+	return res == -1 ? -1 : count * file->blksz;
+}
+
+static void decode_job(void *cls)
+{
+	struct decode_job *job = cls;
+	long i;
+
+	for(i=0; i<job->count; i++) {
+		if(decode_block(job->file, job->blk + i, job->dest + i * job->file->blksz) == -1) {
+			job->res = -1;
+			return;
+		}
+	}
+}
+
+static int decode_block(struct file_info *file, long blk, unsigned char *dest)
+{
+	uint64_t start = file->blktab[blk];
+	uint64_t end = file->blktab[blk + 1];
+	long blen, clen;
+	const unsigned char *src;
+#ifdef HAVE_ZLIB
+	uLongf zlen;
+#endif
+
+	blen = file->ent->size - blk * file->blksz;
+	if(blen > file->blksz) blen = file->blksz;
+
+	if(start < (file->num_blocks + 1) * sizeof *file->blktab || start > end || end > file->ent->stored_size) {
+		goto corrupt;
+	}
+	src = file->data + start;
+	clen = end - start;
+
+	if(clen == blen) {
+		memcpy(dest, src, blen);	/* stored uncompressed */
+		return 0;
+	}
+
+	switch(file->enc) {
+	case PACK_ENC_LZ4:
+		if(ass_lz4_decompress(src, clen, dest, blen) != blen) {
+			goto corrupt;
+		}
+		break;
+
+#ifdef HAVE_ZLIB
+	case PACK_ENC_DEFLATE:
+		zlen = blen;
+		if(uncompress(dest, &zlen, src, clen) != Z_OK || zlen != blen) {
+			goto corrupt;
+		}
+		break;
+#endif
+	default:
+		goto corrupt;
+	}
+	return 0;
+
+corrupt:
+	fprintf(stderr, "assfile: mod_pack: corrupted block %ld of %s\n", blk, file->name);
+	return -1;
+}
+
+#ifdef WIN32
+static int map_pack(struct pack *pack, const char *fname)
+{
+	HANDLE fd;
+	LARGE_INTEGER sz;
+
+	if((fd = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0)) == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "assfile: failed to open pack file: %s\n", fname);
+		return -1;
+	}
+	if(!GetFileSizeEx(fd, &sz) || !sz.QuadPart) {
+		fprintf(stderr, "assfile: failed to get the size of pack file: %s\n", fname);
+		CloseHandle(fd);
+		return -1;
+	}
+	pack->map_size = sz.QuadPart;
+
+	/* the mapping keeps the file open */
+	pack->fmap = CreateFileMappingA(fd, 0, PAGE_READONLY, 0, 0, 0);
+	CloseHandle(fd);
+	if(!pack->fmap) {
+		fprintf(stderr, "assfile: failed to map pack file: %s\n", fname);
+		return -1;
+	}
+	if(!(pack->map = MapViewOfFile(pack->fmap, FILE_MAP_READ, 0, 0, 0))) {
+		fprintf(stderr, "assfile: failed to map pack file: %s\n", fname);
+		CloseHandle(pack->fmap);
+		return -1;
+	}
+	return 0;
+}
+
+static void unmap_pack(struct pack *pack)
+{
+	if(pack->map) {
+		UnmapViewOfFile(pack->map);
+		CloseHandle(pack->fmap);
+		pack->map = 0;
+	}
+}
+
+static void prefetch(struct pack *pack, uint64_t offs, uint64_t size)
+{
+	/* PrefetchVirtualMemory needs windows 8, just let it page in on demand */
+}
+
+#else	/* UNIX */
+
+static int map_pack(struct pack *pack, const char *fname)
+{
+	int fd;
+	struct stat st;
+	void *map;
+
+	if((fd = open(fname, O_RDONLY)) == -1) {
+		fprintf(stderr, "assfile: failed to open pack file: %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	if(fstat(fd, &st) == -1 || !st.st_size || (uint64_t)st.st_size != (size_t)st.st_size) {
+		fprintf(stderr, "assfile: can't map pack file: %s\n", fname);
+		close(fd);
+		return -1;
+	}
+	pack->map_size = st.st_size;
+
+	/* the mapping keeps the file open */
+	map = mmap(0, pack->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		fprintf(stderr, "assfile: failed to map pack file: %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	pack->map = map;
+	return 0;
+}
+
+static void unmap_pack(struct pack *pack)
+{
+	if(pack->map) {
+		munmap(pack->map, pack->map_size);
+		pack->map = 0;
+	}
+}
+
+/* starts reading a range of the pack into the page cache in the background */
+static void prefetch(struct pack *pack, uint64_t offs, uint64_t size)
+{
+	long pgsz = sysconf(_SC_PAGESIZE);
+	uint64_t start = offs & ~(uint64_t)(pgsz - 1);
+
+	if(offs >= pack->map_size) return;
+	if(size > pack->map_size - offs) {
+		size = pack->map_size - offs;
+	}
+	madvise(pack->map + start, size + (offs - start), MADV_WILLNEED);
+}
+#endif
@@ -0,0 +1,486 @@
+/*
+assfile - library for accessing assets with an fopen/fread-like interface
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "assfile_impl.h"
+#include "pack.h"
+#include "hash.h"
+
+/* Patch archives are tarballs, zip files or packs mounted over an archive or
+ * pack, adding or replacing files, and deleting files with whiteouts, as in
+ * OCI image layers: an empty file named .wh.<name> deletes <name> from the
+ * layers below, or everything under it if it's a directory, and an empty
+ * file named .wh..wh..opq deletes everything under its directory. Files in a
+ * patch are never deleted by its own whiteouts.
+ *
+ * The layers aren't searched in turn when files are opened: each patch is
+ * merged, when it's added, into a single index of which layer has the newest
+ * version of every path.
+ */
+#define WH_PREFIX		".wh."
+#define WH_PREFIX_LEN	4
+#define WH_OPAQUE		".wh..wh..opq"
+
+struct layer {
+	struct ass_fileops *fop;
+	int type;		/* MOD_ARCHIVE or MOD_PACK */
+};
+
+struct patch_ent {
+	const char *path;	/* owned by the layer */
+	uint64_t hash;
+	int layer;			/* -1 if it was deleted by a later layer */
+};
+
+/* directories deleted by the layer being merged, with the trailing slash
+ * ("" for an opaque whiteout at the root), see merge_whiteout
+ */
+struct wh_dir {
+	char *prefix;
+	uint64_t hash;
+};
+
+struct patchset {
+	struct layer *layers;
+	int num_layers;
+	/* resolved index, open addressing, empty slots have a null path. Deleted
+	 * paths keep their slots, so that probing never has to skip holes.
+	 */
+	struct patch_ent *htab;
+	uint32_t htab_size, htab_used;
+	int num_added, num_deleted;		/* by the last patch merged */
+
+	/* only used while merging a layer */
+	struct wh_dir *whtab;
+	uint32_t whtab_size, whtab_used;
+};
+
+static int add_layer(struct patchset *ps, int type, struct ass_fileops *fop);
+static void count_file(const char *path, void *cls);
+static int is_whiteout(const char *path, const char **base);
+static void merge_whiteout(const char *path, void *cls);
+static void merge_file(const char *path, void *cls);
+static struct patch_ent *find_ent(struct patchset *ps, const char *path, uint64_t hash);
+static void insert(struct patchset *ps, const char *path, int layer);
+static int delete_path(struct patchset *ps, const char *path);
+static void add_wh_dir(struct patchset *ps, char *prefix);
+static int find_wh_dir(struct patchset *ps, const char *path, int len);
+static void delete_wh_dirs(struct patchset *ps);
+static void free_wh_dirs(struct patchset *ps);
+static int grow(struct patchset *ps);
+static void free_layer(struct layer *layer);
+
+
+struct ass_fileops *ass_alloc_patch(int base_type, struct ass_fileops *base)
+{
+	struct ass_fileops *fop;
+	struct patchset *ps;
+
+	if(base_type != MOD_ARCHIVE && base_type != MOD_PACK) {
+		fprintf(stderr, "assfile: patches can only be mounted over archives and packs\n");
+		return 0;
+	}
+	if(!(ps = calloc(1, sizeof *ps))) {
+		return 0;
+	}
+	if(add_layer(ps, base_type, base) == -1) {
+		free(ps->layers);
+		free(ps->htab);
+		free(ps);
+		return 0;
+	}
+
+	if(!(fop = calloc(1, sizeof *fop))) {
+		free(ps->layers);
+		free(ps->htab);
+		free(ps);
+		return 0;
+	}
+	/* see ass_patch_lookup */
+	fop->udata = ps;
+	return fop;
+}
+
+int ass_add_patch_layer(struct ass_fileops *fop, const char *fname)
+{
+	struct patchset *ps = fop->udata;
+	struct ass_fileops *pfop;
+	int type;
+	FILE *fp;
+	char magic[PACK_MAGIC_LEN] = {0};
+
+	if(!(fp = fopen(fname, "rb"))) {
+		fprintf(stderr, "assfile: failed to open patch: %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	fread(magic, 1, sizeof magic, fp);
+	fclose(fp);
+
+	if(memcmp(magic, PACK_MAGIC, PACK_MAGIC_LEN) == 0) {
+		type = MOD_PACK;
+		pfop = ass_alloc_pack(fname);
+	} else {
+		type = MOD_ARCHIVE;
+		pfop = ass_alloc_archive(fname);
+	}
+	if(!pfop) {
+		fprintf(stderr, "assfile: failed to load patch: %s\n", fname);
+		return -1;
+	}
+	if(add_layer(ps, type, pfop) == -1) {
+		struct layer tmp;
+		tmp.fop = pfop;
+		tmp.type = type;
+		free_layer(&tmp);
+		return -1;
+	}
+
+	if(ass_verbose) {
+		fprintf(stderr, "assfile: patch %s: %d files added or replaced, %d deleted\n", fname,
+				ps->num_added, ps->num_deleted);
+	}
+	return 0;
+}
+
+struct ass_fileops *ass_patch_lookup(struct ass_fileops *fop, const char *path)
+{
+	struct patchset *ps = fop->udata;
+	struct patch_ent *ent;
+
+	ent = find_ent(ps, path, ass_hash64(path, strlen(path), 0));
+	if(!ent || ent->layer < 0) {
+		ass_errno = ENOENT;
+		return 0;
+	}
+	return ps->layers[ent->layer].fop;
+}
+
+void ass_free_patch(struct ass_fileops *fop)
+{
+	int i;
+	struct patchset *ps = fop->udata;
+
+	if(!ps) return;
+
+	for(i=0; i<ps->num_layers; i++) {
+		free_layer(ps->layers + i);
+	}
+	free(ps->layers);
+	free(ps->htab);
+	free(ps);
+	fop->udata = 0;
+}
+
+static void free_layer(struct layer *layer)
+{
+	if(layer->type == MOD_PACK) {
+		ass_free_pack(layer->fop);
+	} else {
+		ass_free_archive(layer->fop);
+	}
+	free(layer->fop);
+}
+
+/* merges a layer into the index: deletions first, so that they only apply to
+ * the layers below, then its files. The index is grown beforehand to have
+ * room for all of them, so that merging can't fail half way through.
+ */
+static int add_layer(struct patchset *ps, int type, struct ass_fileops *fop)
+{
+	struct layer *tmp;
+	void (*list_func)(struct ass_fileops*, ass_list_func, void*);
+	uint32_t count = 0;
+
+	list_func = type == MOD_PACK ? ass_list_pack : ass_list_archive;
+	list_func(fop, count_file, &count);
+	while((ps->htab_used + count) * 2 > ps->htab_size) {
+		if(grow(ps) == -1) {
+			return -1;
+		}
+	}
+
+	if(!(tmp = realloc(ps->layers, (ps->num_layers + 1) * sizeof *ps->layers))) {
+		perror("assfile: failed to allocate patch layer");
+		return -1;
+	}
+	ps->layers = tmp;
+	ps->layers[ps->num_layers].fop = fop;
+	ps->layers[ps->num_layers].type = type;
+	ps->num_added = ps->num_deleted = 0;
+
+	list_func(fop, merge_whiteout, ps);
+	delete_wh_dirs(ps);
+	free_wh_dirs(ps);
+	ps->num_layers++;
+	list_func(fop, merge_file, ps);
+	return 0;
+}
+
+static void count_file(const char *path, void *cls)
+{
+	(*(uint32_t*)cls)++;
+}
+
+static int is_whiteout(const char *path, const char **base)
+{
+	const char *slash = strrchr(path, '/');
+
+	*base = slash ? slash + 1 : path;
+	return strncmp(*base, WH_PREFIX, WH_PREFIX_LEN) == 0;
+}
+
+static void merge_whiteout(const char *path, void *cls)
+{
+	struct patchset *ps = cls;
+	const char *base;
+	char *target;
+	int dirlen;
+
+	if(!is_whiteout(path, &base)) {
+		return;
+	}
+	dirlen = base - path;
+
+	if(!(target = malloc(strlen(path) + 2))) {
+		perror("assfile: failed to apply patch whiteout");
+		return;
+	}
+	memcpy(target, path, dirlen);
+	if(strcmp(base, WH_OPAQUE) == 0) {
+		/* everything under the directory */
+		target[dirlen] = 0;
+	} else {
+		/* the file, or everything under it if it's a directory */
+		strcpy(target + dirlen, base + WH_PREFIX_LEN);
+		if(delete_path(ps, target)) {
+			free(target);
+			return;
+		}
+		strcat(target, "/");
+	}
+	/* directories are deleted all at once after the whiteouts, so that
+	 * merging a layer scans the index once, however many there are
+	 */
+	add_wh_dir(ps, target);
+}
+
+static void merge_file(const char *path, void *cls)
+{
+	struct patchset *ps = cls;
+	const char *base;
+
+	if(!is_whiteout(path, &base)) {
+		insert(ps, path, ps->num_layers - 1);
+		ps->num_added++;
+	}
+}
+
+static struct patch_ent *find_ent(struct patchset *ps, const char *path, uint64_t hash)
+{
+	uint32_t i, idx, mask = ps->htab_size - 1;
+	struct patch_ent *ent;
+
+	if(!ps->htab_size) return 0;
+
+	idx = hash & mask;
+	for(i=0; i<ps->htab_size; i++) {
+		ent = ps->htab + idx;
+		if(!ent->path) break;
+		if(ent->hash == hash && strcmp(ent->path, path) == 0) {
+			return ent;
+		}
+		idx = (idx + 1) & mask;
+	}
+	return 0;
+}
+
+/* the table always has room, see add_layer */
+static void insert(struct patchset *ps, const char *path, int layer)
+{
+	uint32_t idx, mask = ps->htab_size - 1;
+	uint64_t hash = ass_hash64(path, strlen(path), 0);
+	struct patch_ent *ent;
+
+	idx = hash & mask;
+	for(;;) {
+		ent = ps->htab + idx;
+		if(!ent->path) {
+			ps->htab_used++;
+			break;
+		}
+		if(ent->hash == hash && strcmp(ent->path, path) == 0) {
+			break;
+		}
+		idx = (idx + 1) & mask;
+	}
+	ent->path = path;	/* the newest layer's copy, the older one might go away */
+	ent->hash = hash;
+	ent->layer = layer;
+}
+
+/* returns 1 if path was a file in the layers below */
+static int delete_path(struct patchset *ps, const char *path)
+{
+	struct patch_ent *ent;
+
+	if((ent = find_ent(ps, path, ass_hash64(path, strlen(path), 0))) && ent->layer >= 0) {
+		ent->layer = -1;
+		ps->num_deleted++;
+		return 1;
+	}
+	return 0;
+}
+
+/* takes ownership of prefix */
+static void add_wh_dir(struct patchset *ps, char *prefix)
+{
+	uint32_t i, idx, newsz, mask;
+	uint64_t hash = ass_hash64(prefix, strlen(prefix), 0);
+	struct wh_dir *newtab;
+
+	if(find_wh_dir(ps, prefix, strlen(prefix))) {
+		free(prefix);
+		return;
+	}
+
+	if((ps->whtab_used + 1) * 2 > ps->whtab_size) {
+		newsz = ps->whtab_size ? ps->whtab_size * 2 : 16;
+		if(!(newtab = calloc(newsz, sizeof *newtab))) {
+			perror("assfile: failed to apply patch whiteout");
+			free(prefix);
+			return;
+		}
+		mask = newsz - 1;
+		for(i=0; i<ps->whtab_size; i++) {
+			if(!ps->whtab[i].prefix) continue;
+			idx = ps->whtab[i].hash & mask;
+			while(newtab[idx].prefix) {
+				idx = (idx + 1) & mask;
+			}
+			newtab[idx] = ps->whtab[i];
+		}
+		free(ps->whtab);
+		ps->whtab = newtab;
+		ps->whtab_size = newsz;
+	}
+
+	mask = ps->whtab_size - 1;
+	idx = hash & mask;
+	while(ps->whtab[idx].prefix) {
+		idx = (idx + 1) & mask;
+	}
+	ps->whtab[idx].prefix = prefix;
+	ps->whtab[idx].hash = hash;
+	ps->whtab_used++;
+}
+
+/* is the first len characters of path one of the deleted directories */
+static int find_wh_dir(struct patchset *ps, const char *path, int len)
+{
+	uint32_t idx, mask = ps->whtab_size - 1;
+	uint64_t hash;
+	struct wh_dir *wd;
+
+	if(!ps->whtab_used) return 0;
+
+	hash = ass_hash64(path, len, 0);
+	idx = hash & mask;
+	while((wd = ps->whtab + idx)->prefix) {
+		if(wd->hash == hash && strncmp(wd->prefix, path, len) == 0 && !wd->prefix[len]) {
+			return 1;
+		}
+		idx = (idx + 1) & mask;
+	}
+	return 0;
+}
+
+/* deletes everything under the directories collected by merge_whiteout, in a
+ * single pass over the index, looking up each entry's parent directories
+ */
+static void delete_wh_dirs(struct patchset *ps)
+{
+	uint32_t i;
+	const char *ptr;
+	struct patch_ent *ent = ps->htab;
+	int root;
+
+	if(!ps->whtab_used) return;
+	root = find_wh_dir(ps, "", 0);
+
+	for(i=0; i<ps->htab_size; i++, ent++) {
+		if(!ent->path || ent->layer < 0) continue;
+
+		if(!root) {
+			ptr = ent->path;
+			while((ptr = strchr(ptr, '/'))) {
+				ptr++;
+				if(find_wh_dir(ps, ent->path, ptr - ent->path)) {
+					break;
+				}
+			}
+			if(!ptr) continue;
+		}
+		ent->layer = -1;
+		ps->num_deleted++;
+	}
+}
+
+static void free_wh_dirs(struct patchset *ps)
+{
+	uint32_t i;
+
+	for(i=0; i<ps->whtab_size; i++) {
+		free(ps->whtab[i].prefix);
+	}
+	free(ps->whtab);
+	ps->whtab = 0;
+	ps->whtab_size = ps->whtab_used = 0;
+}
+
+/* doubles the size of the index, and drops the deleted paths */
+static int grow(struct patchset *ps)
+{
+	uint32_t i, idx, newsz, mask;
+	struct patch_ent *newtab, *ent;
+
+	newsz = ps->htab_size ? ps->htab_size * 2 : 64;
+	if(!(newtab = calloc(newsz, sizeof *newtab))) {
+		perror("assfile: failed to resize patch index");
+		return -1;
+	}
+	mask = newsz - 1;
+
+	ps->htab_used = 0;
+	for(i=0; i<ps->htab_size; i++) {
+		ent = ps->htab + i;
+		if(!ent->path || ent->layer < 0) continue;
+
+		idx = ent->hash & mask;
+		while(newtab[idx].path) {
+			idx = (idx + 1) & mask;
+		}
+		newtab[idx] = *ent;
+		ps->htab_used++;
+	}
+	free(ps->htab);
+	ps->htab = newtab;
+	ps->htab_size = newsz;
+	return 0;
+}
@@ -19,14 +19,28 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <ctype.h>
 #include "assfile_impl.h"
 
 #ifdef BUILD_MOD_URL
 #include <pthread.h>
 #include <curl/curl.h>
 #include <sys/stat.h>
+#include <time.h>
+
+#ifdef WIN32
+#include <process.h>
+#define getpid	_getpid
+#else
+#include <unistd.h>
+#endif
+
 #include "tpool.h"
 #include "md4.h"
+#include "hash.h"
+#include "diskcache.h"
+#include "memcache.h"
+#include "zfile.h"
 
 enum {
 	DL_UNKNOWN,
@@ -35,16 +49,165 @@ enum {
 	DL_DONE
 };
 
-struct file_info {
+/* outcome of a request to a mirror */
+enum {
+	XFER_OK,
+	XFER_FAILED,
+	XFER_MISSING,	/* the mirror responded, but doesn't have the file */
+	XFER_MISMATCH,	/* got the file, but it doesn't match the manifest */
+	XFER_LOST,		/* another request for the same file got there first */
+	XFER_ABORTED,
+	XFER_ENCODING	/* asked for gzip, got an encoding we can't decode ourselves */
+};
+
+/* content encoding of a response received without decoding */
+enum {
+	ENC_IDENTITY,
+	ENC_GZIP,
+	ENC_OTHER		/* something we can't decode */
+};
+
+/* cache file names relative to the cache dir look like: xx/xxxxxxxxxxxxxxxx */
+#define CACHE_NAME_LEN	19
+
+/* cache files holding a compressed response start with this header, followed
+ * by the gzip stream as it came from the server
+ */
+#define ZCACHE_MAGIC	"\211ASZ\r\n\032\n"
+#define ZCACHE_HDR_LEN	8
+
+#define MAX_MIRRORS		32
+/* bitmask of all n mirrors, without shifting by 32 */
+#define ALL_MIRRORS(n)	((n) >= 32 ? ~0u : (1u << (n)) - 1)
+/* a mirror which fails is avoided for BACKOFF_MIN seconds, doubling with each
+ * consecutive failure, up to BACKOFF_MAX seconds
+ */
+#define BACKOFF_MIN		1.0
+#define BACKOFF_MAX		60.0
+/* weight of each new sample in the mirror latency/throughput averages */
+#define EWMA_WEIGHT		0.25
+/* typical file size, used to weigh throughput against latency when ranking mirrors */
+#define NOMINAL_SIZE	65536.0
+/* nanoseconds between attempts to take a cache lock held by another process */
+#define LOCK_POLL_NSEC	50000000
+
+struct mirror {
 	char *url;
+	double latency;			/* moving average of the time to first byte (seconds) */
+	double rate;			/* moving average of the transfer rate (bytes/second) */
+	int nsamples;
+	int fails;				/* consecutive failures */
+	double retry_time;		/* considered down until this time */
+	int pending;			/* requests in flight */
+	double probe_time;		/* when the first request to the mirror was sent */
+};
+
+/* a url mount, with one or more mirrors serving the same files. Passed to the
+ * fileops callbacks as udata. Open files and preconnect jobs hold references
+ * to it, because they might outlive the mount.
+ */
+struct url_mount {
+	struct mirror *mirrors;
+	int num_mirrors;
+	int nref;
+	pthread_mutex_t lock;	/* protects the mirror statistics and the manifest */
+
+	/* files listed in prefetch manifests, open addressing hash table keyed
+	 * by the cache key of each file
+	 */
+	struct manifest_entry *manifest;
+	int manifest_size, manifest_count;
+};
+
+struct manifest_entry {
+	uint64_t key;			/* 0 for empty slots */
+	uint64_t hash;			/* hash of the file contents */
+	long size;
+};
+
+struct file_info;
+
+/* a single request for a file, to one of the mirrors */
+struct xfer {
+	struct file_info *file;
+	CURL *curl;
+	int mirror;
+	int raw;			/* curl doesn't decode the response for us */
+	int encoding;		/* Content-Encoding of the response */
+};
+
+struct file_info {
+	struct url_mount *mnt;
+	char *url;					/* url of the file on the first mirror */
+	const char *name;			/* url without the mirror part */
+	uint64_t hash;				/* hash of the url, used as the cache key */
 	char *cache_fname;
+	const char *cache_name;		/* cache_fname without the cachedir part */
+	char *tmp_fname;			/* downloads go here, and get renamed to cache_fname when done */
 
 	FILE *cache_file;
 
+	/* compressed transfers, when ASS_URL_CACHE_COMPRESSED is set, are stored
+	 * in the cache as they arrive, and decompressed by zf when reading
+	 */
+	int zcache;
+	struct zfile *zf;
+
+	/* small files are served from the shared in-memory cache */
+	struct mcache_buf *mbuf;
+	long mem_offs;
+
+	/* while downloading, data are collected in dlbuf until they exceed the
+	 * in-memory threshold, at which point they are spilled to the cache file
+	 */
+	char *dlbuf;
+	long dlbuf_size, dlbuf_max;
+	int to_file;
+
 	/* fopen-thread waits until the state becomes known (request starts transmitting or fails) */
 	int state;
 	pthread_cond_t state_cond;
 	pthread_mutex_t state_mutex;
+
+	/* the file is shared between the opener and the download job. Whoever
+	 * drops the last reference frees it. abort is set by fop_close to ask
+	 * the download to stop early.
+	 */
+	int nref;
+	int abort;
+
+	/* more than one request for the file might be in flight, if it got
+	 * hedged, or retried on another mirror. The first one to receive any
+	 * data becomes the owner, and the rest stop. The last download job to
+	 * finish cleans up.
+	 */
+	struct xfer *owner;
+	unsigned int tried;			/* mirrors tried so far (bitmask) */
+	int njobs;					/* download jobs working on this file */
+	int attempts;
+	double start_time;			/* when the first request was sent */
+	int hedged;
+	int locked;					/* we hold the inflight entry and cache lock */
+
+	/* files listed in a prefetch manifest are checked against its size and
+	 * hash, before they are accepted into the cache
+	 */
+	int verify;
+	long expect_size, recv_size;
+	uint64_t expect_hash;
+	struct ass_hash64_state hstate;
+	int prefetch;				/* bulk prefetch, nobody is waiting to read it */
+
+	struct file_info *inflight_next;
+};
+
+/* background connection warm-up for a mirror of a newly added url mount */
+struct preconn {
+	struct url_mount *mnt;
+	int mirror;
+	char *url;
+	int nref;			/* one per queued preconnect job */
+	char *warm;			/* which curl handles have connected already */
 };
 
 static void *fop_open(const char *fname, void *udata);
@@ -54,21 +217,113 @@ static long fop_read(void *fp, void *buf, long size, void *udata);
 
 static void exit_cleanup(void);
 static void download(void *data);
+static void hedge(void *data);
+static void fetch(struct file_info *file, CURL *c);
+static void set_decoding(CURL *c, int raw);
+static int finish_download(struct file_info *file);
+static void finish_job(struct file_info *file);
+static int pick_mirror(struct url_mount *mnt, unsigned int skip);
+static void begin_request(struct mirror *m, double now);
+static char *mirror_url(struct url_mount *mnt, int mirror, const char *name);
+static void update_mirror(struct url_mount *mnt, int mirror, CURL *c, int status);
+static void reset_download(struct file_info *file);
+static double get_time(void);
+static void release_mount(struct url_mount *mnt);
+static int acquire_curl(char *mark);
+static void release_curl(int idx);
+static void evict(void *data);
+static void write_behind(void *data);
+static void start_preconnect(struct url_mount *mnt, int mirror);
+static void preconnect(void *data);
+static void submit(tpool_callback func, void *data, int prio);
+static void job_finished(void *data);
+static int begin_download(struct file_info *file);
+static void end_download(struct file_info *file);
+static void leave_inflight(struct file_info *file);
+static int open_cache_file(struct file_info *file);
+static char *tmp_filename(const char *fname);
+static int mkdir_parent(const char *path);
+static void cache_name(uint64_t hash, char *buf);
+static FILE *open_cached(struct file_info *file);
+static int migrate_legacy(struct file_info *file);
+static int dlbuf_append(struct file_info *file, const char *data, long size);
+static int inflate_dlbuf(struct file_info *file);
 static size_t recv_callback(char *ptr, size_t size, size_t nmemb, void *udata);
+static size_t header_callback(char *ptr, size_t size, size_t nmemb, void *udata);
+static int xferinfo_callback(void *udata, curl_off_t dltotal, curl_off_t dlnow,
+		curl_off_t ultotal, curl_off_t ulnow);
+static struct file_info *new_file(struct url_mount *mnt, const char *fname);
+static void release_file(struct file_info *file);
+static int add_manifest_entry(struct url_mount *mnt, uint64_t key, long size, uint64_t hash);
+static int lookup_manifest(struct file_info *file);
+static int parse_manifest(struct url_mount *mnt, char *text);
+static void throttle(long size);
+static void timed_wait(struct file_info *file, double deadline);
 static const char *get_temp_dir(void);
 static int mkdir_path(const char *path);
+static void share_lock_func(CURL *handle, curl_lock_data data, curl_lock_access access, void *udata);
+static void share_unlock_func(CURL *handle, curl_lock_data data, void *udata);
+static void cleanup_curl(void);
 
 static char *tmpdir, *cachedir;
 static struct thread_pool *tpool;
+
+/* curl handles, one per worker thread. Idle handles are kept in a stack, and
+ * jobs take the one on top, which is the one used most recently, and the most
+ * likely to have a live connection to the server we're about to talk to.
+ */
 static CURL **curl;
+static int num_curl;
+static int *idle_curl, num_idle;
+static pthread_mutex_t curl_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the curl handles of all workers share DNS lookups and TLS sessions, so that
+ * only the first connection to a host pays for a full handshake. Connections
+ * themselves stay per-handle, because libcurl doesn't support using a shared
+ * connection cache from concurrent threads.
+ */
+static CURLSH *share;
+static pthread_mutex_t share_mutex[CURL_LOCK_DATA_LAST];
+
+/* jobs submitted to the thread pool which haven't finished yet. The pool is
+ * shared with the rest of the library, so at exit we have to wait for our own
+ * jobs, before cleaning up the curl handles they use.
+ */
+static int num_jobs, quitting;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+/* bulk prefetch progress */
+static int prefetch_pending, prefetch_failed;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
 
-struct ass_fileops *ass_alloc_url(const char *url)
+/* token bucket for the prefetch bandwidth cap */
+static double bucket_tokens, bucket_time;
+static pthread_mutex_t bucket_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* list of downloads in progress in this process */
+static struct file_info *inflight;
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inflight_cond = PTHREAD_COND_INITIALIZER;
+
+/* lazy mounts (ASS_MOUNT_BACKGROUND) call ass_alloc_url from pool threads */
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct ass_fileops *ass_alloc_url(const char **urls, int count)
 {
 	static int done_init;
 	struct ass_fileops *fop;
+	struct url_mount *mnt;
 	int i, len;
 	char *ptr;
 
+	if(count < 1 || count > MAX_MIRRORS) {
+		fprintf(stderr, "assfile: mod_url: invalid number of mirrors: %d (max %d)\n", count, MAX_MIRRORS);
+		return 0;
+	}
+
+	pthread_mutex_lock(&init_lock);
 	if(!done_init) {
 		curl_global_init(CURL_GLOBAL_ALL);
 		atexit(exit_cleanup);
@@ -87,189 +342,441 @@ struct ass_fileops *ass_alloc_url(const char *url)
 			fprintf(stderr, "assfile mod_url: failed to create cache directory: %s\n", cachedir);
 			goto init_failed;
 		}
+		if(dcache_init(cachedir) == -1) {
+			fprintf(stderr, "assfile mod_url: cache size limits disabled\n");
+		}
+
+		/* downloads run on the library-wide thread pool, with one curl handle
+		 * per worker thread.
+		 */
+		if(!(tpool = ass_get_thread_pool())) {
+			fprintf(stderr, "assfile: failed to create thread pool\n");
+			goto init_failed;
+		}
+		ass_tpool_addref(tpool);
+		num_curl = ass_tpool_num_threads(tpool);
 
-		if(ass_mod_url_max_threads <= 0) {
-			ass_mod_url_max_threads = 8;
+		if((share = curl_share_init())) {
+			for(i=0; i<CURL_LOCK_DATA_LAST; i++) {
+				pthread_mutex_init(share_mutex + i, 0);
+			}
+			curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock_func);
+			curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock_func);
+			curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+			curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
 		}
 
-		if(!(curl = calloc(ass_mod_url_max_threads, sizeof *curl))) {
+		if(!(curl = calloc(num_curl, sizeof *curl)) || !(idle_curl = malloc(num_curl * sizeof *idle_curl))) {
 			perror("assfile: failed to allocate curl context table");
 			goto init_failed;
 		}
-		for(i=0; i<ass_mod_url_max_threads; i++) {
+		for(i=0; i<num_curl; i++) {
 			if(!(curl[i] = curl_easy_init())) {
 				goto init_failed;
 			}
 			curl_easy_setopt(curl[i], CURLOPT_WRITEFUNCTION, recv_callback);
-		}
-
-		if(!(tpool = ass_tpool_create(ass_mod_url_max_threads))) {
-			fprintf(stderr, "assfile: failed to create thread pool\n");
-			goto init_failed;
+			curl_easy_setopt(curl[i], CURLOPT_HEADERFUNCTION, header_callback);
+			curl_easy_setopt(curl[i], CURLOPT_XFERINFOFUNCTION, xferinfo_callback);
+			curl_easy_setopt(curl[i], CURLOPT_NOPROGRESS, 0L);
+			/* don't cache error pages as file contents */
+			curl_easy_setopt(curl[i], CURLOPT_FAILONERROR, 1L);
+			if(share) {
+				curl_easy_setopt(curl[i], CURLOPT_SHARE, share);
+			}
+			idle_curl[num_idle++] = i;
 		}
 
 		done_init = 1;
 	}
+	pthread_mutex_unlock(&init_lock);
 
 	if(!(fop = malloc(sizeof *fop))) {
 		return 0;
 	}
-	len = strlen(url);
-	if(!(fop->udata = malloc(len + 1))) {
+	if(!(mnt = calloc(1, sizeof *mnt)) || !(mnt->mirrors = calloc(count, sizeof *mnt->mirrors))) {
+		free(mnt);
 		free(fop);
 		return 0;
 	}
-	memcpy(fop->udata, url, len + 1);
-	if(len) {
-		ptr = (char*)fop->udata + len - 1;
-		while(*ptr == '/') *ptr-- = 0;
+	for(i=0; i<count; i++) {
+		len = strlen(urls[i]);
+		if(!(mnt->mirrors[i].url = malloc(len + 1))) {
+			while(--i >= 0) free(mnt->mirrors[i].url);
+			free(mnt->mirrors);
+			free(mnt);
+			free(fop);
+			return 0;
+		}
+		memcpy(mnt->mirrors[i].url, urls[i], len + 1);
+		if(len) {
+			ptr = mnt->mirrors[i].url + len - 1;
+			while(*ptr == '/') *ptr-- = 0;
+		}
 	}
+	mnt->num_mirrors = count;
+	mnt->nref = 1;
+	pthread_mutex_init(&mnt->lock, 0);
 
+	fop->udata = mnt;
 	fop->open = fop_open;
 	fop->close = fop_close;
 	fop->seek = fop_seek;
 	fop->read = fop_read;
+
+	if(ass_mod_url_preconnect > 0) {
+		for(i=0; i<count; i++) {
+			start_preconnect(mnt, i);
+		}
+	}
 	return fop;
 
 init_failed:
 	free(cachedir);
-	if(curl) {
-		for(i=0; i<ass_mod_url_max_threads; i++) {
-			if(curl[i]) {
-				curl_easy_cleanup(curl[i]);
-			}
-		}
-		free(curl);
+	cachedir = 0;
+	cleanup_curl();
+	if(tpool) {
+		ass_tpool_release(tpool);
+		tpool = 0;
 	}
+	pthread_mutex_unlock(&init_lock);
 	return 0;
 }
 
 static void exit_cleanup(void)
 {
-	int i;
-
 	if(tpool) {
-		ass_tpool_destroy(tpool);
+		/* abort transfers in progress and wait for all our jobs to finish */
+		pthread_mutex_lock(&jobs_lock);
+		__atomic_store_n(&quitting, 1, __ATOMIC_RELAXED);
+		while(num_jobs > 0) {
+			pthread_cond_wait(&jobs_cond, &jobs_lock);
+		}
+		pthread_mutex_unlock(&jobs_lock);
+
+		ass_tpool_release(tpool);
+		tpool = 0;
 	}
+	dcache_shutdown();
+	mcache_clear();
+	cleanup_curl();
+	curl_global_cleanup();
+}
+
+static void cleanup_curl(void)
+{
+	int i;
+
 	if(curl) {
-		for(i=0; i<ass_mod_url_max_threads; i++) {
+		for(i=0; i<num_curl; i++) {
 			if(curl[i]) {
 				curl_easy_cleanup(curl[i]);
 			}
 		}
 		free(curl);
+		curl = 0;
+	}
+	free(idle_curl);
+	idle_curl = 0;
+	num_idle = 0;
+	/* the share can only go away after all the handles using it */
+	if(share) {
+		curl_share_cleanup(share);
+		share = 0;
+		for(i=0; i<CURL_LOCK_DATA_LAST; i++) {
+			pthread_mutex_destroy(share_mutex + i);
+		}
 	}
-	curl_global_cleanup();
 }
 
+/* takes the most recently used idle curl handle. If a mark array is passed,
+ * handles already marked in it are skipped, and the one returned gets marked.
+ * Returns the index of the handle, or -1 if none is available.
+ */
+static int acquire_curl(char *mark)
+{
+	int i, idx = -1;
+
+	pthread_mutex_lock(&curl_lock);
+	for(i=num_idle-1; i>=0; i--) {
+		if(!mark || !mark[idle_curl[i]]) {
+			idx = idle_curl[i];
+			if(mark) mark[idx] = 1;
+			memmove(idle_curl + i, idle_curl + i + 1, (num_idle - i - 1) * sizeof *idle_curl);
+			num_idle--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&curl_lock);
+	return idx;
+}
 
-void ass_free_url(struct ass_fileops *fop)
+static void release_curl(int idx)
 {
-	free(fop->udata);
+	pthread_mutex_lock(&curl_lock);
+	idle_curl[num_idle++] = idx;
+	pthread_mutex_unlock(&curl_lock);
 }
 
-static char *cache_filename(const char *fname, const char *url)
+static void share_lock_func(CURL *handle, curl_lock_data data, curl_lock_access access, void *udata)
 {
-	MD4_CTX md4ctx;
-	unsigned char sum[16];
-	char sumstr[33];
-	char *resfname;
-	int i, prefix_len;
-	int url_len = strlen(url);
+	pthread_mutex_lock(share_mutex + data);
+}
 
-	MD4Init(&md4ctx);
-	MD4Update(&md4ctx, (unsigned char*)url, url_len);
-	MD4Final((unsigned char*)sum, &md4ctx);
+static void share_unlock_func(CURL *handle, curl_lock_data data, void *udata)
+{
+	pthread_mutex_unlock(share_mutex + data);
+}
 
-	for(i=0; i<16; i++) {
-		sprintf(sumstr + i * 2, "%02x", (unsigned int)sum[i]);
+
+void ass_free_url(struct ass_fileops *fop)
+{
+	release_mount(fop->udata);
+}
+
+static void release_mount(struct url_mount *mnt)
+{
+	int i;
+
+	if(__atomic_sub_fetch(&mnt->nref, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
 	}
-	sumstr[32] = 0;
+	for(i=0; i<mnt->num_mirrors; i++) {
+		free(mnt->mirrors[i].url);
+	}
+	free(mnt->mirrors);
+	free(mnt->manifest);
+	pthread_mutex_destroy(&mnt->lock);
+	free(mnt);
+}
 
-	prefix_len = strlen(cachedir);
-	if(!(resfname = malloc(prefix_len + 64))) {
+static char *cache_filename(uint64_t hash)
+{
+	char *resfname;
+	int prefix_len = strlen(cachedir);
+
+	if(!(resfname = malloc(prefix_len + CACHE_NAME_LEN + 2))) {
 		return 0;
 	}
-	sprintf(resfname, "%s/%s", cachedir, sumstr);
+	memcpy(resfname, cachedir, prefix_len);
+	resfname[prefix_len] = '/';
+	cache_name(hash, resfname + prefix_len + 1);
 	return resfname;
 }
 
-static void *fop_open(const char *fname, void *udata)
+/* shard the cache in subdirectories by the first byte of the hash, to avoid
+ * ending up with huge directories
+ */
+static void cache_name(uint64_t hash, char *buf)
 {
-	struct file_info *file;
-	int state;
-	char *prefix = udata;
+	ass_hash64_str(hash, buf + 3);
+	buf[0] = buf[3];
+	buf[1] = buf[4];
+	buf[2] = '/';
+}
 
-	if(!fname || !*fname) {
-		ass_errno = ENOENT;
-		return 0;
-	}
+/* allocates a file for fname in the url mount, with a single reference */
+static struct file_info *new_file(struct url_mount *mnt, const char *fname)
+{
+	struct file_info *file;
+	char *prefix = mnt->mirrors[0].url;
 
-	if(!(file = malloc(sizeof *file))) {
-		ass_errno = ENOMEM;
+	if(!(file = calloc(1, sizeof *file))) {
 		return 0;
 	}
 
 	if(!(file->url = malloc(strlen(prefix) + strlen(fname) + 2))) {
 		perror("assfile: mod_url: failed to allocate url buffer");
-		ass_errno = errno;
 		free(file);
 		return 0;
 	}
 	if(prefix && *prefix) {
 		sprintf(file->url, "%s/%s", prefix, fname);
+		file->name = file->url + strlen(prefix) + 1;
 	} else {
 		strcpy(file->url, fname);
+		file->name = file->url;
 	}
 
-	if(!(file->cache_fname = cache_filename(fname, file->url))) {
+	file->hash = ass_hash64(file->url, strlen(file->url), 0);
+	if(!(file->cache_fname = cache_filename(file->hash))) {
 		free(file->url);
 		free(file);
+		return 0;
+	}
+	file->cache_name = file->cache_fname + strlen(cachedir) + 1;
+
+	file->mnt = mnt;
+	__atomic_add_fetch(&mnt->nref, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_init(&file->state_mutex, 0);
+	pthread_cond_init(&file->state_cond, 0);
+	file->nref = 1;
+	return file;
+}
+
+static void *fop_open(const char *fname, void *udata)
+{
+	struct file_info *file;
+	int state, known, offline;
+	long size;
+	double deadline;
+	struct url_mount *mnt = udata;
+	int can_hedge = ass_mod_url_hedge_ms > 0 && mnt->num_mirrors > 1;
+
+	if(!fname || !*fname) {
+		ass_errno = ENOENT;
+		return 0;
+	}
+
+	if(!(file = new_file(mnt, fname))) {
 		ass_errno = ENOMEM;
 		return 0;
 	}
-	if(!(file->cache_file = fopen(file->cache_fname, "wb"))) {
-		fprintf(stderr, "assfile: mod_url: failed to open cache file (%s) for writing: %s\n",
-				file->cache_fname, strerror(errno));
-		ass_errno = errno;
-		free(file->url);
-		free(file->cache_fname);
-		free(file);
+
+	if((file->mbuf = mcache_get(file->hash))) {
+		if(ass_verbose) {
+			fprintf(stderr, "assfile: mod_url: \"%s\" found in memory cache\n", file->url);
+		}
+		file->state = DL_DONE;
+		return file;
+	}
+
+	/* in offline mode, or if we know what the file should look like from a
+	 * manifest, use the disk cache without asking the server
+	 */
+	offline = ass_get_option(ASS_URL_OFFLINE);
+	known = lookup_manifest(file);
+	if((offline || known) && (file->cache_file = open_cached(file))) {
+		fseek(file->cache_file, 0, SEEK_END);
+		size = ftell(file->cache_file);
+		if(!known || (!file->zf && size == file->expect_size)) {
+			if(ass_verbose) {
+				fprintf(stderr, "assfile: mod_url: \"%s\" found in disk cache\n", file->url);
+			}
+			rewind(file->cache_file);
+			if(dcache_touch(file->cache_name, size)) {
+				submit(evict, 0, ASS_TPOOL_PRIO_IDLE);
+			}
+			file->state = DL_DONE;
+			return file;
+		}
+		zf_close(file->zf);
+		file->zf = 0;
+		fclose(file->cache_file);
+		file->cache_file = 0;
+	}
+	if(offline) {
+		if(ass_verbose) {
+			fprintf(stderr, "assfile: mod_url: \"%s\" not in cache (offline)\n", file->url);
+		}
+		release_file(file);
+		ass_errno = ENOENT;
 		return 0;
 	}
 
 	file->state = DL_UNKNOWN;
-	pthread_mutex_init(&file->state_mutex, 0);
-	pthread_cond_init(&file->state_cond, 0);
+	file->nref = 2;		/* one for us, one for the download job */
+	file->njobs = 1;
 
 	if(ass_verbose) {
 		fprintf(stderr, "assfile: mod_url: get \"%s\" -> \"%s\"\n", file->url, file->cache_fname);
 	}
-	ass_tpool_enqueue(tpool, file, download, 0);
+	/* someone is blocked on this one, get it ahead of any background work */
+	submit(download, file, ASS_TPOOL_PRIO_HIGH);
 
 	/* wait until the file changes state */
 	pthread_mutex_lock(&file->state_mutex);
 	while(file->state == DL_UNKNOWN) {
-		pthread_cond_wait(&file->state_cond, &file->state_mutex);
+		if(!can_hedge || file->hedged) {
+			pthread_cond_wait(&file->state_cond, &file->state_mutex);
+			continue;
+		}
+
+		/* if the request doesn't start receiving data in time, send another
+		 * one to the next best mirror, and keep whichever responds first
+		 */
+		if(!file->attempts) {
+			deadline = get_time() + ass_mod_url_hedge_ms / 1000.0;
+		} else {
+			deadline = file->start_time + ass_mod_url_hedge_ms / 1000.0;
+			if(get_time() >= deadline) {
+				file->hedged = 1;
+				if(file->njobs > 0 && file->tried != ALL_MIRRORS(mnt->num_mirrors)) {
+					if(ass_verbose) {
+						fprintf(stderr, "assfile: mod_url: no response for \"%s\" after %d ms, asking another mirror\n",
+								file->name, ass_mod_url_hedge_ms);
+					}
+					file->njobs++;
+					file->nref++;
+					pthread_mutex_unlock(&file->state_mutex);
+					submit(hedge, file, ASS_TPOOL_PRIO_HIGH);
+					pthread_mutex_lock(&file->state_mutex);
+				}
+				continue;
+			}
+		}
+		timed_wait(file, deadline);
 	}
 	state = file->state;
 	pthread_mutex_unlock(&file->state_mutex);
 
 	if(state == DL_ERROR) {
-		/* the worker stopped, so we can safely cleanup and return error */
-		fclose(file->cache_file);
-		remove(file->cache_fname);
-		free(file->cache_fname);
-		free(file->url);
-		pthread_cond_destroy(&file->state_cond);
-		pthread_mutex_destroy(&file->state_mutex);
-		free(file);
+		/* the worker stopped and dropped its reference, so this frees the file */
+		release_file(file);
 		ass_errno = ENOENT;	/* TODO: differentiate between 403 and 404 */
 		return 0;
 	}
 	return file;
 }
 
+static void release_file(struct file_info *file)
+{
+	int nref;
+
+	pthread_mutex_lock(&file->state_mutex);
+	nref = --file->nref;
+	pthread_mutex_unlock(&file->state_mutex);
+
+	if(nref > 0) return;
+
+	zf_close(file->zf);
+	if(file->cache_file) {
+		fclose(file->cache_file);
+	}
+	if(file->tmp_fname) {
+		/* download failed or aborted, don't leave partial files around */
+		remove(file->tmp_fname);
+		free(file->tmp_fname);
+	}
+	if(file->mbuf) {
+		mcache_release(file->mbuf);
+	}
+	free(file->dlbuf);
+	free(file->cache_fname);
+	free(file->url);
+	release_mount(file->mnt);
+	pthread_cond_destroy(&file->state_cond);
+	pthread_mutex_destroy(&file->state_mutex);
+	free(file);
+}
+
+/* waits on the state condition until the deadline (see get_time), with the
+ * state mutex held
+ */
+static void timed_wait(struct file_info *file, double deadline)
+{
+	struct timespec ts;
+	double t, dt = deadline - get_time();
+
+	if(dt <= 0.0) return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	t = ts.tv_sec + ts.tv_nsec / 1e9 + dt;
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+	pthread_cond_timedwait(&file->state_cond, &file->state_mutex, &ts);
+}
+
 static void wait_done(struct file_info *file)
 {
 	pthread_mutex_lock(&file->state_mutex);
@@ -283,22 +790,55 @@ static void fop_close(void *fp, void *udata)
 {
 	struct file_info *file = fp;
 
-	wait_done(file);	/* TODO: stop download instead of waiting to finish */
+	/* don't wait for the download to finish; ask it to stop, and let the
+	 * worker free the file when it's done, if it's still holding it.
+	 */
+	pthread_mutex_lock(&file->state_mutex);
+	if(file->state != DL_DONE && file->state != DL_ERROR) {
+		file->abort = 1;
+	}
+	pthread_mutex_unlock(&file->state_mutex);
 
-	fclose(file->cache_file);
-	if(file->state == DL_ERROR) remove(file->cache_fname);
-	free(file->cache_fname);
-	free(file->url);
-	pthread_cond_destroy(&file->state_cond);
-	pthread_mutex_destroy(&file->state_mutex);
-	free(file);
+	release_file(file);
 }
 
 static long fop_seek(void *fp, long offs, int whence, void *udata)
 {
+	long newoffs;
 	struct file_info *file = fp;
 	wait_done(file);
 
+	if(file->state == DL_ERROR) {
+		ass_errno = EIO;
+		return -1;
+	}
+
+	if(file->mbuf) {
+		switch(whence) {
+		case SEEK_SET:
+			newoffs = offs;
+			break;
+		case SEEK_CUR:
+			newoffs = file->mem_offs + offs;
+			break;
+		case SEEK_END:
+			newoffs = file->mbuf->size + offs;
+			break;
+		default:
+			ass_errno = EINVAL;
+			return -1;
+		}
+		if(newoffs < 0) {
+			ass_errno = EINVAL;
+			return -1;
+		}
+		file->mem_offs = newoffs;
+		return newoffs;
+	}
+
+	if(file->zf) {
+		return zf_seek(file->zf, offs, whence);
+	}
 	fseek(file->cache_file, offs, whence);
 	return ftell(file->cache_file);
 }
@@ -308,6 +848,25 @@ static long fop_read(void *fp, void *buf, long size, void *udata)
 	struct file_info *file = fp;
 	wait_done(file);
 
+	if(file->state == DL_ERROR) {
+		ass_errno = EIO;
+		return -1;
+	}
+
+	if(file->mbuf) {
+		if(file->mem_offs >= file->mbuf->size) {
+			return 0;
+		}
+		if(size > file->mbuf->size - file->mem_offs) {
+			size = file->mbuf->size - file->mem_offs;
+		}
+		memcpy(buf, file->mbuf->data + file->mem_offs, size);
+		file->mem_offs += size;
+		return size;
+	}
+	if(file->zf) {
+		return zf_read(file->zf, buf, size);
+	}
 	return fread(buf, 1, size, file->cache_file);
 }
 
@@ -316,69 +875,1257 @@ static long fop_read(void *fp, void *buf, long size, void *udata)
  */
 static void download(void *data)
 {
-	int tid, res;
+	int cidx, res;
 	struct file_info *file = data;
 
-	tid = ass_tpool_thread_id(tpool);
+	if(__atomic_load_n(&quitting, __ATOMIC_RELAXED) || (cidx = acquire_curl(0)) == -1) {
+		finish_job(file);
+		return;
+	}
 
-	curl_easy_setopt(curl[tid], CURLOPT_URL, file->url);
-	curl_easy_setopt(curl[tid], CURLOPT_WRITEDATA, file);
-	res = curl_easy_perform(curl[tid]);
+	if((res = begin_download(file)) == -1) {
+		/* closed or exiting while another process was downloading it */
+		leave_inflight(file);
 
-	pthread_mutex_lock(&file->state_mutex);
-	if(res == CURLE_OK) {
-		file->state = DL_DONE;
-		fclose(file->cache_file);
-		if(!(file->cache_file = fopen(file->cache_fname, "rb"))) {
-			fprintf(stderr, "assfile: failed to reopen cache file (%s) for reading: %s\n",
-					file->cache_fname, strerror(errno));
+	} else if(res == 1) {
+		/* someone else just downloaded the same file, use theirs */
+		end_download(file);
+
+		pthread_mutex_lock(&file->state_mutex);
+		if(file->mbuf || (file->cache_file = open_cached(file))) {
+			file->state = DL_DONE;
+		} else {
 			file->state = DL_ERROR;
 		}
+		pthread_cond_broadcast(&file->state_cond);
+		pthread_mutex_unlock(&file->state_mutex);
+
+		if(ass_verbose) {
+			fprintf(stderr, "assfile: mod_url: \"%s\" was downloaded concurrently, using cached copy\n", file->url);
+		}
 	} else {
-		file->state = DL_ERROR;
+		pthread_mutex_lock(&file->state_mutex);
+		file->locked = 1;
+		pthread_mutex_unlock(&file->state_mutex);
+
+		fetch(file, curl[cidx]);
 	}
-	pthread_cond_broadcast(&file->state_cond);
-	pthread_mutex_unlock(&file->state_mutex);
+	release_curl(cidx);
+	finish_job(file);
 }
 
-/* this function is called by curl to pass along downloaded data chunks */
-static size_t recv_callback(char *ptr, size_t size, size_t count, void *udata)
+/* second download job for a file, started by fop_open if the first request
+ * takes too long to start receiving data
+ */
+static void hedge(void *data)
 {
-	struct file_info *file = udata;
+	int cidx;
+	struct file_info *file = data;
 
-	pthread_mutex_lock(&file->state_mutex);
-	if(file->state == DL_UNKNOWN) {
-		file->state = DL_STARTED;
-		pthread_cond_broadcast(&file->state_cond);
+	if(!__atomic_load_n(&quitting, __ATOMIC_RELAXED) && (cidx = acquire_curl(0)) != -1) {
+		fetch(file, curl[cidx]);
+		release_curl(cidx);
 	}
-	pthread_mutex_unlock(&file->state_mutex);
-
-	return fwrite(ptr, size, count, file->cache_file);
+	finish_job(file);
 }
 
-#ifdef WIN32
-#include <windows.h>
-
-static const char *get_temp_dir(void)
-{
-	static char buf[MAX_PATH + 1];
-	GetTempPathA(MAX_PATH + 1, buf);
-	return buf;
-}
-#else	/* UNIX */
-static const char *get_temp_dir(void)
+/* requests the file from the best mirror we haven't tried yet, until one of
+ * them succeeds, or we run out of mirrors, or another job gets the file first
+ */
+static void fetch(struct file_info *file, CURL *c)
 {
-	char *env = getenv("TMPDIR");
-	return env ? env : "/tmp";
-}
+	int m, res, status, need_evict = 0, retry = -1;
+	long code;
+	char *url;
+	curl_off_t wire_size;
+	struct xfer xfer;
+
+	xfer.file = file;
+	xfer.curl = c;
+
+	/* to cache a compressed response as it is, ask only for encodings we can
+	 * decode ourselves, and don't let curl decode it. Files checked against a
+	 * manifest are hashed as they arrive, so those are always decoded.
+	 */
+#ifdef HAVE_ZLIB
+	xfer.raw = ass_get_option(ASS_URL_COMPRESSION) && ass_get_option(ASS_URL_CACHE_COMPRESSED) &&
+		!file->verify;
+#else
+	xfer.raw = 0;
 #endif
+	set_decoding(c, xfer.raw);
+
+	for(;;) {
+		pthread_mutex_lock(&file->state_mutex);
+		if(file->owner || file->abort || file->state == DL_DONE || file->state == DL_ERROR ||
+				__atomic_load_n(&quitting, __ATOMIC_RELAXED)) {
+			pthread_mutex_unlock(&file->state_mutex);
+			break;
+		}
+		if(retry >= 0) {
+			/* same mirror again, after an encoding we couldn't keep */
+			m = retry;
+			retry = -1;
+			pthread_mutex_lock(&file->mnt->lock);
+			begin_request(file->mnt->mirrors + m, get_time());
+			pthread_mutex_unlock(&file->mnt->lock);
+		} else if((m = pick_mirror(file->mnt, file->tried)) == -1) {
+			pthread_mutex_unlock(&file->state_mutex);
+			break;
+		}
+		file->tried |= 1u << m;
+		if(!file->attempts++) {
+			file->start_time = get_time();
+		}
+		pthread_mutex_unlock(&file->state_mutex);
+
+		if(!(url = mirror_url(file->mnt, m, file->name))) {
+			break;
+		}
+		xfer.mirror = m;
+		xfer.encoding = ENC_IDENTITY;
+		curl_easy_setopt(c, CURLOPT_URL, url);
+		curl_easy_setopt(c, CURLOPT_WRITEDATA, &xfer);
+		curl_easy_setopt(c, CURLOPT_HEADERDATA, &xfer);
+		curl_easy_setopt(c, CURLOPT_XFERINFODATA, &xfer);
+		res = curl_easy_perform(c);
+
+		pthread_mutex_lock(&file->state_mutex);
+		if(file->owner && file->owner != &xfer) {
+			status = XFER_LOST;
+		} else if(res == CURLE_OK && !file->abort) {
+			file->owner = &xfer;	/* might not have received any data, if the file is empty */
+			if(file->verify && (file->recv_size != file->expect_size ||
+						ass_hash64_final(&file->hstate) != file->expect_hash)) {
+				fprintf(stderr, "assfile: mod_url: \"%s\" doesn't match the manifest\n", url);
+				reset_download(file);
+				status = XFER_MISMATCH;
+			} else {
+				need_evict = finish_download(file);
+				status = XFER_OK;
+			}
+		} else {
+			if(file->owner == &xfer) {
+				reset_download(file);
+			}
+			if(file->abort || __atomic_load_n(&quitting, __ATOMIC_RELAXED)) {
+				status = XFER_ABORTED;
+			} else if(xfer.raw && xfer.encoding == ENC_OTHER) {
+				status = XFER_ENCODING;
+			} else if(res == CURLE_HTTP_RETURNED_ERROR &&
+					curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &code) == CURLE_OK && code < 500) {
+				status = XFER_MISSING;
+			} else {
+				status = XFER_FAILED;
+			}
+		}
+		pthread_mutex_unlock(&file->state_mutex);
+
+		update_mirror(file->mnt, m, c, status);
+
+		if(ass_verbose) {
+			if(status == XFER_FAILED) {
+				fprintf(stderr, "assfile: mod_url: failed to get \"%s\": %s\n", url, curl_easy_strerror(res));
+			} else if(status == XFER_ENCODING) {
+				fprintf(stderr, "assfile: mod_url: \"%s\" came in an encoding we can't cache, asking for it decoded\n", url);
+			} else if(status == XFER_OK && curl_easy_getinfo(c, CURLINFO_SIZE_DOWNLOAD_T, &wire_size) == CURLE_OK) {
+				fprintf(stderr, "assfile: mod_url: got \"%s\": %ld bytes, %ld on the wire%s\n", url,
+						file->recv_size, (long)wire_size, file->zcache ? " (cached compressed)" : "");
+			}
+		}
+		free(url);
+		if(status == XFER_OK || status == XFER_LOST || status == XFER_ABORTED) {
+			break;
+		}
+		if(status == XFER_ENCODING) {
+			/* the mirror is fine, let curl decode it this time */
+			xfer.raw = 0;
+			set_decoding(c, 0);
+			retry = m;
+		}
+	}
+
+	if(need_evict) {
+		submit(evict, 0, ASS_TPOOL_PRIO_IDLE);
+	}
+}
+
+/* with raw set, asks only for gzip, and leaves the response encoded */
+static void set_decoding(CURL *c, int raw)
+{
+	if(raw) {
+		curl_easy_setopt(c, CURLOPT_ACCEPT_ENCODING, "gzip");
+		curl_easy_setopt(c, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+	} else {
+		/* an empty string offers every encoding libcurl can decode */
+		curl_easy_setopt(c, CURLOPT_ACCEPT_ENCODING, ass_get_option(ASS_URL_COMPRESSION) ? "" : (char*)0);
+		curl_easy_setopt(c, CURLOPT_HTTP_CONTENT_DECODING, 1L);
+	}
+}
+
+/* called by the owner of the file after a successful transfer, with the state
+ * mutex held, to publish the file to the disk or memory cache. Returns the
+ * result of dcache_touch.
+ */
+static int finish_download(struct file_info *file)
+{
+	int need_evict = 0;
+
+	file->state = DL_DONE;
+	if(file->cache_file) {
+		/* publish the complete file atomically, and keep reading from the
+		 * open handle, which still refers to the same file
+		 */
+		if(fflush(file->cache_file) != 0 || rename(file->tmp_fname, file->cache_fname) == -1) {
+			fprintf(stderr, "assfile: failed to move downloaded file to the cache (%s): %s\n",
+					file->cache_fname, strerror(errno));
+			file->state = DL_ERROR;
+		} else {
+			free(file->tmp_fname);
+			file->tmp_fname = 0;
+			need_evict = dcache_touch(file->cache_name, ftell(file->cache_file));
+			rewind(file->cache_file);
+			if(file->zcache && !(file->zf = zf_open(file->cache_file, ZCACHE_HDR_LEN))) {
+				file->state = DL_ERROR;
+			}
+		}
+	} else {
+		/* small enough to keep in memory, hand the buffer over to the memory
+		 * cache. The memory cache only holds decoded data.
+		 */
+		if(file->zcache && inflate_dlbuf(file) == -1) {
+			file->state = DL_ERROR;
+		} else if(!file->dlbuf && !(file->dlbuf = malloc(1))) {
+			file->state = DL_ERROR;
+		} else if(!(file->mbuf = mcache_add(file->hash, file->dlbuf, file->dlbuf_size))) {
+			file->state = DL_ERROR;
+		} else {
+			file->dlbuf = 0;
+			if(ass_get_option(ASS_URL_WRITEBEHIND)) {
+				mcache_addref(file->mbuf);
+				submit(write_behind, file->mbuf, ASS_TPOOL_PRIO_LOW);
+			}
+		}
+	}
+	pthread_cond_broadcast(&file->state_cond);
+	return need_evict;
+}
+
+/* drops anything received by a failed transfer, so that the next one can
+ * start over. Called with the state mutex held.
+ */
+static void reset_download(struct file_info *file)
+{
+	if(file->cache_file) {
+		fclose(file->cache_file);
+		file->cache_file = 0;
+		/* don't wait for the file to be closed, it might never be if we're
+		 * aborting at exit.
+		 */
+		remove(file->tmp_fname);
+		free(file->tmp_fname);
+		file->tmp_fname = 0;
+	}
+	free(file->dlbuf);
+	file->dlbuf = 0;
+	file->dlbuf_size = file->dlbuf_max = 0;
+	file->to_file = 0;
+	file->zcache = 0;
+	file->owner = 0;
+	file->recv_size = 0;
+	ass_hash64_init(&file->hstate, 0);
+}
+
+/* called at the end of every download job. The last one to finish reports
+ * failure if none of them got the file, and releases the download lock.
+ */
+static void finish_job(struct file_info *file)
+{
+	int last;
+
+	pthread_mutex_lock(&file->state_mutex);
+	if((last = --file->njobs == 0)) {
+		if(file->state != DL_DONE && file->state != DL_ERROR) {
+			file->state = DL_ERROR;
+			pthread_cond_broadcast(&file->state_cond);
+		}
+	}
+	pthread_mutex_unlock(&file->state_mutex);
+
+	if(last) {
+		if(file->locked) {
+			end_download(file);
+		}
+		if(ass_verbose && file->abort) {
+			fprintf(stderr, "assfile: mod_url: aborted \"%s\"\n", file->url);
+		}
+		if(file->prefetch) {
+			pthread_mutex_lock(&prefetch_lock);
+			if(file->state != DL_DONE) {
+				prefetch_failed++;
+			}
+			if(--prefetch_pending <= 0) {
+				pthread_cond_broadcast(&prefetch_cond);
+			}
+			pthread_mutex_unlock(&prefetch_lock);
+		}
+	}
+	release_file(file);
+}
+
+/* picks the mirror expected to deliver a file the fastest, out of those not
+ * in the skip mask, and counts a new request to it. Mirrors which recently
+ * failed are only considered if all the rest have been tried, and mirrors we
+ * know nothing about yet are tried before all others, to find out how fast
+ * they are. Until the first request to such a mirror completes, the time it
+ * has been waiting serves as its latency.
+ */
+static int pick_mirror(struct url_mount *mnt, unsigned int skip)
+{
+	int i, best = -1, best_down = 0;
+	double cost, best_cost = 0.0, now = get_time();
+	struct mirror *m;
+
+	pthread_mutex_lock(&mnt->lock);
+	for(i=0; i<mnt->num_mirrors; i++) {
+		if(skip & (1u << i)) continue;
+		m = mnt->mirrors + i;
+
+		if(m->retry_time > now) {
+			if(best == -1 || (best_down && m->retry_time < best_cost)) {
+				best = i;
+				best_down = 1;
+				best_cost = m->retry_time;
+			}
+			continue;
+		}
+
+		cost = 0.0;
+		if(m->nsamples) {
+			cost = m->latency;
+			if(m->rate > 0.0) {
+				cost += NOMINAL_SIZE / m->rate;
+			}
+		} else if(m->pending) {
+			cost = now - m->probe_time;
+		}
+		if(best == -1 || best_down || cost < best_cost) {
+			best = i;
+			best_down = 0;
+			best_cost = cost;
+		}
+	}
+	if(best >= 0) {
+		begin_request(mnt->mirrors + best, now);
+	}
+	pthread_mutex_unlock(&mnt->lock);
+	return best;
+}
+
+/* called with the mount lock held, when sending a request to a mirror.
+ * update_mirror must be called when it completes.
+ */
+static void begin_request(struct mirror *m, double now)
+{
+	if(!m->nsamples && !m->pending) {
+		m->probe_time = now;
+	}
+	m->pending++;
+}
+
+static char *mirror_url(struct url_mount *mnt, int mirror, const char *name)
+{
+	char *url, *prefix = mnt->mirrors[mirror].url;
+
+	if(!(url = malloc(strlen(prefix) + strlen(name) + 2))) {
+		return 0;
+	}
+	if(*prefix) {
+		sprintf(url, "%s/%s", prefix, name);
+	} else {
+		strcpy(url, name);
+	}
+	return url;
+}
+
+static double ewma(double avg, double x, int nsamples)
+{
+	return nsamples ? avg + (x - avg) * EWMA_WEIGHT : x;
+}
+
+/* updates the mirror statistics after a request made with curl handle c */
+static void update_mirror(struct url_mount *mnt, int mirror, CURL *c, int status)
+{
+	double ttfb, total, backoff;
+	curl_off_t size;
+	struct mirror *m = mnt->mirrors + mirror;
+
+	if(curl_easy_getinfo(c, CURLINFO_STARTTRANSFER_TIME, &ttfb) != CURLE_OK ||
+			curl_easy_getinfo(c, CURLINFO_TOTAL_TIME, &total) != CURLE_OK ||
+			curl_easy_getinfo(c, CURLINFO_SIZE_DOWNLOAD_T, &size) != CURLE_OK) {
+		status = XFER_ABORTED;
+	}
+
+	pthread_mutex_lock(&mnt->lock);
+	m->pending--;
+	switch(status) {
+	case XFER_OK:
+	case XFER_MISMATCH:
+		/* a mismatch is more likely a stale manifest than a bad mirror, so it
+		 * doesn't count as a failure. Throughput estimates from tiny files
+		 * would mostly measure latency.
+		 */
+		if(size >= NOMINAL_SIZE / 4 && total - ttfb > 0.001) {
+			m->rate = m->rate > 0.0 ? ewma(m->rate, size / (total - ttfb), 1) : size / (total - ttfb);
+		}
+		m->latency = ewma(m->latency, ttfb, m->nsamples++);
+		m->fails = 0;
+		m->retry_time = 0.0;
+		break;
+
+	case XFER_MISSING:
+		/* the mirror is fine, it just doesn't have the file */
+		m->latency = ewma(m->latency, total, m->nsamples++);
+		m->fails = 0;
+		m->retry_time = 0.0;
+		break;
+
+	case XFER_LOST:
+		/* we gave up on it after this long, so it's at least this slow */
+		m->latency = ewma(m->latency, total, m->nsamples++);
+		break;
+
+	case XFER_FAILED:
+		backoff = BACKOFF_MIN * (1 << (m->fails < 6 ? m->fails : 6));
+		m->retry_time = get_time() + (backoff < BACKOFF_MAX ? backoff : BACKOFF_MAX);
+		m->fails++;
+		if(ass_verbose) {
+			fprintf(stderr, "assfile: mod_url: mirror %s failed %d times, avoiding it for %g sec\n",
+					m->url, m->fails, m->retry_time - get_time());
+		}
+		break;
+
+	default:
+		break;
+	}
+	pthread_mutex_unlock(&mnt->lock);
+}
+
+/* makes sure only one thread in one process downloads a given url at a time.
+ * returns 1 if we had to wait for someone else downloading the same file, and
+ * they finished successfully, in which case we can use their copy. Returns -1
+ * without the cache lock, if the file was closed or the program is exiting
+ * while another process holds it.
+ */
+static int begin_download(struct file_info *file)
+{
+	struct file_info *it;
+	struct stat st0, st;
+	struct timespec ts;
+	int waited = 0, had_file, stop;
+
+	/* if the cache file gets replaced while we wait, it was downloaded by
+	 * whoever we were waiting for
+	 */
+	had_file = stat(file->cache_fname, &st0) != -1;
+
+	pthread_mutex_lock(&inflight_lock);
+	for(;;) {
+		it = inflight;
+		while(it && it->hash != file->hash) {
+			it = it->inflight_next;
+		}
+		if(!it) break;
+		waited = 1;
+		pthread_cond_wait(&inflight_cond, &inflight_lock);
+	}
+	file->inflight_next = inflight;
+	inflight = file;
+	pthread_mutex_unlock(&inflight_lock);
+
+	if(waited && (file->mbuf = mcache_get(file->hash))) {
+		return 1;
+	}
+
+	/* poll instead of blocking in the lock, so that neither closing the file,
+	 * nor exiting have to wait for the other process to finish
+	 */
+	while(dcache_lock(file->cache_name, 0) == -1) {
+		waited = 1;
+
+		pthread_mutex_lock(&file->state_mutex);
+		stop = file->abort || __atomic_load_n(&quitting, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&file->state_mutex);
+		if(stop) {
+			return -1;
+		}
+
+		ts.tv_sec = 0;
+		ts.tv_nsec = LOCK_POLL_NSEC;
+		nanosleep(&ts, 0);
+	}
+
+	if(waited && stat(file->cache_fname, &st) != -1) {
+		if(!had_file || st.st_ino != st0.st_ino || st.st_mtime != st0.st_mtime) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void end_download(struct file_info *file)
+{
+	dcache_unlock(file->cache_name);
+	leave_inflight(file);
+}
+
+static void leave_inflight(struct file_info *file)
+{
+	struct file_info dummy, *it = &dummy;
+
+	pthread_mutex_lock(&inflight_lock);
+	dummy.inflight_next = inflight;
+	while(it->inflight_next) {
+		if(it->inflight_next == file) {
+			it->inflight_next = file->inflight_next;
+			break;
+		}
+		it = it->inflight_next;
+	}
+	inflight = dummy.inflight_next;
+	pthread_cond_broadcast(&inflight_cond);
+	pthread_mutex_unlock(&inflight_lock);
+}
+
+/* opens an existing cache file for reading. If it holds a compressed
+ * response, file->zf is set up to decode it.
+ */
+static FILE *open_cached(struct file_info *file)
+{
+	FILE *fp;
+	char hdr[ZCACHE_HDR_LEN];
+
+	if(!(fp = fopen(file->cache_fname, "rb"))) {
+		if(migrate_legacy(file) == -1 || !(fp = fopen(file->cache_fname, "rb"))) {
+			return 0;
+		}
+	}
+
+	if(fread(hdr, 1, ZCACHE_HDR_LEN, fp) == ZCACHE_HDR_LEN && memcmp(hdr, ZCACHE_MAGIC, ZCACHE_HDR_LEN) == 0) {
+		if(!(file->zf = zf_open(fp, ZCACHE_HDR_LEN))) {
+			fclose(fp);
+			return 0;
+		}
+	}
+	rewind(fp);
+	return fp;
+}
+
+/* cache files used to be named after the MD4 of the url, first directly in
+ * the cache directory, and later sharded like the current names. If we find
+ * one of those, move it to its current name.
+ */
+static int migrate_legacy(struct file_info *file)
+{
+	static const char hexdig[] = "0123456789abcdef";
+	MD4_CTX md4ctx;
+	unsigned char sum[16];
+	char sumstr[33];
+	char *oldpath, *oldname;
+	int i, pass;
+	struct stat st;
+
+	MD4Init(&md4ctx);
+	MD4Update(&md4ctx, (unsigned char*)file->url, strlen(file->url));
+	MD4Final(sum, &md4ctx);
+
+	for(i=0; i<16; i++) {
+		sumstr[i * 2] = hexdig[sum[i] >> 4];
+		sumstr[i * 2 + 1] = hexdig[sum[i] & 0xf];
+	}
+	sumstr[32] = 0;
+
+	oldpath = alloca(strlen(cachedir) + 40);
+	oldname = oldpath + strlen(cachedir) + 1;
+
+	for(pass=0; pass<2; pass++) {
+		if(pass == 0) {
+			sprintf(oldpath, "%s/%s", cachedir, sumstr);
+		} else {
+			sprintf(oldpath, "%s/%c%c/%s", cachedir, sumstr[0], sumstr[1], sumstr);
+		}
+		if(stat(oldpath, &st) == -1) {
+			continue;
+		}
+
+		mkdir_parent(file->cache_fname);
+		if(rename(oldpath, file->cache_fname) == -1) {
+			return -1;
+		}
+		if(ass_verbose) {
+			fprintf(stderr, "assfile: mod_url: migrated cache file %s -> %s\n", oldname, file->cache_name);
+		}
+		dcache_remove(oldname);
+		if(dcache_touch(file->cache_name, st.st_size)) {
+			submit(evict, 0, ASS_TPOOL_PRIO_IDLE);
+		}
+		return 0;
+	}
+	return -1;
+}
+
+static void submit(tpool_callback func, void *data, int prio)
+{
+	pthread_mutex_lock(&jobs_lock);
+	num_jobs++;
+	pthread_mutex_unlock(&jobs_lock);
+
+	if(ass_tpool_enqueue_prio(tpool, data, func, job_finished, prio) == -1) {
+		fprintf(stderr, "assfile: mod_url: failed to queue job\n");
+		func(data);
+		job_finished(data);
+	}
+}
+
+/* completion callback for all our jobs */
+static void job_finished(void *data)
+{
+	pthread_mutex_lock(&jobs_lock);
+	if(--num_jobs <= 0) {
+		pthread_cond_broadcast(&jobs_cond);
+	}
+	pthread_mutex_unlock(&jobs_lock);
+}
+
+/* background job scheduled when the disk cache goes over budget */
+static void evict(void *data)
+{
+	dcache_evict();
+}
+
+/* background job to write a file kept in the memory cache to the disk cache */
+static void write_behind(void *data)
+{
+	struct mcache_buf *mbuf = data;
+	FILE *fp = 0;
+	char *tmpname, name[CACHE_NAME_LEN + 1];
+	char *path = alloca(strlen(cachedir) + CACHE_NAME_LEN + 2);
+
+	cache_name(mbuf->key, name);
+	sprintf(path, "%s/%s", cachedir, name);
+	mkdir_parent(path);
+	if(!(tmpname = tmp_filename(path)) || !(fp = fopen(tmpname, "wb"))) {
+		goto end;
+	}
+	if(fwrite(mbuf->data, 1, mbuf->size, fp) < mbuf->size) {
+		fclose(fp);
+		remove(tmpname);
+	} else if(fclose(fp) != 0 || rename(tmpname, path) == -1) {
+		remove(tmpname);
+	} else {
+		if(dcache_touch(name, mbuf->size)) {
+			dcache_evict();
+		}
+	}
+end:
+	free(tmpname);
+	mcache_release(mbuf);
+}
+
+/* queues jobs to open connections to a new mount in the background, so that
+ * the first file requested doesn't have to wait for DNS, TCP and TLS
+ * handshakes. Each job warms up a different curl handle, and puts it back on
+ * top of the idle stack, where the next download will find it.
+ */
+static void start_preconnect(struct url_mount *mnt, int mirror)
+{
+	int i, count;
+	struct preconn *pc;
+
+	if(!*mnt->mirrors[mirror].url) {
+		return;		/* no base url, file names are full urls */
+	}
+	count = ass_mod_url_preconnect < num_curl ? ass_mod_url_preconnect : num_curl;
+
+	if(!(pc = malloc(sizeof *pc))) {
+		return;
+	}
+	if(!(pc->url = mirror_url(mnt, mirror, ""))) {
+		free(pc);
+		return;
+	}
+	if(!(pc->warm = calloc(num_curl, 1))) {
+		free(pc->url);
+		free(pc);
+		return;
+	}
+	pc->mnt = mnt;
+	pc->mirror = mirror;
+	pc->nref = count;
+	__atomic_add_fetch(&mnt->nref, 1, __ATOMIC_RELAXED);
+
+	for(i=0; i<count; i++) {
+		submit(preconnect, pc, ASS_TPOOL_PRIO_NORMAL);
+	}
+}
+
+/* preconnect job: a HEAD request leaves a connection to the server open in
+ * the curl handle, and the DNS entry and TLS session in the share. It also
+ * gives us a first estimate of the mirror latency.
+ */
+static void preconnect(void *data)
+{
+	int cidx, res;
+	struct preconn *pc = data;
+	CURL *c;
+
+	if(__atomic_load_n(&quitting, __ATOMIC_RELAXED)) {
+		cidx = -1;
+	} else {
+		cidx = acquire_curl(pc->warm);
+	}
+
+	if(cidx >= 0) {
+		c = curl[cidx];
+
+		pthread_mutex_lock(&pc->mnt->lock);
+		begin_request(pc->mnt->mirrors + pc->mirror, get_time());
+		pthread_mutex_unlock(&pc->mnt->lock);
+
+		curl_easy_setopt(c, CURLOPT_URL, pc->url);
+		curl_easy_setopt(c, CURLOPT_WRITEDATA, 0);
+		curl_easy_setopt(c, CURLOPT_HEADERDATA, 0);
+		curl_easy_setopt(c, CURLOPT_XFERINFODATA, 0);
+		curl_easy_setopt(c, CURLOPT_NOBODY, 1L);
+		/* any response will do, and errors would make curl drop the connection */
+		curl_easy_setopt(c, CURLOPT_FAILONERROR, 0L);
+		res = curl_easy_perform(c);
+		curl_easy_setopt(c, CURLOPT_HTTPGET, 1L);
+		curl_easy_setopt(c, CURLOPT_FAILONERROR, 1L);
+
+		update_mirror(pc->mnt, pc->mirror, c, res == CURLE_OK ? XFER_OK : XFER_FAILED);
+
+		if(ass_verbose) {
+			fprintf(stderr, "assfile: mod_url: preconnect \"%s\" (handle %d): %s\n", pc->url,
+					cidx, curl_easy_strerror(res));
+		}
+		release_curl(cidx);
+	}
+
+	if(__atomic_sub_fetch(&pc->nref, 1, __ATOMIC_ACQ_REL) == 0) {
+		release_mount(pc->mnt);
+		free(pc->warm);
+		free(pc->url);
+		free(pc);
+	}
+}
+
+/* reads the manifest through the mount, and queues downloads for all the
+ * files it lists which aren't in the disk cache already. The manifest is a
+ * text file with one line per file: size in bytes, hash of the contents (see
+ * ass_hash64) as 16 hex digits, and path relative to the mount.
+ * Returns the number of downloads queued, or -1 on error.
+ */
+int ass_prefetch_url(struct ass_fileops *fop, const char *manifest)
+{
+	struct url_mount *mnt = fop->udata;
+	struct file_info *mf;
+	char *text, *tmp;
+	long len = 0, max = 4096, rd;
+	int count;
+
+	if(ass_get_option(ASS_URL_OFFLINE)) {
+		fprintf(stderr, "assfile: mod_url: can't prefetch in offline mode\n");
+		return -1;
+	}
+
+	if(!(mf = fop_open(manifest, mnt))) {
+		fprintf(stderr, "assfile: mod_url: failed to get prefetch manifest: %s\n", manifest);
+		return -1;
+	}
+	if(!(text = malloc(max + 1))) {
+		fop_close(mf, mnt);
+		return -1;
+	}
+	while((rd = fop_read(mf, text + len, max - len, mnt)) > 0) {
+		len += rd;
+		if(len >= max) {
+			max *= 2;
+			if(!(tmp = realloc(text, max + 1))) {
+				free(text);
+				fop_close(mf, mnt);
+				return -1;
+			}
+			text = tmp;
+		}
+	}
+	fop_close(mf, mnt);
+	if(rd == -1) {
+		fprintf(stderr, "assfile: mod_url: failed to read prefetch manifest: %s\n", manifest);
+		free(text);
+		return -1;
+	}
+	text[len] = 0;
+
+	count = parse_manifest(mnt, text);
+	free(text);
+	return count;
+}
+
+/* waits for all queued prefetch downloads, and returns how many failed */
+int ass_prefetch_url_wait(void)
+{
+	int nfailed;
+
+	pthread_mutex_lock(&prefetch_lock);
+	while(prefetch_pending > 0) {
+		pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+	}
+	nfailed = prefetch_failed;
+	prefetch_failed = 0;
+	pthread_mutex_unlock(&prefetch_lock);
+	return nfailed;
+}
+
+static int parse_manifest(struct url_mount *mnt, char *text)
+{
+	char *line, *end, *path, *ptr;
+	long size;
+	uint64_t hash;
+	int lineno = 0, count = 0, total = 0;
+	struct file_info *file;
+	struct stat st;
+
+	for(line = text; *line; line = end) {
+		if((end = strchr(line, '\n'))) {
+			*end++ = 0;
+		} else {
+			end = line + strlen(line);
+		}
+		lineno++;
+
+		ptr = line + strlen(line);
+		while(ptr > line && isspace((unsigned char)ptr[-1])) *--ptr = 0;
+		while(*line && isspace((unsigned char)*line)) line++;
+		if(!*line || *line == '#') continue;
+
+		size = strtol(line, &ptr, 10);
+		if(ptr == line || size < 0) goto inval;
+		line = ptr;
+		hash = strtoull(line, &ptr, 16);
+		if(ptr == line) goto inval;
+		path = ptr;
+		while(*path && isspace((unsigned char)*path)) path++;
+		if(!*path) goto inval;
+
+		if(!(file = new_file(mnt, path))) {
+			break;
+		}
+		total++;
+		if(add_manifest_entry(mnt, file->hash, size, hash) == -1) {
+			release_file(file);
+			break;
+		}
+		if(stat(file->cache_fname, &st) != -1 && st.st_size == size) {
+			release_file(file);		/* already cached */
+			continue;
+		}
+
+		lookup_manifest(file);
+		file->prefetch = 1;
+		file->state = DL_UNKNOWN;
+		file->njobs = 1;
+
+		pthread_mutex_lock(&prefetch_lock);
+		prefetch_pending++;
+		pthread_mutex_unlock(&prefetch_lock);
+
+		/* on-demand downloads get priority over bulk prefetching */
+		submit(download, file, ASS_TPOOL_PRIO_LOW);
+		count++;
+		continue;
+
+inval:
+		fprintf(stderr, "assfile: mod_url: invalid manifest line %d\n", lineno);
+	}
+
+	if(ass_verbose) {
+		fprintf(stderr, "assfile: mod_url: prefetching %d of %d files\n", count, total);
+	}
+	return count;
+}
+
+static int add_manifest_entry(struct url_mount *mnt, uint64_t key, long size, uint64_t hash)
+{
+	int i, newsz;
+	struct manifest_entry *ent, *newtab;
+
+	if(!key) return 0;	/* reserved for empty slots, don't bother */
+
+	pthread_mutex_lock(&mnt->lock);
+	if(mnt->manifest_count * 2 >= mnt->manifest_size) {
+		newsz = mnt->manifest_size ? mnt->manifest_size * 2 : 256;
+		if(!(newtab = calloc(newsz, sizeof *newtab))) {
+			pthread_mutex_unlock(&mnt->lock);
+			return -1;
+		}
+		for(i=0; i<mnt->manifest_size; i++) {
+			if((ent = mnt->manifest + i)->key) {
+				int idx = ent->key & (newsz - 1);
+				while(newtab[idx].key) idx = (idx + 1) & (newsz - 1);
+				newtab[idx] = *ent;
+			}
+		}
+		free(mnt->manifest);
+		mnt->manifest = newtab;
+		mnt->manifest_size = newsz;
+	}
+
+	i = key & (mnt->manifest_size - 1);
+	while(mnt->manifest[i].key && mnt->manifest[i].key != key) {
+		i = (i + 1) & (mnt->manifest_size - 1);
+	}
+	ent = mnt->manifest + i;
+	if(!ent->key) {
+		ent->key = key;
+		mnt->manifest_count++;
+	}
+	ent->size = size;
+	ent->hash = hash;
+	pthread_mutex_unlock(&mnt->lock);
+	return 0;
+}
+
+/* if the file is listed in a manifest, set it up to be verified against it */
+static int lookup_manifest(struct file_info *file)
+{
+	int i;
+	struct url_mount *mnt = file->mnt;
+
+	pthread_mutex_lock(&mnt->lock);
+	if(mnt->manifest_size) {
+		i = file->hash & (mnt->manifest_size - 1);
+		while(mnt->manifest[i].key) {
+			if(mnt->manifest[i].key == file->hash) {
+				file->verify = 1;
+				file->expect_size = mnt->manifest[i].size;
+				file->expect_hash = mnt->manifest[i].hash;
+				ass_hash64_init(&file->hstate, 0);
+				break;
+			}
+			i = (i + 1) & (mnt->manifest_size - 1);
+		}
+	}
+	pthread_mutex_unlock(&mnt->lock);
+	return file->verify;
+}
+
+/* keeps prefetch downloads within ASS_URL_PREFETCH_RATE, by sleeping in the
+ * receive callback when they go over. Bursts of up to a second's worth of
+ * data are allowed.
+ */
+static void throttle(long size)
+{
+	double now, wait, rate = ass_mod_url_prefetch_kbps * 1024.0;
+	struct timespec ts;
+
+	if(rate <= 0.0) return;
+
+	pthread_mutex_lock(&bucket_lock);
+	now = get_time();
+	bucket_tokens += (now - bucket_time) * rate;
+	if(bucket_tokens > rate) {
+		bucket_tokens = rate;
+	}
+	bucket_time = now;
+	bucket_tokens -= size;
+	wait = bucket_tokens < 0.0 ? -bucket_tokens / rate : 0.0;
+	pthread_mutex_unlock(&bucket_lock);
+
+	/* sleep in small steps, so that we don't hold up the exit */
+	while(wait > 0.0 && !__atomic_load_n(&quitting, __ATOMIC_RELAXED)) {
+		double t = wait < 0.1 ? wait : 0.1;
+		ts.tv_sec = 0;
+		ts.tv_nsec = (long)(t * 1e9);
+		nanosleep(&ts, 0);
+		wait -= t;
+	}
+}
+
+/* this function is called by curl to pass along downloaded data chunks */
+static size_t recv_callback(char *ptr, size_t size, size_t count, void *udata)
+{
+	int stop;
+	long sz = size * count;
+	curl_off_t clen;
+	struct xfer *xfer = udata;
+	struct file_info *file;
+
+	if(!xfer) {
+		return count;	/* preconnect request, nothing to keep */
+	}
+	file = xfer->file;
+
+	pthread_mutex_lock(&file->state_mutex);
+	if(xfer->raw && xfer->encoding == ENC_OTHER) {
+		/* we asked for gzip, but got something we can't decode. Stop before
+		 * claiming the file, fetch asks for it again, decoded.
+		 */
+		pthread_mutex_unlock(&file->state_mutex);
+		return 0;
+	}
+	if(!file->owner) {
+		/* first request to receive any data, the rest will stop */
+		file->owner = xfer;
+		if(file->state == DL_UNKNOWN) {
+			file->state = DL_STARTED;
+			pthread_cond_broadcast(&file->state_cond);
+		}
+		file->zcache = xfer->raw && xfer->encoding == ENC_GZIP;
+
+		/* go straight to the cache file, if we know it won't fit in memory,
+		 * or if it's prefetched for later
+		 */
+		if(file->prefetch || ass_mod_url_mem_threshold <= 0 || (curl_easy_getinfo(xfer->curl,
+					CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &clen) == CURLE_OK &&
+					clen > ass_mod_url_mem_threshold)) {
+			file->to_file = 1;
+		}
+	}
+	if(file->owner != xfer) {
+		pthread_mutex_unlock(&file->state_mutex);
+		return 0;
+	}
+	if(!(stop = file->abort) && !file->cache_file) {
+		if(file->to_file || file->dlbuf_size + sz > ass_mod_url_mem_threshold) {
+			/* open the cache file while holding the lock, so that fop_close
+			 * either sees it and removes it, or we see the abort flag
+			 */
+			stop = open_cache_file(file) == -1;
+		}
+	}
+	pthread_mutex_unlock(&file->state_mutex);
+
+	if(stop) {
+		return 0;	/* returning less than requested makes curl fail the transfer */
+	}
+	if(file->prefetch) {
+		throttle(sz);
+	}
+	if(file->verify) {
+		ass_hash64_update(&file->hstate, ptr, sz);
+	}
+	file->recv_size += sz;
+
+	if(file->cache_file) {
+		return fwrite(ptr, size, count, file->cache_file);
+	}
+	return dlbuf_append(file, ptr, sz) == -1 ? 0 : count;
+}
+
+/* opens the cache file for writing, and moves anything collected in the
+ * download buffer so far to the file
+ */
+static int open_cache_file(struct file_info *file)
+{
+	mkdir_parent(file->cache_fname);
+	if(!(file->tmp_fname = tmp_filename(file->cache_fname))) {
+		return -1;
+	}
+	if(!(file->cache_file = fopen(file->tmp_fname, "w+b"))) {
+		fprintf(stderr, "assfile: mod_url: failed to open cache file (%s) for writing: %s\n",
+				file->tmp_fname, strerror(errno));
+		free(file->tmp_fname);
+		file->tmp_fname = 0;
+		return -1;
+	}
+	file->to_file = 1;
+
+	if(file->zcache && fwrite(ZCACHE_MAGIC, 1, ZCACHE_HDR_LEN, file->cache_file) < ZCACHE_HDR_LEN) {
+		return -1;
+	}
+	if(file->dlbuf) {
+		if(fwrite(file->dlbuf, 1, file->dlbuf_size, file->cache_file) < file->dlbuf_size) {
+			return -1;
+		}
+		free(file->dlbuf);
+		file->dlbuf = 0;
+		file->dlbuf_size = file->dlbuf_max = 0;
+	}
+	return 0;
+}
+
+/* temporary file name, unique across threads and processes, next to fname */
+static char *tmp_filename(const char *fname)
+{
+	static unsigned int seq;
+	unsigned int n;
+	char *buf;
+
+	if(!(buf = malloc(strlen(fname) + 32))) {
+		return 0;
+	}
+	pthread_mutex_lock(&inflight_lock);
+	n = seq++;
+	pthread_mutex_unlock(&inflight_lock);
+
+	sprintf(buf, "%s.%d.%u.tmp", fname, (int)getpid(), n);
+	return buf;
+}
+
+static int dlbuf_append(struct file_info *file, const char *data, long size)
+{
+	char *tmp;
+	long newmax;
+
+	if(file->dlbuf_size + size > file->dlbuf_max) {
+		newmax = file->dlbuf_max ? file->dlbuf_max : 1024;
+		while(newmax < file->dlbuf_size + size) newmax *= 2;
+
+		if(!(tmp = realloc(file->dlbuf, newmax))) {
+			return -1;
+		}
+		file->dlbuf = tmp;
+		file->dlbuf_max = newmax;
+	}
+	memcpy(file->dlbuf + file->dlbuf_size, data, size);
+	file->dlbuf_size += size;
+	return 0;
+}
+
+/* decompresses a compressed response collected in the download buffer */
+static int inflate_dlbuf(struct file_info *file)
+{
+	char *buf;
+	long size;
+
+	if(zf_inflate_mem(file->dlbuf, file->dlbuf_size, &buf, &size) == -1) {
+		fprintf(stderr, "assfile: mod_url: failed to decompress \"%s\"\n", file->url);
+		return -1;
+	}
+	free(file->dlbuf);
+	file->dlbuf = buf;
+	file->dlbuf_size = file->dlbuf_max = size;
+	return 0;
+}
+
+/* called by curl for each header line of the response. We only care about
+ * the content encoding, for responses we have to decode ourselves.
+ */
+static size_t header_callback(char *ptr, size_t size, size_t count, void *udata)
+{
+	static const char name[] = "content-encoding:";
+	long i, len = size * count;
+	char *end = ptr + len;
+	struct xfer *xfer = udata;
+
+	if(!xfer) return count;
+
+	if(len >= 5 && memcmp(ptr, "HTTP/", 5) == 0) {
+		/* status line of a new response, after a redirect */
+		xfer->encoding = ENC_IDENTITY;
+		return count;
+	}
+
+	for(i=0; i<sizeof name - 1; i++) {
+		if(i >= len || tolower((unsigned char)ptr[i]) != name[i]) {
+			return count;
+		}
+	}
+	ptr += i;
+	while(ptr < end && isspace((unsigned char)*ptr)) ptr++;
+	while(end > ptr && isspace((unsigned char)end[-1])) end--;
+
+	if(end - ptr == 4 && memcmp(ptr, "gzip", 4) == 0) {
+		xfer->encoding = ENC_GZIP;
+	} else if(end - ptr == 6 && memcmp(ptr, "x-gzip", 6) == 0) {
+		xfer->encoding = ENC_GZIP;
+	} else if(!(end - ptr == 8 && memcmp(ptr, "identity", 8) == 0)) {
+		xfer->encoding = ENC_OTHER;
+	}
+	return count;
+}
+
+/* called by curl periodically during the transfer, even when no data arrive.
+ * returning non-zero aborts the transfer.
+ */
+static int xferinfo_callback(void *udata, curl_off_t dltotal, curl_off_t dlnow,
+		curl_off_t ultotal, curl_off_t ulnow)
+{
+	int stop;
+	struct xfer *xfer = udata;
+	struct file_info *file;
+
+	if(!xfer) {
+		return __atomic_load_n(&quitting, __ATOMIC_RELAXED);
+	}
+	file = xfer->file;
+
+	/* stop waiting for a slow mirror, if another one got the file first */
+	pthread_mutex_lock(&file->state_mutex);
+	stop = file->abort || (file->owner && file->owner != xfer);
+	pthread_mutex_unlock(&file->state_mutex);
+	return stop || __atomic_load_n(&quitting, __ATOMIC_RELAXED);
+}
+
+#ifdef WIN32
+#include <windows.h>
+
+static const char *get_temp_dir(void)
+{
+	static char buf[MAX_PATH + 1];
+	GetTempPathA(MAX_PATH + 1, buf);
+	return buf;
+}
+
+/* monotonic time in seconds */
+static double get_time(void)
+{
+	return GetTickCount64() / 1000.0;
+}
+#else	/* UNIX */
+static const char *get_temp_dir(void)
+{
+	char *env = getenv("TMPDIR");
+	return env ? env : "/tmp";
+}
+
+/* monotonic time in seconds */
+static double get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+#endif
+
+
+/* create the directory containing the file path, if it doesn't exist */
+static int mkdir_parent(const char *path)
+{
+	char *dir, *sep;
+
+	dir = alloca(strlen(path) + 1);
+	strcpy(dir, path);
+	if(!(sep = strrchr(dir, '/'))) {
+		return 0;
+	}
+	*sep = 0;
+#ifdef WIN32
+	if(mkdir(dir) == -1 && errno != EEXIST) {
+#else
+	if(mkdir(dir, 0777) == -1 && errno != EEXIST) {
+#endif
+		return -1;
+	}
+	return 0;
+}
+
+static int mkdir_path(const char *path)
+{
+	char *pathbuf, *dptr;
+	struct stat st;
 
-
-static int mkdir_path(const char *path)
-{
-	char *pathbuf, *dptr;
-	struct stat st;
-
 	if(!path || !*path) return -1;
 
 	pathbuf = dptr = alloca(strlen(path) + 1);
@@ -408,7 +2155,7 @@ static int mkdir_path(const char *path)
 }
 
 #else	/* don't build mod_url */
-struct ass_fileops *ass_alloc_url(const char *url)
+struct ass_fileops *ass_alloc_url(const char **urls, int count)
 {
 	fprintf(stderr, "assfile: compiled without URL asset source support\n");
 	return 0;
@@ -417,4 +2164,14 @@ struct ass_fileops *ass_alloc_url(const char *url)
 void ass_free_url(struct ass_fileops *fop)
 {
 }
+
+int ass_prefetch_url(struct ass_fileops *fop, const char *manifest)
+{
+	return -1;
+}
+
+int ass_prefetch_url_wait(void)
+{
+	return 0;
+}
 #endif
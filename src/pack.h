@@ -0,0 +1,102 @@
+/*
+assfile - library for accessing assets with an fopen/fread-like interface
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef PACK_H_
+#define PACK_H_
+
+#include <inttypes.h>
+
+/* Pack file format, designed to be mapped into memory and used as is.
+ *
+ *  +--------------------+ 0
+ *  | pack_header        |
+ *  +--------------------+ dir_offs
+ *  | pack_entry[]       | sorted by path (strcmp order)
+ *  +--------------------+ hash_offs
+ *  | uint32_t[]         | hash table: entry index + 1, or 0 for empty slots
+ *  +--------------------+ names_offs
+ *  | path arena         | nul-terminated paths, referenced by the entries
+ *  +--------------------+ data_offs (page aligned)
+ *  | file data          | each file starts at a multiple of the alignment
+ *  +--------------------+
+ *
+ * Lookups hash the path with ass_hash64 (seed 0), and probe the hash table
+ * linearly, starting from slot (hash & (hash_size - 1)).
+ *
+ * Files can be stored compressed (the encoding is in the low bits of the
+ * entry flags), in blocks of block_size bytes, compressed independently so
+ * that any part of the file can be read without decompressing the rest. The
+ * data of a compressed file start with a table of num_blocks + 1 uint64_t
+ * offsets, relative to the start of the file data; block i is stored between
+ * offsets i and i + 1. Blocks which didn't compress are stored as they are,
+ * and can be told apart by their stored size being equal to their size. All integers are in
+ * the byte order of the machine which built the pack; byte_order tells which
+ * one that was, and readers refuse packs built on the other kind.
+ *
+ * Packs built with an access trace (asspack -order) have the data of the
+ * files in the trace first, in the order they were opened, and hot_size is
+ * the size of that part of the data, from data_offs. Readers ask the OS to
+ * start reading it in when they mount the pack. Packs without an order have
+ * a hot_size of 0.
+ */
+#define PACK_MAGIC			"ASSPACK\n"
+#define PACK_MAGIC_LEN		8
+#define PACK_VERSION		1
+#define PACK_BYTE_ORDER		0x01020304
+#define PACK_DEF_ALIGN		4096
+#define PACK_DEF_BLOCK_SIZE	65536
+#define PACK_MAX_BLOCK_SIZE	(1 << 24)
+
+/* file encodings */
+enum {
+	PACK_ENC_NONE,
+	PACK_ENC_LZ4,		/* LZ4 block format, see lz4.h */
+	PACK_ENC_DEFLATE	/* zlib stream (RFC 1950) */
+};
+#define PACK_ENC_MASK		0xff
+
+#define PACK_NUM_BLOCKS(ent, bsz)	(((ent)->size + (bsz) - 1) / (bsz))
+
+struct pack_header {
+	char magic[PACK_MAGIC_LEN];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t flags;
+	uint32_t align;				/* alignment of file data */
+	uint32_t num_entries;
+	uint32_t hash_size;			/* number of hash table slots, power of two */
+	uint64_t dir_offs;
+	uint64_t hash_offs;
+	uint64_t names_offs, names_size;
+	uint64_t data_offs, data_size;
+	uint32_t block_size;		/* uncompressed size of the blocks of compressed files */
+	uint32_t reserved32;
+	uint64_t hot_size;			/* data read first by programs using the pack, see below */
+};
+
+struct pack_entry {
+	uint64_t hash;				/* ass_hash64 of the path */
+	uint64_t offset;			/* of the file data from the start of the pack */
+	uint64_t size;				/* size of the file */
+	uint64_t stored_size;		/* size of the data in the pack, same as size unless encoded */
+	uint32_t name_offs;			/* path, relative to names_offs */
+	uint32_t name_len;
+	uint32_t flags;				/* encoding (PACK_ENC_*) */
+	uint32_t reserved;
+};
+
+#endif	/* PACK_H_ */
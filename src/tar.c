@@ -19,10 +19,30 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <fcntl.h>
+#endif
 #include "tar.h"
+#include "zfile.h"
+#include "hash.h"
 
 #define MAX_NAME_LEN	100
-#define MAX_PREFIX_LEN	131
+#define MAX_PREFIX_LEN	155
+
+/* gzip access points every ZIDX_SPAN bytes of the uncompressed tarball.
+ * Reading from an arbitrary offset decompresses ZIDX_SPAN/2 bytes on average
+ * before getting to the data, and each point keeps a (compressed) 32k window.
+ */
+#define ZIDX_SPAN		(1 << 20)
+#define ZIDX_SUFFIX		".idx"
+#define ZIDX_MAGIC		"ASSTARIX"
+#define ZIDX_VERSION	4
+
+/* pax global header keyword with the size of the hot prefix, see asslayout */
+#define PAX_HOT_KEY		"ASSFILE.hot"
 
 struct header {
 	char name[MAX_NAME_LEN];
@@ -38,7 +58,7 @@ struct header {
 	char uname[32], gname[32];
 	char devmajor[8], devminor[8];
 	char prefix[MAX_PREFIX_LEN];
-	char atime[12], ctime[12];
+	char pad[12];
 };
 
 struct node {
@@ -46,15 +66,31 @@ struct node {
 	struct node *next;
 };
 
+/* header of the index saved next to compressed tarballs, followed by the
+ * file list (offset, size, path length, path), and the zfile access points
+ */
+struct zidx_header {
+	char magic[8];
+	uint32_t version, num_files;
+	uint64_t arsize, armtime;	/* to detect changes to the tarball */
+	uint64_t hot;
+};
+
+static int read_tar(struct tar *tar, const char *fname, int gz);
+static int load_zip(struct tar *tar, const char *fname);
+static int build_hash(struct tar *tar);
+static void read_pax(struct tar *tar, const char *data, long size);
+static void prefetch_hot(struct tar *tar);
+static long read_data(struct tar *tar, struct zfile *zf, void *buf, long size);
+static int skip_data(struct tar *tar, struct zfile *zf, long size);
+static int load_index(struct tar *tar, const char *fname);
+static void save_index(struct tar *tar, const char *fname);
+
 
 int load_tar(struct tar *tar, const char *fname)
 {
-	int i, res = -1;
-	struct node *node, *head = 0, *tail = 0;
-	char buf[512];
-	struct header *hdr;
-	unsigned long offset = 0, size, blksize;
-	char *path, *endp;
+	int res;
+	unsigned char magic[4] = {0};
 
 	if(!(tar->fp = fopen(fname, "rb"))) {
 		fprintf(stderr, "load_tar: failed to open %s: %s\n", fname, strerror(errno));
@@ -62,32 +98,109 @@ int load_tar(struct tar *tar, const char *fname)
 	}
 	tar->num_files = 0;
 	tar->files = 0;
+	tar->names = 0;
+	tar->htab = 0;
+	tar->zidx = 0;
+	tar->hot = 0;
+
+	fread(magic, 1, 4, tar->fp);
+	if(memcmp(magic, "PK\3\4", 4) == 0 || memcmp(magic, "PK\5\6", 4) == 0) {
+		res = load_zip(tar, fname);
+	} else {
+		res = read_tar(tar, fname, magic[0] == 0x1f && magic[1] == 0x8b);
+	}
+
+	if(res == -1 || build_hash(tar) == -1) {
+		close_tar(tar);
+		return -1;
+	}
+	/* plain tarballs start reading it as soon as the pax header is found,
+	 * compressed ones need the access points to know where it ends
+	 */
+	if(tar->hot && tar->zidx) {
+		prefetch_hot(tar);
+	}
+	return 0;
+}
+
+static int read_tar(struct tar *tar, const char *fname, int gz)
+{
+	int i, res = -1;
+	struct node *node, *head = 0, *tail = 0;
+	char buf[512], c;
+	struct header *hdr;
+	unsigned long offset = 0, size, blksize;
+	char *path, *endp;
+	struct zfile *zf = 0;
 
-	while(fread(buf, 1, sizeof buf, tar->fp) == sizeof buf) {
+	if(gz) {
+		/* gzip-compressed, see if we've been through it before */
+		if(load_index(tar, fname) == 0) {
+			return 0;
+		}
+		if(!(zf = zf_open(tar->fp, 0)) || zf_build_index(zf, ZIDX_SPAN) == -1) {
+			zf_close(zf);
+			return -1;
+		}
+	}
+	rewind(tar->fp);
+
+	while(read_data(tar, zf, buf, sizeof buf) == sizeof buf) {
 		hdr = (struct header*)buf;
 
 		offset += 512;
 		size = strtol(hdr->size, &endp, 8);
-		if(endp == hdr->size || size <= 0) {
+		if(endp == hdr->size) {
 			continue;	/* skip invalid */
 		}
+		if(!size) {
+			/* skip directories and the like, but keep empty files, which can
+			 * be whiteouts in patch archives (see mod_patch.c)
+			 */
+			if((hdr->typeflag != '0' && hdr->typeflag != 0) || !hdr->name[0] ||
+					hdr->name[strnlen(hdr->name, MAX_NAME_LEN) - 1] == '/') {
+				continue;
+			}
+			blksize = 0;
+			goto add;
+		}
 		blksize = ((size - 1) | 0x1ff) + 1;	/* round to next 512-block */
 
+		if(hdr->typeflag == 'g' || hdr->typeflag == 'x') {
+			/* pax extended headers aren't files, but a global one can have
+			 * the size of the hot prefix. Ours fit in one block.
+			 */
+			if(hdr->typeflag == 'g' && blksize == sizeof buf) {
+				if(read_data(tar, zf, buf, sizeof buf) < sizeof buf) break;
+				read_pax(tar, buf, size);
+				/* start reading it while we go through the headers */
+				if(tar->hot && !zf) {
+					prefetch_hot(tar);
+				}
+			} else {
+				if(skip_data(tar, zf, blksize) == -1) break;
+			}
+			offset += blksize;
+			continue;
+		}
+
 		/* verify filesize reasonable */
-		fseek(tar->fp, size - 1, SEEK_CUR);
-		if(fgetc(tar->fp) == -1) {
+		if(skip_data(tar, zf, size - 1) == -1 || read_data(tar, zf, &c, 1) < 1) {
 			break;	/* invalid and reached EOF */
 		}
-		fseek(tar->fp, blksize - size, SEEK_CUR);
+		skip_data(tar, zf, blksize - size);
 
+add:
 		if(memcmp(hdr->magic, "ustar", 5) == 0) {
 			int nlen = strnlen(hdr->name, MAX_NAME_LEN);
 			int plen = strnlen(hdr->prefix, MAX_PREFIX_LEN);
-			if(!(path = malloc(nlen + plen + 1))) {
+			if(!(path = malloc(nlen + plen + 2))) {
 				perror("failed to allocate file path string");
 				goto end;
 			}
+			/* long paths are split at a slash, which isn't stored */
 			memcpy(path, hdr->prefix, plen);
+			if(plen) path[plen++] = '/';
 			memcpy(path + plen, hdr->name, nlen);
 			path[nlen + plen] = 0;
 		} else {
@@ -104,6 +217,7 @@ int load_tar(struct tar *tar, const char *fname)
 			perror("failed to allocate file list node");
 			goto end;
 		}
+		memset(&node->file, 0, sizeof node->file);
 		node->file.path = path;
 		node->file.offset = offset;
 		node->file.size = size;
@@ -136,7 +250,15 @@ int load_tar(struct tar *tar, const char *fname)
 		res = 0;
 	}
 
+	if(zf) {
+		tar->zidx = zf_take_index(zf);
+		if(res == 0) {
+			save_index(tar, fname);
+		}
+	}
+
 end:
+	zf_close(zf);
 	while(head) {
 		node = head;
 		head = head->next;
@@ -150,6 +272,191 @@ end:
 	return res;
 }
 
+static long read_data(struct tar *tar, struct zfile *zf, void *buf, long size)
+{
+	if(zf) {
+		return zf_read(zf, buf, size);
+	}
+	return fread(buf, 1, size, tar->fp);
+}
+
+static int skip_data(struct tar *tar, struct zfile *zf, long size)
+{
+	if(zf) {
+		return zf_seek(zf, size, SEEK_CUR) == -1 ? -1 : 0;
+	}
+	return fseek(tar->fp, size, SEEK_CUR);
+}
+
+/* pax records are: "<length> <keyword>=<value>\n", length including all of it */
+static void read_pax(struct tar *tar, const char *data, long size)
+{
+	const char *end = data + size;
+	char *kw;
+	long len;
+
+	while(data < end) {
+		len = strtol(data, &kw, 10);
+		if(len <= 0 || len > end - data || *kw++ != ' ') {
+			break;
+		}
+		if(memcmp(kw, PAX_HOT_KEY "=", sizeof PAX_HOT_KEY) == 0) {
+			tar->hot = strtoul(kw + sizeof PAX_HOT_KEY, 0, 10);
+		}
+		data += len;
+	}
+}
+
+/* the hot prefix has the files a program opens first, in the order it opens
+ * them; asking for all of it up front turns their reads into one sequential
+ * read, done by the OS in the background while the program gets going
+ */
+static void prefetch_hot(struct tar *tar)
+{
+#ifdef POSIX_FADV_WILLNEED
+	long end = tar->hot;
+
+	if(tar->zidx) {
+		/* compressed size of the prefix, or everything (0) if we can't tell */
+		if((end = zf_index_comp_offset(tar->zidx, tar->hot)) < 0) {
+			end = 0;
+		}
+	}
+	posix_fadvise(fileno(tar->fp), 0, end, POSIX_FADV_WILLNEED);
+#endif
+}
+
+static int load_index(struct tar *tar, const char *fname)
+{
+	int i;
+	FILE *fp;
+	char *idxname;
+	struct stat st;
+	struct zidx_header hdr;
+	uint64_t val64[2];
+	uint32_t plen;
+	struct tar_entry *ent;
+
+	if(stat(fname, &st) == -1 || !(idxname = malloc(strlen(fname) + sizeof ZIDX_SUFFIX))) {
+		return -1;
+	}
+	sprintf(idxname, "%s" ZIDX_SUFFIX, fname);
+	fp = fopen(idxname, "rb");
+	free(idxname);
+	if(!fp) return -1;
+
+	if(fread(&hdr, sizeof hdr, 1, fp) < 1 || memcmp(hdr.magic, ZIDX_MAGIC, 8) != 0 ||
+			hdr.version != ZIDX_VERSION || !hdr.num_files) {
+		goto err;
+	}
+	if(hdr.arsize != (uint64_t)st.st_size || hdr.armtime != (uint64_t)st.st_mtime) {
+		goto err;	/* stale, the tarball has changed since */
+	}
+
+	if(!(tar->files = calloc(hdr.num_files, sizeof *tar->files))) {
+		goto err;
+	}
+	for(i=0; i<hdr.num_files; i++) {
+		ent = tar->files + i;
+		if(fread(val64, 8, 2, fp) < 2 || fread(&plen, 4, 1, fp) < 1 || plen > 65536) {
+			goto err;
+		}
+		tar->num_files++;
+		if(!(ent->path = malloc(plen + 1)) || fread(ent->path, 1, plen, fp) < plen) {
+			goto err;
+		}
+		ent->path[plen] = 0;
+		ent->offset = val64[0];
+		ent->size = val64[1];
+	}
+	tar->hot = hdr.hot;
+
+	if(!(tar->zidx = zf_read_index(fp))) {
+		goto err;
+	}
+	fclose(fp);
+	return 0;
+
+err:
+	fclose(fp);
+	if(tar->files) {
+		for(i=0; i<tar->num_files; i++) {
+			free(tar->files[i].path);
+		}
+		free(tar->files);
+		tar->files = 0;
+		tar->num_files = 0;
+	}
+	return -1;
+}
+
+static void save_index(struct tar *tar, const char *fname)
+{
+	int i;
+	FILE *fp;
+	char *idxname, *tmpname;
+	struct stat st;
+	struct zidx_header hdr;
+	uint64_t val64[2];
+	uint32_t plen;
+	struct tar_entry *ent;
+
+	if(!tar->zidx || stat(fname, &st) == -1) return;
+
+	if(!(idxname = malloc((strlen(fname) + sizeof ZIDX_SUFFIX) * 2 + 4))) {
+		return;
+	}
+	tmpname = idxname + strlen(fname) + sizeof ZIDX_SUFFIX;
+	sprintf(idxname, "%s" ZIDX_SUFFIX, fname);
+	sprintf(tmpname, "%s" ZIDX_SUFFIX ".tmp", fname);
+
+	/* the tarball might be in a read-only location, that's fine */
+	if(!(fp = fopen(tmpname, "wb"))) {
+		free(idxname);
+		return;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, ZIDX_MAGIC, 8);
+	hdr.version = ZIDX_VERSION;
+	hdr.num_files = tar->num_files;
+	hdr.arsize = st.st_size;
+	hdr.armtime = st.st_mtime;
+	hdr.hot = tar->hot;
+	if(fwrite(&hdr, sizeof hdr, 1, fp) < 1) {
+		goto err;
+	}
+	for(i=0; i<tar->num_files; i++) {
+		ent = tar->files + i;
+		val64[0] = ent->offset;
+		val64[1] = ent->size;
+		plen = strlen(ent->path);
+		if(fwrite(val64, 8, 2, fp) < 2 || fwrite(&plen, 4, 1, fp) < 1 ||
+				fwrite(ent->path, 1, plen, fp) < plen) {
+			goto err;
+		}
+	}
+	if(zf_write_index(tar->zidx, fp) == -1 || fclose(fp) == EOF) {
+		fp = 0;
+		goto err;
+	}
+
+	/* write and rename, so that concurrent loads never see a partial index */
+#ifdef WIN32
+	remove(idxname);
+#endif
+	if(rename(tmpname, idxname) == -1) {
+		remove(tmpname);
+	}
+	free(idxname);
+	return;
+
+err:
+	if(fp) fclose(fp);
+	remove(tmpname);
+	free(idxname);
+}
+
 
 void close_tar(struct tar *tar)
 {
@@ -159,13 +466,294 @@ void close_tar(struct tar *tar)
 		fclose(tar->fp);
 		tar->fp = 0;
 	}
-	if(tar->files && tar->num_files > 0) {
+	zf_free_index(tar->zidx);
+	tar->zidx = 0;
+	free(tar->htab);
+	tar->htab = 0;
+	if(tar->files) {
 		int i;
-		for(i=0; i<tar->num_files; i++) {
-			free(tar->files[i].path);
+		if(tar->names) {
+			free(tar->names);
+			tar->names = 0;
+		} else {
+			for(i=0; i<tar->num_files; i++) {
+				free(tar->files[i].path);
+			}
 		}
 		free(tar->files);
 		tar->files = 0;
 		tar->num_files = 0;
 	}
 }
+
+struct tar_entry *find_tar_entry(struct tar *tar, const char *path)
+{
+	uint32_t i, idx, mask = tar->htab_size - 1;
+	struct tar_entry *ent;
+
+	idx = ass_hash64(path, strlen(path), 0) & mask;
+	for(i=0; i<tar->htab_size; i++) {
+		if(!tar->htab[idx]) break;
+		ent = tar->files + tar->htab[idx] - 1;
+		if(strcmp(ent->path, path) == 0) {
+			return ent;
+		}
+		idx = (idx + 1) & mask;
+	}
+	return 0;
+}
+
+static int build_hash(struct tar *tar)
+{
+	int i;
+	uint32_t idx, mask;
+
+	/* at most half full, open addressing with linear probing. Slots hold
+	 * entry index + 1, 0 is empty. For duplicate paths the first one wins.
+	 */
+	tar->htab_size = 16;
+	while(tar->htab_size < (uint32_t)tar->num_files * 2) {
+		tar->htab_size <<= 1;
+	}
+	if(!(tar->htab = calloc(tar->htab_size, sizeof *tar->htab))) {
+		perror("load_tar: failed to allocate file hash table");
+		return -1;
+	}
+	mask = tar->htab_size - 1;
+
+	for(i=0; i<tar->num_files; i++) {
+		idx = ass_hash64(tar->files[i].path, strlen(tar->files[i].path), 0) & mask;
+		while(tar->htab[idx]) {
+			if(strcmp(tar->files[tar->htab[idx] - 1].path, tar->files[i].path) == 0) {
+				break;
+			}
+			idx = (idx + 1) & mask;
+		}
+		if(!tar->htab[idx]) {
+			tar->htab[idx] = i + 1;
+		}
+	}
+	return 0;
+}
+
+
+/* --- zip archives --- */
+
+#define ZIP_LOCHDR_SIG		0x04034b50
+#define ZIP_CDIR_SIG		0x02014b50
+#define ZIP_EOCD_SIG		0x06054b50
+#define ZIP_EOCD64_SIG		0x06064b50
+#define ZIP_EOCD64LOC_SIG	0x07064b50
+
+#define ZIP_LOCHDR_SIZE		30
+#define ZIP_CDIR_SIZE		46
+#define ZIP_EOCD_SIZE		22
+#define ZIP_EOCD64_SIZE		56
+#define ZIP_EOCD64LOC_SIZE	20
+#define ZIP_MAX_COMMENT		65535
+
+/* zip is little endian, with unaligned fields */
+static unsigned int rd16(const unsigned char *p)
+{
+	return p[0] | ((unsigned int)p[1] << 8);
+}
+
+static uint32_t rd32(const unsigned char *p)
+{
+	return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t rd64(const unsigned char *p)
+{
+	return rd32(p) | ((uint64_t)rd32(p + 4) << 32);
+}
+
+/* finds the end of central directory record, and from it (or its zip64
+ * counterpart) the offset, size and number of entries of the central
+ * directory
+ */
+static int find_zip_cdir(FILE *fp, uint64_t *offs, uint64_t *size, uint64_t *count)
+{
+	long fsize, bufsz, i;
+	unsigned char *buf, *eocd = 0, *loc;
+	unsigned char eocd64[ZIP_EOCD64_SIZE];
+	int res = -1;
+
+	if(fseek(fp, 0, SEEK_END) == -1 || (fsize = ftell(fp)) < ZIP_EOCD_SIZE) {
+		return -1;
+	}
+	/* the record is at the end, followed by a comment of up to 64k */
+	bufsz = ZIP_EOCD64LOC_SIZE + ZIP_EOCD_SIZE + ZIP_MAX_COMMENT;
+	if(bufsz > fsize) bufsz = fsize;
+
+	if(!(buf = malloc(bufsz))) {
+		return -1;
+	}
+	if(fseek(fp, fsize - bufsz, SEEK_SET) == -1 || fread(buf, 1, bufsz, fp) < bufsz) {
+		goto end;
+	}
+	for(i=bufsz - ZIP_EOCD_SIZE; i>=0; i--) {
+		if(rd32(buf + i) == ZIP_EOCD_SIG && i + ZIP_EOCD_SIZE + rd16(buf + i + 20) <= bufsz) {
+			eocd = buf + i;
+			break;
+		}
+	}
+	if(!eocd) goto end;
+
+	*count = rd16(eocd + 10);
+	*size = rd32(eocd + 12);
+	*offs = rd32(eocd + 16);
+
+	loc = eocd - ZIP_EOCD64LOC_SIZE;
+	if(loc >= buf && rd32(loc) == ZIP_EOCD64LOC_SIG) {
+		/* zip64: more than 64k entries, or offsets beyond 4GB */
+		if(fseek(fp, (long)rd64(loc + 8), SEEK_SET) == -1 ||
+				fread(eocd64, 1, sizeof eocd64, fp) < sizeof eocd64 ||
+				rd32(eocd64) != ZIP_EOCD64_SIG) {
+			goto end;
+		}
+		*count = rd64(eocd64 + 32);
+		*size = rd64(eocd64 + 40);
+		*offs = rd64(eocd64 + 48);
+	}
+	res = 0;
+end:
+	free(buf);
+	return res;
+}
+
+static int load_zip(struct tar *tar, const char *fname)
+{
+	uint64_t cdoffs, cdsize, count, usize, csize, lhoffs;
+	unsigned char *cdir = 0, *ptr, *end, *ext, *extend;
+	unsigned int i, nlen, xlen, clen, flags, method, id, sz, skipped = 0;
+	char *nameptr;
+	struct tar_entry *ent;
+
+	if(find_zip_cdir(tar->fp, &cdoffs, &cdsize, &count) == -1) {
+		fprintf(stderr, "load_tar: %s: invalid zip file, central directory not found\n", fname);
+		return -1;
+	}
+	if(cdsize > (uint64_t)LONG_MAX || count > cdsize / ZIP_CDIR_SIZE) {
+		fprintf(stderr, "load_tar: %s: invalid zip central directory\n", fname);
+		return -1;
+	}
+
+	/* read the whole central directory in one go, and all names into a
+	 * single block, which is smaller than the central directory
+	 */
+	if(!(cdir = malloc(cdsize)) || !(tar->names = malloc(cdsize)) ||
+			!(tar->files = malloc((count ? count : 1) * sizeof *tar->files))) {
+		perror("load_tar: failed to allocate zip directory");
+		goto err;
+	}
+	if(fseek(tar->fp, (long)cdoffs, SEEK_SET) == -1 || fread(cdir, 1, cdsize, tar->fp) < cdsize) {
+		fprintf(stderr, "load_tar: %s: failed to read zip central directory\n", fname);
+		goto err;
+	}
+
+	nameptr = tar->names;
+	ptr = cdir;
+	end = cdir + cdsize;
+	for(i=0; i<count; i++) {
+		if(end - ptr < ZIP_CDIR_SIZE || rd32(ptr) != ZIP_CDIR_SIG) {
+			goto corrupt;
+		}
+		flags = rd16(ptr + 8);
+		method = rd16(ptr + 10);
+		csize = rd32(ptr + 20);
+		usize = rd32(ptr + 24);
+		nlen = rd16(ptr + 28);
+		xlen = rd16(ptr + 30);
+		clen = rd16(ptr + 32);
+		lhoffs = rd32(ptr + 42);
+		if(end - ptr < ZIP_CDIR_SIZE + nlen + xlen + clen) {
+			goto corrupt;
+		}
+
+		/* zip64 extended information: the 64bit versions of any fields which
+		 * are set to 0xffffffff, in this order
+		 */
+		ext = ptr + ZIP_CDIR_SIZE + nlen;
+		extend = ext + xlen;
+		while(extend - ext >= 4) {
+			id = rd16(ext);
+			sz = rd16(ext + 2);
+			ext += 4;
+			if(sz > extend - ext) break;
+			if(id == 1) {
+				unsigned char *field = ext;
+				if(usize == 0xffffffff && field + 8 <= ext + sz) {
+					usize = rd64(field);
+					field += 8;
+				}
+				if(csize == 0xffffffff && field + 8 <= ext + sz) {
+					csize = rd64(field);
+					field += 8;
+				}
+				if(lhoffs == 0xffffffff && field + 8 <= ext + sz) {
+					lhoffs = rd64(field);
+				}
+			}
+			ext += sz;
+		}
+
+		/* skip directories, encrypted entries and unsupported compression */
+		if(nlen && ptr[ZIP_CDIR_SIZE + nlen - 1] == '/') {
+			ptr += ZIP_CDIR_SIZE + nlen + xlen + clen;
+			continue;
+		}
+		if((flags & 1) || (method != ARC_STORED && method != ARC_DEFLATED)) {
+			skipped++;
+			ptr += ZIP_CDIR_SIZE + nlen + xlen + clen;
+			continue;
+		}
+
+		ent = tar->files + tar->num_files++;
+		ent->path = nameptr;
+		memcpy(nameptr, ptr + ZIP_CDIR_SIZE, nlen);
+		nameptr[nlen] = 0;
+		nameptr += nlen + 1;
+
+		/* the data offset depends on the local header, which we'll read
+		 * when the file is first opened
+		 */
+		ent->offset = lhoffs;
+		ent->size = usize;
+		ent->csize = csize;
+		ent->method = method;
+		ent->lochdr = 1;
+
+		ptr += ZIP_CDIR_SIZE + nlen + xlen + clen;
+	}
+	free(cdir);
+
+	if(skipped) {
+		fprintf(stderr, "load_tar: %s: skipped %u encrypted or unsupported zip entries\n",
+				fname, skipped);
+	}
+	return 0;
+
+corrupt:
+	fprintf(stderr, "load_tar: %s: corrupted zip central directory\n", fname);
+err:
+	free(cdir);
+	return -1;
+}
+
+int resolve_tar_entry(struct tar *tar, struct tar_entry *ent)
+{
+	unsigned char hdr[ZIP_LOCHDR_SIZE];
+
+	if(!ent->lochdr) return 0;
+
+	if(fseek(tar->fp, ent->offset, SEEK_SET) == -1 || fread(hdr, 1, sizeof hdr, tar->fp) < sizeof hdr ||
+			rd32(hdr) != ZIP_LOCHDR_SIG) {
+		fprintf(stderr, "load_tar: invalid zip local header for %s\n", ent->path);
+		return -1;
+	}
+	/* the local extra field can differ from the one in the central dir */
+	ent->offset += ZIP_LOCHDR_SIZE + rd16(hdr + 26) + rd16(hdr + 28);
+	ent->lochdr = 0;
+	return 0;
+}
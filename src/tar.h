@@ -19,20 +19,59 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define TAR_H_
 
 #include <stdio.h>
+#include <inttypes.h>
+
+/* compression methods, with their zip numbers */
+#define ARC_STORED		0
+#define ARC_DEFLATED	8
 
 struct tar_entry {
 	char *path;
 	unsigned long offset;
 	unsigned long size;
+	/* zip entries can be compressed: csize bytes of raw deflate at offset.
+	 * lochdr is set while offset still points to the local header, see
+	 * resolve_tar_entry.
+	 */
+	unsigned long csize;
+	int method;
+	int lochdr;
 };
 
+struct zf_index;
+
 struct tar {
 	FILE *fp;
 	struct tar_entry *files;
 	int num_files;
+	char *names;	/* zip: all paths in one block, instead of one allocation each */
+	/* hash table of paths, open addressing, slots are file index + 1 */
+	uint32_t *htab;
+	uint32_t htab_size;
+	/* gzip-compressed tarballs: access points for reading entries without
+	 * decompressing everything before them. Entry offsets are offsets in the
+	 * uncompressed tar stream. Null for uncompressed tarballs.
+	 */
+	struct zf_index *zidx;
+	/* size of the hot prefix: the files a program reads first, which the
+	 * asslayout tool puts at the start of the tarball, in the order they
+	 * were read. 0 for tarballs without a recorded layout.
+	 */
+	unsigned long hot;
 };
 
+/* loads the file list of a tarball, which can be gzip-compressed, or a zip
+ * file, detected by their magic numbers. For compressed tarballs, the file
+ * list and access point index are saved to fname.idx, and reused by
+ * subsequent loads while the tarball is unchanged. Zip file lists come from
+ * the central directory, without scanning the file. If the tarball has a hot
+ * prefix, the OS is asked to start reading it in the background.
+ */
 int load_tar(struct tar *tar, const char *fname);
 void close_tar(struct tar *tar);
 
+struct tar_entry *find_tar_entry(struct tar *tar, const char *path);
+/* zip entries: reads the local header to find where the data starts */
+int resolve_tar_entry(struct tar *tar, struct tar_entry *ent);
+
 #endif	/* TAR_H_ */
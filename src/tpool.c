@@ -15,8 +15,14 @@ GNU Lesser General Public License for more details.
 You should have received a copy of the GNU Lesser General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* for pthread_setaffinity_np and pthread_setname_np */
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <pthread.h>
 #include "tpool.h"
@@ -32,11 +38,17 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #if defined(unix) || defined(__unix__)
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
 
 # ifdef __bsd__
 #  include <sys/sysctl.h>
 # endif
+# ifdef __linux__
+#  include <sched.h>
+#  include <stdint.h>
+#  include <sys/eventfd.h>
+# endif
 #endif
 
 #if defined(WIN32) || defined(__WIN32__)
@@ -44,15 +56,110 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #endif
 
 
-struct work_item {
+/* counters and queues shared between workers and submitters are accessed
+ * atomically, so that enqueueing and running jobs never takes a mutex.
+ */
+#define ALOAD(x)	__atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define ASTORE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+#define AINC(x)		__atomic_add_fetch(&(x), 1, __ATOMIC_SEQ_CST)
+#define ADEC(x)		__atomic_sub_fetch(&(x), 1, __ATOMIC_SEQ_CST)
+#define APEEK(x)	__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define APOKE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define AXCHG(x, v)	__atomic_exchange_n(&(x), (v), __ATOMIC_SEQ_CST)
+/* on failure, exp is updated with the current value */
+#define ACAS(x, exp, v)	\
+	__atomic_compare_exchange_n(&(x), &(exp), (v), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
+#define CACHE_LINE	64
+
+/* The job state word holds one of the JOB_* states in the low bits, and a tag
+ * in the rest, which changes every time the job is queued. Queue entries
+ * record the state word at the time they were pushed, and a worker may only
+ * take the job if it still matches. Cancelling or moving a queued job just
+ * changes its state word, and leaves a stale entry behind, which is dropped
+ * when it reaches the front of its queue.
+ */
+enum { JOB_WAITING, JOB_QUEUED, JOB_RUNNING, JOB_DONE, JOB_CANCELLED };
+#define STATE_MASK		7
+#define TAG_INC			8
+#define JOB_STATE(w)	((w) & STATE_MASK)
+#define NEXT_TAG(w)		(((w) & ~STATE_MASK) + TAG_INC)
+
+struct dep_link {
+	struct tpool_job *job;
+	struct dep_link *next;
+};
+/* replaces the dependents list of a job when it finishes */
+#define DEPS_CLOSED	((struct dep_link*)1)
+
+struct tpool_job {
+	struct thread_pool *pool;
 	void *data;
 	tpool_callback work, done;
-	struct work_item *next;
+	int prio;
+	unsigned int state;	/* state word, see above */
+	int nref;	/* one per queue entry or running worker, one per handle */
+
+	/* dependency tracking. The job stays in the waiting state until ndeps
+	 * drops to 0, and is cancelled if any of its dependencies was cancelled.
+	 */
+	int ndeps, dep_failed;
+	struct dep_link *dependents;
+
+	struct tpool_job *next;	/* free list link */
+};
+
+struct job_ref {
+	struct tpool_job *job;
+	unsigned int word;
+};
+
+/* shared queues are bounded lock-free MPMC ring buffers (D. Vyukov). When one
+ * fills up, further jobs spill over to a mutex-protected list until it drains,
+ * which keeps the order FIFO.
+ */
+#define RING_SIZE	2048
+
+struct ring_cell {
+	unsigned int seq;
+	unsigned int word;
+	struct tpool_job *job;
+};
+
+struct ovf_node {
+	struct job_ref ref;
+	struct ovf_node *next;
+};
+
+struct job_ring {
+	unsigned int head;
+	char pad0[CACHE_LINE - sizeof(unsigned int)];
+	unsigned int tail;
+	char pad1[CACHE_LINE - sizeof(unsigned int)];
+	struct ring_cell cell[RING_SIZE];
+
+	struct ovf_node *ovf, *ovf_tail;
+	pthread_mutex_t ovf_lock;
+};
+
+/* per-worker queues in work-stealing mode are Chase-Lev deques. The owner
+ * pushes and pops jobs at the bottom, idle workers steal from the top. When
+ * one fills up, jobs go to the shared queue instead.
+ */
+#define DEQUE_SIZE	256
+
+struct job_deque {
+	long top;
+	char pad0[CACHE_LINE - sizeof(long)];
+	long bottom;
+	char pad1[CACHE_LINE - sizeof(long)];
+	struct job_ref cell[DEQUE_SIZE];
 };
 
 struct thread_data {
 	int id;
 	struct thread_pool *pool;
+	struct job_deque deque[ASS_TPOOL_NUM_PRIO];
 };
 
 struct thread_pool {
@@ -60,15 +167,18 @@ struct thread_pool {
 	struct thread_data *tdata;
 	int num_threads;
 	pthread_key_t idkey;
+	unsigned int flags;
 
-	int qsize;
-	struct work_item *workq, *workq_tail;
-	pthread_mutex_t workq_mutex;
+	int qsize;		/* number of queued jobs, in all queues */
+	struct job_ring workq[ASS_TPOOL_NUM_PRIO];
+	pthread_mutex_t workq_mutex;	/* guards sleeping and waiting */
 	pthread_cond_t workq_condvar;
+	int nsleeping;	/* number of workers waiting on workq_condvar */
 
 	int nactive;	/* number of active workers (not sleeping) */
 
 	pthread_cond_t done_condvar;
+	int nwaiters;	/* number of threads waiting on done_condvar */
 
 	int should_quit;
 	int in_batch;
@@ -78,18 +188,40 @@ struct thread_pool {
 #if defined(WIN32) || defined(__WIN32__)
 	HANDLE wait_event;
 #else
-	int wait_pipe[2];
+	int wait_pipe[2];	/* on linux both are the same eventfd */
+	int ev_pending;		/* completions not yet reported through wait_pipe */
 #endif
 };
 
 static void *thread_func(void *args);
+static struct tpool_job *get_job(struct thread_pool *tpool, struct thread_data *self);
+static struct tpool_job *claim_job(struct thread_pool *tpool, struct job_ref ref);
+static void drop_entry(struct thread_pool *tpool, struct job_ref ref);
+static void queue_job(struct thread_pool *tpool, struct tpool_job *job, unsigned int word, int local);
+static void run_job(struct thread_pool *tpool, struct tpool_job *job);
+static void finish_job(struct thread_pool *tpool, struct tpool_job *job, int state);
+static void release_dependent(struct thread_pool *tpool, struct tpool_job *job, int failed);
+static void job_done(struct thread_pool *tpool);
+static void wake_waiters(struct thread_pool *tpool);
 static void send_done_event(struct thread_pool *tpool);
 
-static struct work_item *alloc_work_item(void);
-static void free_work_item(struct work_item *w);
+static void init_ring(struct job_ring *q);
+static int ring_push(struct job_ring *q, struct tpool_job *job, unsigned int word);
+static struct job_ref ring_pop(struct job_ring *q);
+static int deque_push(struct job_deque *dq, struct tpool_job *job, unsigned int word);
+static struct job_ref deque_pop(struct job_deque *dq);
+static struct job_ref deque_steal(struct job_deque *dq);
+
+static struct tpool_job *alloc_work_item(void);
+static void free_work_item(struct tpool_job *w);
 
 
 struct thread_pool *ass_tpool_create(int num_threads)
+{
+	return ass_tpool_create_flags(num_threads, 0);
+}
+
+struct thread_pool *ass_tpool_create_flags(int num_threads, unsigned int flags)
 {
 	int i;
 	struct thread_pool *tpool;
@@ -97,12 +229,15 @@ struct thread_pool *ass_tpool_create(int num_threads)
 	if(!(tpool = calloc(1, sizeof *tpool))) {
 		return 0;
 	}
+	tpool->flags = flags;
+	tpool->nref = 1;	/* the creator's reference */
 	pthread_mutex_init(&tpool->workq_mutex, 0);
 	pthread_cond_init(&tpool->workq_condvar, 0);
 	pthread_cond_init(&tpool->done_condvar, 0);
 	pthread_key_create(&tpool->idkey, 0);
-
-	pthread_setspecific(tpool->idkey, (void*)0xffffffff);
+	for(i=0; i<ASS_TPOOL_NUM_PRIO; i++) {
+		init_ring(tpool->workq + i);
+	}
 
 #if !defined(WIN32) && !defined(__WIN32__)
 	tpool->wait_pipe[0] = tpool->wait_pipe[1] = -1;
@@ -117,18 +252,19 @@ struct thread_pool *ass_tpool_create(int num_threads)
 		free(tpool);
 		return 0;
 	}
-	if(!(tpool->tdata = malloc(num_threads * sizeof *tpool->tdata))) {
+	if(!(tpool->tdata = calloc(num_threads, sizeof *tpool->tdata))) {
 		free(tpool->threads);
 		free(tpool);
 		return 0;
 	}
-
 	for(i=0; i<num_threads; i++) {
 		tpool->tdata[i].id = i;
 		tpool->tdata[i].pool = tpool;
+	}
 
-		if(pthread_create(tpool->threads + i, 0, thread_func, tpool->tdata + i) == -1) {
-			/*tpool->threads[i] = 0;*/
+	for(i=0; i<num_threads; i++) {
+		if(pthread_create(tpool->threads + i, 0, thread_func, tpool->tdata + i) != 0) {
+			tpool->num_threads = i;
 			ass_tpool_destroy(tpool);
 			return 0;
 		}
@@ -142,24 +278,32 @@ void ass_tpool_destroy(struct thread_pool *tpool)
 	if(!tpool) return;
 
 	ass_tpool_clear(tpool);
-	tpool->should_quit = 1;
 
+	pthread_mutex_lock(&tpool->workq_mutex);
+	ASTORE(tpool->should_quit, 1);
 	pthread_cond_broadcast(&tpool->workq_condvar);
+	pthread_mutex_unlock(&tpool->workq_mutex);
 
 	if(tpool->threads) {
 		for(i=0; i<tpool->num_threads; i++) {
 			pthread_join(tpool->threads[i], 0);
 		}
-		putchar('\n');
 		free(tpool->threads);
 	}
+	/* drop anything queued by jobs which were still running above */
+	ass_tpool_clear(tpool);
 	free(tpool->tdata);
 
 	/* also wake up anyone waiting on the wait* calls */
+	pthread_mutex_lock(&tpool->workq_mutex);
 	tpool->nactive = 0;
 	pthread_cond_broadcast(&tpool->done_condvar);
+	pthread_mutex_unlock(&tpool->workq_mutex);
 	send_done_event(tpool);
 
+	for(i=0; i<ASS_TPOOL_NUM_PRIO; i++) {
+		pthread_mutex_destroy(&tpool->workq[i].ovf_lock);
+	}
 	pthread_mutex_destroy(&tpool->workq_mutex);
 	pthread_cond_destroy(&tpool->workq_condvar);
 	pthread_cond_destroy(&tpool->done_condvar);
@@ -172,120 +316,289 @@ void ass_tpool_destroy(struct thread_pool *tpool)
 #else
 	if(tpool->wait_pipe[0] >= 0) {
 		close(tpool->wait_pipe[0]);
-		close(tpool->wait_pipe[1]);
+		if(tpool->wait_pipe[1] != tpool->wait_pipe[0]) {
+			close(tpool->wait_pipe[1]);
+		}
 	}
 #endif
+	free(tpool);
 }
 
 int ass_tpool_addref(struct thread_pool *tpool)
 {
-	return ++tpool->nref;
+	return AINC(tpool->nref);
 }
 
 int ass_tpool_release(struct thread_pool *tpool)
 {
-	if(--tpool->nref <= 0) {
+	int nref;
+
+	if((nref = ADEC(tpool->nref)) <= 0) {
 		ass_tpool_destroy(tpool);
 		return 0;
 	}
-	return tpool->nref;
+	return nref;
+}
+
+int ass_tpool_num_threads(struct thread_pool *tpool)
+{
+	return tpool->num_threads;
 }
 
 void ass_tpool_begin_batch(struct thread_pool *tpool)
 {
-	tpool->in_batch = 1;
+	ASTORE(tpool->in_batch, 1);
 }
 
 void ass_tpool_end_batch(struct thread_pool *tpool)
 {
-	tpool->in_batch = 0;
+	pthread_mutex_lock(&tpool->workq_mutex);
+	ASTORE(tpool->in_batch, 0);
 	pthread_cond_broadcast(&tpool->workq_condvar);
+	pthread_mutex_unlock(&tpool->workq_mutex);
 }
 
 int ass_tpool_enqueue(struct thread_pool *tpool, void *data,
 		tpool_callback work_func, tpool_callback done_func)
 {
-	struct work_item *job;
+	return ass_tpool_enqueue_prio(tpool, data, work_func, done_func, ASS_TPOOL_PRIO_NORMAL);
+}
 
-	if(!(job = alloc_work_item())) {
+int ass_tpool_enqueue_prio(struct thread_pool *tpool, void *data,
+		tpool_callback work_func, tpool_callback done_func, int prio)
+{
+	struct tpool_job *job;
+
+	if(!(job = ass_tpool_submit(tpool, data, work_func, done_func, prio))) {
 		return -1;
 	}
+	ass_tpool_job_release(job);
+	return 0;
+}
+
+struct tpool_job *ass_tpool_submit(struct thread_pool *tpool, void *data,
+		tpool_callback work_func, tpool_callback done_func, int prio)
+{
+	return ass_tpool_submit_after(tpool, data, work_func, done_func, prio, 0, 0);
+}
+
+struct tpool_job *ass_tpool_submit_after(struct thread_pool *tpool, void *data,
+		tpool_callback work_func, tpool_callback done_func, int prio,
+		struct tpool_job **deps, int num_deps)
+{
+	int i;
+	struct tpool_job *job, *dep;
+	struct dep_link *link, *head;
+
+	if(!(job = alloc_work_item())) {
+		return 0;
+	}
+	if(prio < 0) prio = 0;
+	if(prio >= ASS_TPOOL_NUM_PRIO) prio = ASS_TPOOL_NUM_PRIO - 1;
+
+	job->pool = tpool;
 	job->work = work_func;
 	job->done = done_func;
 	job->data = data;
-	job->next = 0;
+	job->prio = prio;
+	job->state = JOB_WAITING;
+	job->nref = 2;	/* one for the pool, one for the returned handle */
+	job->ndeps = 1;	/* held by us until all dependencies are registered */
+	job->dep_failed = 0;
+	job->dependents = 0;
+
+	for(i=0; i<num_deps; i++) {
+		if(!(dep = deps[i])) continue;
+
+		if(!(link = malloc(sizeof *link))) {
+			fprintf(stderr, "ass_tpool_submit_after: failed to allocate dependency link\n");
+			job->dep_failed = 1;
+			break;
+		}
+		link->job = job;
+
+		/* count it before it becomes visible, the dependency may finish and
+		 * release it right away.
+		 */
+		AINC(job->ndeps);
+		head = ALOAD(dep->dependents);
+		do {
+			if(head == DEPS_CLOSED) break;
+			link->next = head;
+		} while(!ACAS(dep->dependents, head, link));
+
+		if(head == DEPS_CLOSED) {
+			/* already finished, its final state is visible by now */
+			free(link);
+			ADEC(job->ndeps);
+			if(JOB_STATE(ALOAD(dep->state)) != JOB_DONE) {
+				job->dep_failed = 1;
+			}
+		}
+	}
 
-	pthread_mutex_lock(&tpool->workq_mutex);
-	if(tpool->workq) {
-		tpool->workq_tail->next = job;
-		tpool->workq_tail = job;
-	} else {
-		tpool->workq = tpool->workq_tail = job;
+	/* drop our hold, which queues the job if nothing else is pending */
+	release_dependent(tpool, job, 0);
+	return job;
+}
+
+int ass_tpool_cancel(struct thread_pool *tpool, struct tpool_job *job)
+{
+	unsigned int word;
+
+	for(;;) {
+		word = ALOAD(job->state);
+		switch(JOB_STATE(word)) {
+		case JOB_WAITING:
+			/* dropped once its dependencies finish */
+			if(ACAS(job->state, word, (word & ~STATE_MASK) | JOB_CANCELLED)) {
+				return 0;
+			}
+			break;
+
+		case JOB_QUEUED:
+			/* the queue entry is left behind, and dropped when it's reached */
+			if(ACAS(job->state, word, (word & ~STATE_MASK) | JOB_CANCELLED)) {
+				ADEC(tpool->qsize);
+				finish_job(tpool, job, JOB_CANCELLED);
+				/* the pending count dropped, wake up anyone waiting for it */
+				wake_waiters(tpool);
+				return 0;
+			}
+			break;
+
+		default:
+			return -1;	/* already running or finished */
+		}
 	}
-	++tpool->qsize;
-	pthread_mutex_unlock(&tpool->workq_mutex);
+}
+
+int ass_tpool_set_prio(struct thread_pool *tpool, struct tpool_job *job, int prio)
+{
+	unsigned int word, newword;
+
+	if(prio < 0) prio = 0;
+	if(prio >= ASS_TPOOL_NUM_PRIO) prio = ASS_TPOOL_NUM_PRIO - 1;
+
+	for(;;) {
+		word = ALOAD(job->state);
+		switch(JOB_STATE(word)) {
+		case JOB_WAITING:
+			ASTORE(job->prio, prio);
+			if(ALOAD(job->state) == word) {
+				return 0;
+			}
+			break;	/* got queued in the meantime, move it */
+
+		case JOB_QUEUED:
+			/* re-tag it, which makes the old queue entry stale, and push a new
+			 * entry to the back of the shared queue for the new priority. qsize
+			 * is left alone, the job is counted as queued throughout.
+			 */
+			newword = NEXT_TAG(word) | JOB_QUEUED;
+			if(ACAS(job->state, word, newword)) {
+				AINC(job->nref);
+				ASTORE(job->prio, prio);
+				queue_job(tpool, job, newword, 0);
+				return 0;
+			}
+			break;
 
-	if(!tpool->in_batch) {
-		pthread_cond_broadcast(&tpool->workq_condvar);
+		default:
+			return -1;
+		}
+	}
+}
+
+int ass_tpool_job_done(struct tpool_job *job)
+{
+	int state = JOB_STATE(ALOAD(job->state));
+	return state == JOB_DONE || (state == JOB_CANCELLED && !ALOAD(job->ndeps));
+}
+
+int ass_tpool_job_wait(struct tpool_job *job)
+{
+	struct thread_pool *tpool = job->pool;
+	struct tpool_job *other;
+	int tid = ass_tpool_thread_id(tpool);
+
+	while(!ass_tpool_job_done(job)) {
+		/* when called from one of our workers, keep working on other jobs
+		 * while waiting, instead of tying up the thread.
+		 */
+		if(tid >= 0 && (other = get_job(tpool, tpool->tdata + tid))) {
+			run_job(tpool, other);
+			continue;
+		}
+
+		pthread_mutex_lock(&tpool->workq_mutex);
+		AINC(tpool->nwaiters);
+		if(!ass_tpool_job_done(job) && (tid < 0 || !ALOAD(tpool->qsize))) {
+			pthread_cond_wait(&tpool->done_condvar, &tpool->workq_mutex);
+		}
+		ADEC(tpool->nwaiters);
+		pthread_mutex_unlock(&tpool->workq_mutex);
+	}
+	return JOB_STATE(ALOAD(job->state)) == JOB_DONE ? 0 : -1;
+}
+
+void ass_tpool_job_release(struct tpool_job *job)
+{
+	if(job && ADEC(job->nref) <= 0) {
+		free_work_item(job);
 	}
-	return 0;
 }
 
 void ass_tpool_clear(struct thread_pool *tpool)
 {
-	pthread_mutex_lock(&tpool->workq_mutex);
-	while(tpool->workq) {
-		void *tmp = tpool->workq;
-		tpool->workq = tpool->workq->next;
-		free(tmp);
+	int i, j;
+	struct job_ref ref;
+	struct job_deque *dq;
+
+	for(i=0; i<ASS_TPOOL_NUM_PRIO; i++) {
+		while((ref = ring_pop(tpool->workq + i)).job) {
+			drop_entry(tpool, ref);
+		}
+		for(j=0; j<tpool->num_threads; j++) {
+			dq = tpool->tdata[j].deque + i;
+			while(ALOAD(dq->top) < ALOAD(dq->bottom)) {
+				if((ref = deque_steal(dq)).job) {
+					drop_entry(tpool, ref);
+				}
+			}
+		}
 	}
-	tpool->workq = tpool->workq_tail = 0;
-	tpool->qsize = 0;
-	pthread_mutex_unlock(&tpool->workq_mutex);
+	wake_waiters(tpool);
 }
 
 int ass_tpool_queued_jobs(struct thread_pool *tpool)
 {
-	int res;
-	pthread_mutex_lock(&tpool->workq_mutex);
-	res = tpool->qsize;
-	pthread_mutex_unlock(&tpool->workq_mutex);
-	return res;
+	return ALOAD(tpool->qsize);
 }
 
 int ass_tpool_active_jobs(struct thread_pool *tpool)
 {
-	int res;
-	pthread_mutex_lock(&tpool->workq_mutex);
-	res = tpool->nactive;
-	pthread_mutex_unlock(&tpool->workq_mutex);
-	return res;
+	return ALOAD(tpool->nactive);
 }
 
 int ass_tpool_pending_jobs(struct thread_pool *tpool)
 {
-	int res;
-	pthread_mutex_lock(&tpool->workq_mutex);
-	res = tpool->qsize + tpool->nactive;
-	pthread_mutex_unlock(&tpool->workq_mutex);
-	return res;
+	return ALOAD(tpool->qsize) + ALOAD(tpool->nactive);
 }
 
 void ass_tpool_wait(struct thread_pool *tpool)
 {
-	pthread_mutex_lock(&tpool->workq_mutex);
-	while(tpool->nactive || tpool->qsize) {
-		pthread_cond_wait(&tpool->done_condvar, &tpool->workq_mutex);
-	}
-	pthread_mutex_unlock(&tpool->workq_mutex);
+	ass_tpool_wait_pending(tpool, 0);
 }
 
 void ass_tpool_wait_pending(struct thread_pool *tpool, int pending_target)
 {
 	pthread_mutex_lock(&tpool->workq_mutex);
-	while(tpool->qsize + tpool->nactive > pending_target) {
+	AINC(tpool->nwaiters);
+	while(ass_tpool_pending_jobs(tpool) > pending_target) {
 		pthread_cond_wait(&tpool->done_condvar, &tpool->workq_mutex);
 	}
+	ADEC(tpool->nwaiters);
 	pthread_mutex_unlock(&tpool->workq_mutex);
 }
 
@@ -338,12 +651,14 @@ long ass_tpool_timedwait(struct thread_pool *tpool, long timeout)
 	tout_ts.tv_sec = tv0.tv_sec + sec;
 
 	pthread_mutex_lock(&tpool->workq_mutex);
-	while(tpool->nactive || tpool->qsize) {
+	AINC(tpool->nwaiters);
+	while(ass_tpool_pending_jobs(tpool)) {
 		if(pthread_cond_timedwait(&tpool->done_condvar,
 					&tpool->workq_mutex, &tout_ts) == ETIMEDOUT) {
 			break;
 		}
 	}
+	ADEC(tpool->nwaiters);
 	pthread_mutex_unlock(&tpool->workq_mutex);
 
 	gettimeofday(&tv, 0);
@@ -352,10 +667,24 @@ long ass_tpool_timedwait(struct thread_pool *tpool, long timeout)
 
 int ass_tpool_get_wait_fd(struct thread_pool *tpool)
 {
+	int fd[2];
+
 	if(tpool->wait_pipe[0] < 0) {
-		if(pipe(tpool->wait_pipe) == -1) {
+#ifdef __linux__
+		if((fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
 			return -1;
 		}
+		fd[1] = fd[0];
+#else
+		if(pipe(fd) == -1) {
+			return -1;
+		}
+		/* if the pipe fills up it's readable anyway, don't block workers */
+		fcntl(fd[1], F_SETFL, fcntl(fd[1], F_GETFL) | O_NONBLOCK);
+#endif
+		tpool->wait_pipe[0] = fd[0];
+		/* workers check the write end, publish it last */
+		ASTORE(tpool->wait_pipe[1], fd[1]);
 	}
 	return tpool->wait_pipe[0];
 }
@@ -370,11 +699,32 @@ void *ass_tpool_get_wait_handle(struct thread_pool *tpool)
 	return 0;
 }
 
+/* notifications are coalesced: the first of a burst of completions does the
+ * write, and reports every completion counted up to that point. Completions
+ * on other workers while it's doing so, just add to the count.
+ */
 static void send_done_event(struct thread_pool *tpool)
 {
-	if(tpool->wait_pipe[1] >= 0) {
-		write(tpool->wait_pipe[1], tpool, 1);
+	int fd, n;
+#ifdef __linux__
+	uint64_t val;
+#endif
+
+	if((fd = APEEK(tpool->wait_pipe[1])) < 0) {
+		return;
 	}
+	if(AINC(tpool->ev_pending) > 1) {
+		return;
+	}
+	n = AXCHG(tpool->ev_pending, 0);
+
+#ifdef __linux__
+	val = n;
+	write(fd, &val, sizeof val);
+#else
+	(void)n;
+	write(fd, tpool, 1);
+#endif
 }
 #endif	/* WIN32/UNIX */
 
@@ -382,49 +732,258 @@ static void *thread_func(void *args)
 {
 	struct thread_data *tdata = args;
 	struct thread_pool *tpool = tdata->pool;
+	struct tpool_job *job;
 
-	pthread_setspecific(tpool->idkey, (void*)(intptr_t)tdata->id);
+	/* store id + 1, so that threads which never set it read back -1 */
+	pthread_setspecific(tpool->idkey, (void*)(intptr_t)(tdata->id + 1));
 
-	pthread_mutex_lock(&tpool->workq_mutex);
-	while(!tpool->should_quit) {
-		if(!tpool->workq) {
+	while(!ALOAD(tpool->should_quit)) {
+		if((job = get_job(tpool, tdata))) {
+			run_job(tpool, job);
+			continue;
+		}
+
+		/* nothing to do, sleep until someone enqueues more work. nsleeping
+		 * is raised before checking qsize, and enqueue raises qsize before
+		 * checking nsleeping, so one of the two always sees the other.
+		 */
+		pthread_mutex_lock(&tpool->workq_mutex);
+		AINC(tpool->nsleeping);
+		while(!ALOAD(tpool->should_quit) && (!ALOAD(tpool->qsize) || ALOAD(tpool->in_batch))) {
 			pthread_cond_wait(&tpool->workq_condvar, &tpool->workq_mutex);
-			if(tpool->should_quit) break;
-		}
-
-		while(!tpool->should_quit && tpool->workq) {
-			/* grab the first job */
-			struct work_item *job = tpool->workq;
-			tpool->workq = tpool->workq->next;
-			if(!tpool->workq)
-				tpool->workq_tail = 0;
-			++tpool->nactive;
-			--tpool->qsize;
-			pthread_mutex_unlock(&tpool->workq_mutex);
-
-			/* do the job */
-			job->work(job->data);
-			if(job->done) {
-				job->done(job->data);
-			}
-			free_work_item(job);
+		}
+		ADEC(tpool->nsleeping);
+		pthread_mutex_unlock(&tpool->workq_mutex);
+	}
+
+	return 0;
+}
 
-			pthread_mutex_lock(&tpool->workq_mutex);
-			/* notify everyone interested that we're done with this job */
-			pthread_cond_broadcast(&tpool->done_condvar);
-			send_done_event(tpool);
-			--tpool->nactive;
+/* find the next job for a worker. Higher priorities are always drained
+ * first. Within each priority: first from the worker's own queue (newest
+ * first, while its data are still hot in the cache), then from the shared
+ * queue, and finally by stealing the oldest job of another worker.
+ */
+static struct tpool_job *get_job(struct thread_pool *tpool, struct thread_data *self)
+{
+	int i, prio;
+	struct tpool_job *job;
+	struct job_ref ref;
+	struct job_deque *dq;
+	int steal = tpool->flags & ASS_TPOOL_WORKSTEAL;
+
+	for(prio=0; prio<ASS_TPOOL_NUM_PRIO; prio++) {
+		if(steal) {
+			while((ref = deque_pop(self->deque + prio)).job) {
+				if((job = claim_job(tpool, ref))) return job;
+			}
+		}
+		while((ref = ring_pop(tpool->workq + prio)).job) {
+			if((job = claim_job(tpool, ref))) return job;
+		}
+		if(steal) {
+			for(i=1; i<tpool->num_threads; i++) {
+				dq = tpool->tdata[(self->id + i) % tpool->num_threads].deque + prio;
+				while((ref = deque_steal(dq)).job) {
+					if((job = claim_job(tpool, ref))) return job;
+				}
+			}
 		}
 	}
-	pthread_mutex_unlock(&tpool->workq_mutex);
+	return 0;
+}
 
+/* take the job of a queue entry for running it, if the entry isn't stale.
+ * The entry's reference passes to the worker. nactive is raised before qsize
+ * drops, so that the pending count never reaches 0 while a job is changing
+ * hands.
+ */
+static struct tpool_job *claim_job(struct thread_pool *tpool, struct job_ref ref)
+{
+	unsigned int word = ref.word;
+
+	if(ACAS(ref.job->state, word, (ref.word & ~STATE_MASK) | JOB_RUNNING)) {
+		AINC(tpool->nactive);
+		ADEC(tpool->qsize);
+		return ref.job;
+	}
+	ass_tpool_job_release(ref.job);
 	return 0;
 }
 
+/* discard a queue entry, cancelling its job if the entry isn't stale */
+static void drop_entry(struct thread_pool *tpool, struct job_ref ref)
+{
+	unsigned int word = ref.word;
+
+	if(ACAS(ref.job->state, word, (ref.word & ~STATE_MASK) | JOB_CANCELLED)) {
+		ADEC(tpool->qsize);
+		finish_job(tpool, ref.job, JOB_CANCELLED);
+	}
+	ass_tpool_job_release(ref.job);
+}
+
+/* push a queue entry for a job, which was set to the given state word.
+ * If local is set, and it's called from one of our workers in work-stealing
+ * mode, the job goes to the worker's own queue.
+ */
+static void queue_job(struct thread_pool *tpool, struct tpool_job *job, unsigned int word, int local)
+{
+	int tid;
+	int prio = ALOAD(job->prio);	/* ass_tpool_set_prio may change it meanwhile */
+
+	if(!local || !(tpool->flags & ASS_TPOOL_WORKSTEAL) ||
+			(tid = ass_tpool_thread_id(tpool)) < 0 ||
+			deque_push(tpool->tdata[tid].deque + prio, job, word) == -1) {
+
+		if(ring_push(tpool->workq + prio, job, word) == -1) {
+			fprintf(stderr, "ass_tpool: failed to queue job\n");
+			drop_entry(tpool, (struct job_ref){job, word});
+			wake_waiters(tpool);
+			return;
+		}
+	}
+
+	/* wake up a single sleeping worker, if there is one */
+	if(!ALOAD(tpool->in_batch) && ALOAD(tpool->nsleeping)) {
+		pthread_mutex_lock(&tpool->workq_mutex);
+		pthread_cond_signal(&tpool->workq_condvar);
+		pthread_mutex_unlock(&tpool->workq_mutex);
+	}
+}
+
+static void run_job(struct thread_pool *tpool, struct tpool_job *job)
+{
+	job->work(job->data);
+	if(job->done) {
+		job->done(job->data);
+	}
+
+	finish_job(tpool, job, JOB_DONE);
+	ass_tpool_job_release(job);
+	job_done(tpool);
+}
+
+/* mark a job as finished, and release any jobs depending on it */
+static void finish_job(struct thread_pool *tpool, struct tpool_job *job, int state)
+{
+	struct dep_link *list, *link;
+	unsigned int word = ALOAD(job->state);
+
+	ASTORE(job->state, (word & ~STATE_MASK) | state);
+	ASTORE(job->ndeps, 0);
+
+	list = AXCHG(job->dependents, DEPS_CLOSED);
+	while(list) {
+		link = list;
+		list = list->next;
+		release_dependent(tpool, link->job, state != JOB_DONE);
+		free(link);
+	}
+}
+
+/* one of the dependencies of a job has finished. When the last one does, the
+ * job is queued, or dropped if it was cancelled or any dependency failed.
+ */
+static void release_dependent(struct thread_pool *tpool, struct tpool_job *job, int failed)
+{
+	unsigned int word, newword;
+
+	if(failed) {
+		ASTORE(job->dep_failed, 1);
+	}
+	if(ADEC(job->ndeps) > 0) {
+		return;
+	}
+
+	/* count it as queued before it can be seen as such, cancel lowers it */
+	AINC(tpool->qsize);
+	word = ALOAD(job->state);
+	if(JOB_STATE(word) == JOB_WAITING && !ALOAD(job->dep_failed)) {
+		newword = NEXT_TAG(word) | JOB_QUEUED;
+		if(ACAS(job->state, word, newword)) {
+			queue_job(tpool, job, newword, 1);
+			return;
+		}
+	}
+	ADEC(tpool->qsize);
+
+	finish_job(tpool, job, JOB_CANCELLED);
+	ass_tpool_job_release(job);
+	wake_waiters(tpool);
+}
+
+/* notify everyone interested that a job was completed */
+static void job_done(struct thread_pool *tpool)
+{
+	ADEC(tpool->nactive);
+	wake_waiters(tpool);
+	send_done_event(tpool);
+}
+
+static void wake_waiters(struct thread_pool *tpool)
+{
+	if(ALOAD(tpool->nwaiters)) {
+		pthread_mutex_lock(&tpool->workq_mutex);
+		pthread_cond_broadcast(&tpool->done_condvar);
+		pthread_mutex_unlock(&tpool->workq_mutex);
+	}
+}
+
+
+int ass_tpool_set_affinity(struct thread_pool *tpool, const int *cpus, int count)
+{
+#ifdef __linux__
+	int i, res = 0;
+	cpu_set_t set;
+
+	for(i=0; i<tpool->num_threads; i++) {
+		CPU_ZERO(&set);
+		if(count > 0) {
+			CPU_SET(cpus[i % count], &set);
+		} else {
+			/* allow any processor */
+			int j, nproc = ass_tpool_num_processors();
+			for(j=0; j<nproc; j++) {
+				CPU_SET(j, &set);
+			}
+		}
+		if(pthread_setaffinity_np(tpool->threads[i], sizeof set, &set) != 0) {
+			res = -1;
+		}
+	}
+	return res;
+#else
+	return -1;
+#endif
+}
+
+int ass_tpool_set_name(struct thread_pool *tpool, const char *name)
+{
+#ifdef __linux__
+	int i, len, idlen, res = 0;
+	char buf[16], idstr[16];	/* linux limit is 16, including the terminator */
+
+	for(i=0; i<tpool->num_threads; i++) {
+		idlen = sprintf(idstr, "%d", i);
+		if((len = strlen(name)) > 15 - idlen) {
+			len = 15 - idlen;
+		}
+		memcpy(buf, name, len);
+		memcpy(buf + len, idstr, idlen + 1);
+		if(pthread_setname_np(tpool->threads[i], buf) != 0) {
+			res = -1;
+		}
+	}
+	return res;
+#else
+	return -1;
+#endif
+}
 
 int ass_tpool_thread_id(struct thread_pool *tpool)
 {
-	int id = (intptr_t)pthread_getspecific(tpool->idkey);
+	int id = (intptr_t)pthread_getspecific(tpool->idkey) - 1;
 	if(id >= tpool->num_threads) {
 		return -1;
 	}
@@ -464,38 +1023,311 @@ int ass_tpool_num_processors(void)
 #endif
 }
 
-#define MAX_WPOOL_SIZE	64
+static void init_ring(struct job_ring *q)
+{
+	unsigned int i;
+
+	q->head = q->tail = 0;
+	for(i=0; i<RING_SIZE; i++) {
+		q->cell[i].seq = i;
+	}
+	q->ovf = q->ovf_tail = 0;
+	pthread_mutex_init(&q->ovf_lock, 0);
+}
+
+static int ring_push(struct job_ring *q, struct tpool_job *job, unsigned int word)
+{
+	struct ring_cell *c;
+	struct ovf_node *node;
+	unsigned int pos, seq;
+	int dif;
+
+	/* once spilled over, keep using the overflow list until it drains */
+	if(!APEEK(q->ovf)) {
+		pos = APEEK(q->tail);
+		for(;;) {
+			c = q->cell + (pos & (RING_SIZE - 1));
+			seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+			dif = (int)(seq - pos);
+			if(dif == 0) {
+				if(__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+					APOKE(c->job, job);
+					APOKE(c->word, word);
+					__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+					return 0;
+				}
+			} else if(dif < 0) {
+				break;	/* full */
+			} else {
+				pos = APEEK(q->tail);
+			}
+		}
+	}
+
+	if(!(node = malloc(sizeof *node))) {
+		return -1;
+	}
+	node->ref.job = job;
+	node->ref.word = word;
+	node->next = 0;
+
+	pthread_mutex_lock(&q->ovf_lock);
+	if(q->ovf) {
+		q->ovf_tail->next = node;
+	} else {
+		APOKE(q->ovf, node);
+	}
+	q->ovf_tail = node;
+	pthread_mutex_unlock(&q->ovf_lock);
+	return 0;
+}
+
+static struct job_ref ring_pop(struct job_ring *q)
+{
+	struct job_ref ref = {0, 0};
+	struct ring_cell *c;
+	struct ovf_node *node;
+	unsigned int pos, seq;
+	int dif;
+
+	pos = APEEK(q->head);
+	for(;;) {
+		c = q->cell + (pos & (RING_SIZE - 1));
+		seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		dif = (int)(seq - (pos + 1));
+		if(dif == 0) {
+			if(__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				ref.job = APEEK(c->job);
+				ref.word = APEEK(c->word);
+				__atomic_store_n(&c->seq, pos + RING_SIZE, __ATOMIC_RELEASE);
+				return ref;
+			}
+		} else if(dif < 0) {
+			break;	/* empty */
+		} else {
+			pos = APEEK(q->head);
+		}
+	}
+
+	if(APEEK(q->ovf)) {
+		pthread_mutex_lock(&q->ovf_lock);
+		if((node = q->ovf)) {
+			APOKE(q->ovf, node->next);
+			if(!node->next) {
+				q->ovf_tail = 0;
+			}
+		}
+		pthread_mutex_unlock(&q->ovf_lock);
+
+		if(node) {
+			ref = node->ref;
+			free(node);
+		}
+	}
+	return ref;
+}
+
+/* called only by the owner of the deque */
+static int deque_push(struct job_deque *dq, struct tpool_job *job, unsigned int word)
+{
+	struct job_ref *c;
+	long b = APEEK(dq->bottom);
+	long t = ALOAD(dq->top);
+
+	if(b - t >= DEQUE_SIZE) {
+		return -1;
+	}
+	c = dq->cell + (b & (DEQUE_SIZE - 1));
+	APOKE(c->job, job);
+	APOKE(c->word, word);
+	ASTORE(dq->bottom, b + 1);
+	return 0;
+}
+
+/* called only by the owner of the deque */
+static struct job_ref deque_pop(struct job_deque *dq)
+{
+	struct job_ref ref = {0, 0};
+	struct job_ref *c;
+	long t, b;
+
+	b = APEEK(dq->bottom);
+	if(b <= APEEK(dq->top)) {
+		return ref;
+	}
+
+	ASTORE(dq->bottom, --b);
+	t = ALOAD(dq->top);
+	if(t > b) {
+		/* a thief got the last one */
+		ASTORE(dq->bottom, b + 1);
+		return ref;
+	}
+
+	c = dq->cell + (b & (DEQUE_SIZE - 1));
+	ref.job = APEEK(c->job);
+	ref.word = APEEK(c->word);
+	if(t == b) {
+		/* last one, race against thieves for it */
+		if(!ACAS(dq->top, t, t + 1)) {
+			ref.job = 0;
+		}
+		ASTORE(dq->bottom, b + 1);
+	}
+	return ref;
+}
+
+static struct job_ref deque_steal(struct job_deque *dq)
+{
+	struct job_ref ref = {0, 0};
+	struct job_ref *c;
+	long t = ALOAD(dq->top);
+	long b = ALOAD(dq->bottom);
+
+	if(t < b) {
+		c = dq->cell + (t & (DEQUE_SIZE - 1));
+		ref.job = APEEK(c->job);
+		ref.word = APEEK(c->word);
+		if(!ACAS(dq->top, t, t + 1)) {
+			ref.job = 0;	/* lost the race, the caller may retry */
+		}
+	}
+	return ref;
+}
+
+/* work item allocator. Each thread keeps a cache of free items, and hands
+ * them over to a shared pool in batches when it grows too large. Workers free
+ * items which were allocated by the submitting threads, so it's the batches
+ * which move between threads, not individual items.
+ */
+#define CACHE_BATCH		32
+#define MAX_WPOOL_SIZE	256
+
+struct item_cache {
+	struct tpool_job *list;
+	int count;
+};
+
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
 static pthread_mutex_t wpool_lock = PTHREAD_MUTEX_INITIALIZER;
-static struct work_item *wpool;
+static struct tpool_job *wpool;
 static int wpool_size;
 
-/* work item allocator */
-static struct work_item *alloc_work_item(void)
+static void put_batch(struct tpool_job *head, struct tpool_job *tail, int count)
 {
-	struct work_item *w;
+	struct tpool_job *w;
 
 	pthread_mutex_lock(&wpool_lock);
-	if(!wpool) {
+	if(wpool_size < MAX_WPOOL_SIZE) {
+		tail->next = wpool;
+		wpool = head;
+		APOKE(wpool_size, wpool_size + count);	/* peeked at without the lock */
+		head = 0;
+	}
+	pthread_mutex_unlock(&wpool_lock);
+
+	while(head) {
+		w = head;
+		head = head->next;
+		free(w);
+	}
+}
+
+static void destroy_cache(void *cls)
+{
+	struct item_cache *cache = cls;
+	struct tpool_job *tail;
+
+	if(cache->list) {
+		tail = cache->list;
+		while(tail->next) tail = tail->next;
+		put_batch(cache->list, tail, cache->count);
+	}
+	free(cache);
+}
+
+static void init_cache_key(void)
+{
+	pthread_key_create(&cache_key, destroy_cache);
+}
+
+static struct item_cache *get_cache(void)
+{
+	struct item_cache *cache;
+
+	pthread_once(&cache_once, init_cache_key);
+	if(!(cache = pthread_getspecific(cache_key))) {
+		if((cache = calloc(1, sizeof *cache))) {
+			pthread_setspecific(cache_key, cache);
+		}
+	}
+	return cache;
+}
+
+static struct tpool_job *alloc_work_item(void)
+{
+	struct item_cache *cache;
+	struct tpool_job *w;
+	int i;
+
+	if(!(cache = get_cache())) {
+		return malloc(sizeof(struct tpool_job));
+	}
+
+	if(!cache->list && APEEK(wpool_size) > 0) {
+		/* grab a batch from the shared pool */
+		pthread_mutex_lock(&wpool_lock);
+		if((w = wpool)) {
+			for(i=1; i<CACHE_BATCH && w->next; i++) {
+				w = w->next;
+			}
+			cache->list = wpool;
+			cache->count = i;
+			wpool = w->next;
+			w->next = 0;
+			APOKE(wpool_size, wpool_size - i);
+		}
 		pthread_mutex_unlock(&wpool_lock);
-		return malloc(sizeof(struct work_item));
 	}
 
-	w = wpool;
-	wpool = wpool->next;
-	--wpool_size;
-	pthread_mutex_unlock(&wpool_lock);
+	if(!(w = cache->list)) {
+		return malloc(sizeof(struct tpool_job));
+	}
+	cache->list = w->next;
+	cache->count--;
 	return w;
 }
 
-static void free_work_item(struct work_item *w)
+static void free_work_item(struct tpool_job *w)
 {
-	pthread_mutex_lock(&wpool_lock);
-	if(wpool_size >= MAX_WPOOL_SIZE) {
+	struct item_cache *cache;
+	struct tpool_job *head, *tail;
+	int i;
+
+	if(!(cache = get_cache())) {
 		free(w);
-	} else {
-		w->next = wpool;
-		wpool = w;
-		++wpool_size;
+		return;
+	}
+
+	w->next = cache->list;
+	cache->list = w;
+	if(++cache->count >= CACHE_BATCH * 2) {
+		/* hand the older half over to the shared pool */
+		tail = cache->list;
+		for(i=1; i<CACHE_BATCH; i++) {
+			tail = tail->next;
+		}
+		head = tail->next;
+		tail->next = 0;
+		cache->count = CACHE_BATCH;
+
+		for(tail=head, i=1; tail->next; i++) {
+			tail = tail->next;
+		}
+		put_batch(head, tail, i);
 	}
-	pthread_mutex_unlock(&wpool_lock);
 }
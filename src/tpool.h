@@ -19,22 +19,50 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define ASSFILE_THREADPOOL_H_
 
 struct thread_pool;
+struct tpool_job;
 
 /* type of the function accepted as work or completion callback */
 typedef void (*tpool_callback)(void*);
 
+/* flags for ass_tpool_create_flags */
+enum {
+	/* each worker gets its own queue. Jobs enqueued by a worker thread go to
+	 * its own queue, and idle workers steal jobs from the others. Jobs
+	 * enqueued by other threads go to the shared queue as usual.
+	 */
+	ASS_TPOOL_WORKSTEAL	= 1
+};
+
+/* job priorities. Queued jobs of a higher priority are always started before
+ * any job of a lower priority. Running jobs are never interrupted.
+ */
+enum {
+	ASS_TPOOL_PRIO_HIGH,		/* latency-critical, e.g. blocking opens */
+	ASS_TPOOL_PRIO_NORMAL,		/* default for ass_tpool_enqueue */
+	ASS_TPOOL_PRIO_LOW,			/* background work, e.g. prefetching */
+	ASS_TPOOL_PRIO_IDLE,		/* maintenance, runs when nothing else is queued */
+
+	ASS_TPOOL_NUM_PRIO
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /* if num_threads == 0, auto-detect how many threads to spawn */
 struct thread_pool *ass_tpool_create(int num_threads);
+struct thread_pool *ass_tpool_create_flags(int num_threads, unsigned int flags);
 void ass_tpool_destroy(struct thread_pool *tpool);
 
-/* optional reference counting interface for thread pool sharing */
+/* optional reference counting interface for thread pool sharing. The pool
+ * starts with a single reference, held by whoever created it.
+ */
 int ass_tpool_addref(struct thread_pool *tpool);
 int ass_tpool_release(struct thread_pool *tpool);	/* will ass_tpool_destroy on nref 0 */
 
+/* returns the number of worker threads */
+int ass_tpool_num_threads(struct thread_pool *tpool);
+
 /* if begin_batch is called before an enqueue, the worker threads will not be
  * signalled to start working until end_batch is called.
  */
@@ -46,9 +74,47 @@ void ass_tpool_end_batch(struct thread_pool *tpool);
  */
 int ass_tpool_enqueue(struct thread_pool *tpool, void *data,
 		tpool_callback work_func, tpool_callback done_func);
+/* same as ass_tpool_enqueue, with one of the ASS_TPOOL_PRIO_* priorities */
+int ass_tpool_enqueue_prio(struct thread_pool *tpool, void *data,
+		tpool_callback work_func, tpool_callback done_func, int prio);
 /* clear the work queue. does not cancel any currently running jobs */
 void ass_tpool_clear(struct thread_pool *tpool);
 
+/* same as ass_tpool_enqueue_prio, but returns a handle to the job, or null on
+ * failure. The handle stays valid until it's passed to ass_tpool_job_release,
+ * regardless of whether the job has finished.
+ */
+struct tpool_job *ass_tpool_submit(struct thread_pool *tpool, void *data,
+		tpool_callback work_func, tpool_callback done_func, int prio);
+void ass_tpool_job_release(struct tpool_job *job);
+
+/* same as ass_tpool_submit, but the job is held back until all the jobs in
+ * the deps array have finished, which makes it possible to chain jobs into
+ * dependency graphs. If any of the dependencies is cancelled, so is the new
+ * job. Null entries in deps are ignored.
+ */
+struct tpool_job *ass_tpool_submit_after(struct thread_pool *tpool, void *data,
+		tpool_callback work_func, tpool_callback done_func, int prio,
+		struct tpool_job **deps, int num_deps);
+
+/* returns non-zero if the job has finished, or has been cancelled */
+int ass_tpool_job_done(struct tpool_job *job);
+/* wait until the job finishes. Returns 0 if it ran to completion, or -1 if it
+ * was cancelled. When called from a worker thread, the caller runs other
+ * queued jobs while waiting.
+ */
+int ass_tpool_job_wait(struct tpool_job *job);
+
+/* remove a job from the queue, before it starts. Neither the work nor the done
+ * callback will be called, and any jobs depending on it are cancelled too.
+ * Returns 0 on success, or -1 if the job is already running or finished.
+ */
+int ass_tpool_cancel(struct thread_pool *tpool, struct tpool_job *job);
+/* change the priority of a queued job. Returns -1 if the job has already
+ * started.
+ */
+int ass_tpool_set_prio(struct thread_pool *tpool, struct tpool_job *job, int prio);
+
 /* returns the number of queued work items */
 int ass_tpool_queued_jobs(struct thread_pool *tpool);
 /* returns the number of active (working) threads */
@@ -67,8 +133,12 @@ void ass_tpool_wait_pending(struct thread_pool *tpool, int pending_target);
 long ass_tpool_timedwait(struct thread_pool *tpool, long timeout);
 
 /* return a file descriptor which can be used to wait for pending job
- * completion events. A single char is written every time a job completes.
- * You should empty the pipe every time you receive such an event.
+ * completion events. It becomes readable after jobs complete; completions
+ * happening close together may be reported together. On Linux it's an
+ * eventfd, and reading 8 bytes from it returns the number of completions
+ * since the last read. Elsewhere it's a pipe, with a single char written per
+ * notification. Either way, you should empty it every time you receive such
+ * an event.
  *
  * This is a UNIX-specific call. On windows it does nothing.
  */
@@ -81,6 +151,17 @@ int ass_tpool_get_wait_fd(struct thread_pool *tpool);
  */
 void *ass_tpool_get_wait_handle(struct thread_pool *tpool);
 
+/* pin the worker threads to the given processors. Worker i is restricted to
+ * cpus[i % count]. Pass count 0 to let them run anywhere again.
+ * Returns 0 on success, -1 on failure or if unsupported (non-linux).
+ */
+int ass_tpool_set_affinity(struct thread_pool *tpool, const int *cpus, int count);
+/* name the worker threads "<name><thread id>", for debuggers and tools like
+ * top. The name is truncated to fit the 15 character limit.
+ * Returns 0 on success, -1 on failure or if unsupported (non-linux).
+ */
+int ass_tpool_set_name(struct thread_pool *tpool, const char *name);
+
 /* When called by a work/done callback, it returns the thread number executing
  * it. From the main thread it returns -1.
  */
@@ -0,0 +1,628 @@
+/*
+assfile - library for accessing assets with an fopen/fread-like interface
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "zfile.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+
+#define ZF_BUFSZ	32768
+/* window bits for inflateInit2: maximum window, detect gzip or zlib header */
+#define ZF_WBITS	(15 + 32)
+#define ZF_WSIZE	32768
+
+#define ZF_INDEX_MAGIC	"ASSZIDX\n"
+
+/* random access point: a deflate block boundary, and the window of output
+ * preceding it, which is all the state needed to start decompressing there.
+ */
+struct zf_point {
+	long out;				/* offset in the uncompressed data */
+	long in;				/* offset of the next compressed byte, from the stream start */
+	int bits;				/* unused bits in the byte before "in", or 0 */
+	int wsize;				/* size of the compressed window */
+	unsigned char *window;	/* the last 32k of output before the point, deflated */
+};
+
+struct zf_index {
+	long span;
+	struct zf_point *pts;
+	int num_pts, max_pts;
+};
+
+struct zfile {
+	FILE *fp;
+	long start;				/* file offset of the compressed stream */
+	long in_pos;			/* file offset of the next compressed byte to read */
+	long pos;				/* current offset in the uncompressed data */
+	long size;				/* uncompressed size, -1 until we reach the end */
+	int eof;
+	int wbits;				/* inflateInit2 window bits, negative for raw deflate streams */
+	int raw;				/* inflating headerless deflate data, after resuming at a point */
+	struct zf_index *idx;	/* random access points used for seeking, or 0 */
+	int own_idx, build_idx;
+	z_stream zs;
+	unsigned char inbuf[ZF_BUFSZ];
+};
+
+static struct zfile *open_stream(FILE *fp, long start, int wbits);
+static int restart(struct zfile *zf);
+static int resume(struct zfile *zf, struct zf_point *pt);
+static int fill_input(struct zfile *zf);
+static int add_point(struct zfile *zf, long out);
+static struct zf_point *find_point(struct zf_index *idx, long offs);
+
+struct zfile *zf_open(FILE *fp, long start)
+{
+	return open_stream(fp, start, ZF_WBITS);
+}
+
+struct zfile *zf_open_raw(FILE *fp, long start)
+{
+	return open_stream(fp, start, -15);
+}
+
+static struct zfile *open_stream(FILE *fp, long start, int wbits)
+{
+	struct zfile *zf;
+
+	if(!(zf = calloc(1, sizeof *zf))) {
+		perror("assfile: failed to allocate compressed file reader");
+		return 0;
+	}
+	if(inflateInit2(&zf->zs, wbits) != Z_OK) {
+		fprintf(stderr, "assfile: failed to initialize zlib: %s\n", zf->zs.msg ? zf->zs.msg : "?");
+		free(zf);
+		return 0;
+	}
+	zf->fp = fp;
+	zf->start = zf->in_pos = start;
+	zf->size = -1;
+	zf->wbits = wbits;
+	return zf;
+}
+
+void zf_close(struct zfile *zf)
+{
+	if(zf) {
+		if(zf->own_idx) {
+			zf_free_index(zf->idx);
+		}
+		inflateEnd(&zf->zs);
+		free(zf);
+	}
+}
+
+static int restart(struct zfile *zf)
+{
+	if(inflateReset2(&zf->zs, zf->wbits) != Z_OK) {
+		return -1;
+	}
+	zf->zs.avail_in = 0;
+	zf->in_pos = zf->start;
+	zf->pos = 0;
+	zf->eof = 0;
+	zf->raw = 0;
+	return 0;
+}
+
+static int resume(struct zfile *zf, struct zf_point *pt)
+{
+	unsigned char win[ZF_WSIZE];
+	uLongf wlen = ZF_WSIZE;
+	int c;
+
+	if(inflateReset2(&zf->zs, -15) != Z_OK) {
+		return -1;
+	}
+	zf->zs.avail_in = 0;
+	zf->in_pos = zf->start + pt->in;
+	if(pt->bits) {
+		/* the point is in the middle of a byte, feed its remaining bits */
+		if(fseek(zf->fp, zf->in_pos - 1, SEEK_SET) == -1 || (c = fgetc(zf->fp)) == -1) {
+			return -1;
+		}
+		inflatePrime(&zf->zs, pt->bits, c >> (8 - pt->bits));
+	}
+	if(uncompress(win, &wlen, pt->window, pt->wsize) != Z_OK ||
+			inflateSetDictionary(&zf->zs, win, wlen) != Z_OK) {
+		fprintf(stderr, "assfile: corrupted compressed stream index\n");
+		return -1;
+	}
+	zf->pos = pt->out;
+	zf->eof = 0;
+	zf->raw = 1;
+	return 0;
+}
+
+/* returns 1 if there's more input, 0 at the end of the file, -1 on error */
+static int fill_input(struct zfile *zf)
+{
+	size_t rd;
+
+	/* the file might be shared with others, don't assume it's still where we
+	 * left it
+	 */
+	if(fseek(zf->fp, zf->in_pos, SEEK_SET) == -1) {
+		return -1;
+	}
+	if(!(rd = fread(zf->inbuf, 1, ZF_BUFSZ, zf->fp))) {
+		return ferror(zf->fp) ? -1 : 0;
+	}
+	zf->in_pos += rd;
+	zf->zs.next_in = zf->inbuf;
+	zf->zs.avail_in = rd;
+	return 1;
+}
+
+long zf_read(struct zfile *zf, void *buf, long size)
+{
+	int res, skip;
+
+	if(size <= 0 || zf->eof) return 0;
+
+	zf->zs.next_out = buf;
+	zf->zs.avail_out = size;
+
+	while(zf->zs.avail_out > 0) {
+		if(!zf->zs.avail_in) {
+			if((res = fill_input(zf)) == -1) {
+				return -1;
+			}
+			if(!res) {
+				/* truncated stream, return whatever we've got */
+				zf->eof = 1;
+				break;
+			}
+		}
+
+		/* while building an index, stop at every block boundary to see if
+		 * it's time for a new access point
+		 */
+		res = inflate(&zf->zs, zf->build_idx ? Z_BLOCK : Z_NO_FLUSH);
+		if(res == Z_STREAM_END) {
+			if(zf->wbits < 0) {
+				zf->eof = 1;	/* raw deflate, nothing follows */
+				break;
+			}
+			if(zf->raw) {
+				/* resumed at an access point, skip the gzip trailer */
+				skip = 8;
+				while(skip > 0) {
+					if(!zf->zs.avail_in && fill_input(zf) <= 0) {
+						break;
+					}
+					res = zf->zs.avail_in < skip ? zf->zs.avail_in : skip;
+					zf->zs.next_in += res;
+					zf->zs.avail_in -= res;
+					skip -= res;
+				}
+				zf->raw = 0;
+			}
+			/* gzip files can be made of multiple concatenated members */
+			if(inflateReset2(&zf->zs, ZF_WBITS) != Z_OK) {
+				return -1;
+			}
+			if(!zf->zs.avail_in && fill_input(zf) <= 0) {
+				zf->eof = 1;
+				break;
+			}
+		} else if(res != Z_OK && res != Z_BUF_ERROR) {
+			fprintf(stderr, "assfile: corrupted compressed data: %s\n", zf->zs.msg ? zf->zs.msg : "?");
+			return -1;
+		}
+
+		/* bit 7 of data_type: at the end of a block, bit 6: it was the last */
+		if(zf->build_idx && (zf->zs.data_type & 0xc0) == 0x80) {
+			if(add_point(zf, zf->pos + size - zf->zs.avail_out) == -1) {
+				return -1;
+			}
+		}
+	}
+
+	size -= zf->zs.avail_out;
+	zf->pos += size;
+	if(zf->eof) {
+		zf->size = zf->pos;
+	}
+	return size;
+}
+
+long zf_seek(struct zfile *zf, long offs, int whence)
+{
+	char buf[16384];
+	long target, rd;
+	struct zf_point *pt;
+
+	switch(whence) {
+	case SEEK_SET:
+		target = offs;
+		break;
+	case SEEK_CUR:
+		target = zf->pos + offs;
+		break;
+	case SEEK_END:
+		if(zf->size < 0) {
+			/* no way to know without decompressing everything */
+			while((rd = zf_read(zf, buf, sizeof buf)) > 0);
+			if(rd == -1) return -1;
+		}
+		target = zf->size + offs;
+		break;
+	default:
+		return -1;
+	}
+	if(target < 0) return -1;
+
+	if(zf->idx && (pt = find_point(zf->idx, target)) && (target < zf->pos || pt->out > zf->pos)) {
+		/* start from the closest access point, if it saves work */
+		if(resume(zf, pt) == -1) {
+			return -1;
+		}
+	} else if(target < zf->pos && restart(zf) == -1) {
+		return -1;
+	}
+	while(zf->pos < target && !zf->eof) {
+		rd = target - zf->pos;
+		if((rd = zf_read(zf, buf, rd < sizeof buf ? rd : sizeof buf)) == -1) {
+			return -1;
+		}
+	}
+	/* like fseek, allow seeking past the end */
+	zf->pos = target;
+	return target;
+}
+
+int zf_build_index(struct zfile *zf, long span)
+{
+	if(zf->pos > 0) {
+		fprintf(stderr, "assfile: zf_build_index must be called before reading\n");
+		return -1;
+	}
+	if(!(zf->idx = calloc(1, sizeof *zf->idx))) {
+		perror("assfile: failed to allocate compressed stream index");
+		return -1;
+	}
+	zf->idx->span = span;
+	zf->own_idx = 1;
+	zf->build_idx = 1;
+	return 0;
+}
+
+struct zf_index *zf_take_index(struct zfile *zf)
+{
+	struct zf_index *idx = zf->idx;
+
+	if(!zf->own_idx) return 0;
+	zf->own_idx = zf->build_idx = 0;
+	return idx;
+}
+
+void zf_use_index(struct zfile *zf, struct zf_index *idx)
+{
+	if(zf->own_idx) {
+		zf_free_index(zf->idx);
+	}
+	zf->idx = idx;
+	zf->own_idx = zf->build_idx = 0;
+}
+
+void zf_free_index(struct zf_index *idx)
+{
+	int i;
+
+	if(!idx) return;
+
+	for(i=0; i<idx->num_pts; i++) {
+		free(idx->pts[i].window);
+	}
+	free(idx->pts);
+	free(idx);
+}
+
+int zf_index_points(struct zf_index *idx)
+{
+	return idx->num_pts;
+}
+
+long zf_index_comp_offset(struct zf_index *idx, long out)
+{
+	int i;
+
+	/* the first point at or after out marks where the data up to out ends */
+	for(i=0; i<idx->num_pts; i++) {
+		if(idx->pts[i].out >= out) {
+			return idx->pts[i].in;
+		}
+	}
+	return -1;
+}
+
+static int add_point(struct zfile *zf, long out)
+{
+	struct zf_index *idx = zf->idx;
+	struct zf_point *pt;
+	unsigned char win[ZF_WSIZE];
+	uInt wlen = ZF_WSIZE;
+	uLongf zlen;
+	void *tmp;
+	long last = idx->num_pts ? idx->pts[idx->num_pts - 1].out : 0;
+
+	/* a point at the very start would be no better than restarting */
+	if(out - last < idx->span) {
+		return 0;
+	}
+
+	if(idx->num_pts >= idx->max_pts) {
+		int newsz = idx->max_pts ? idx->max_pts * 2 : 16;
+		if(!(tmp = realloc(idx->pts, newsz * sizeof *idx->pts))) {
+			perror("assfile: failed to grow compressed stream index");
+			return -1;
+		}
+		idx->pts = tmp;
+		idx->max_pts = newsz;
+	}
+	pt = idx->pts + idx->num_pts;
+
+	if(inflateGetDictionary(&zf->zs, win, &wlen) != Z_OK) {
+		return -1;
+	}
+	/* windows compress well, and there's one per span */
+	zlen = compressBound(wlen);
+	if(!(pt->window = malloc(zlen))) {
+		perror("assfile: failed to allocate compressed stream index window");
+		return -1;
+	}
+	if(compress2(pt->window, &zlen, win, wlen, Z_BEST_SPEED) != Z_OK) {
+		free(pt->window);
+		return -1;
+	}
+	if((tmp = realloc(pt->window, zlen))) {
+		pt->window = tmp;
+	}
+	pt->wsize = zlen;
+	pt->out = out;
+	pt->in = zf->in_pos - zf->zs.avail_in - zf->start;
+	pt->bits = zf->zs.data_type & 7;
+	idx->num_pts++;
+	return 0;
+}
+
+static struct zf_point *find_point(struct zf_index *idx, long offs)
+{
+	int mid, lo = 0, hi = idx->num_pts;
+
+	/* last point at or before offs */
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(idx->pts[mid].out <= offs) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo > 0 ? idx->pts + lo - 1 : 0;
+}
+
+/* serialized index: magic, span and point count, then for each point its
+ * out and in offsets, bits, window size and window, in host byte order
+ */
+int zf_write_index(struct zf_index *idx, FILE *fp)
+{
+	int i;
+	uint64_t val64[2];
+	uint32_t val32[2];
+	struct zf_point *pt;
+
+	val64[0] = idx->span;
+	val32[0] = idx->num_pts;
+	if(fwrite(ZF_INDEX_MAGIC, 1, 8, fp) < 8 || fwrite(val64, 8, 1, fp) < 1 ||
+			fwrite(val32, 4, 1, fp) < 1) {
+		return -1;
+	}
+	for(i=0; i<idx->num_pts; i++) {
+		pt = idx->pts + i;
+		val64[0] = pt->out;
+		val64[1] = pt->in;
+		val32[0] = pt->bits;
+		val32[1] = pt->wsize;
+		if(fwrite(val64, 8, 2, fp) < 2 || fwrite(val32, 4, 2, fp) < 2 ||
+				fwrite(pt->window, 1, pt->wsize, fp) < pt->wsize) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+struct zf_index *zf_read_index(FILE *fp)
+{
+	char magic[8];
+	uint64_t val64[2];
+	uint32_t val32[2];
+	struct zf_index *idx;
+	struct zf_point *pt;
+
+	if(fread(magic, 1, 8, fp) < 8 || memcmp(magic, ZF_INDEX_MAGIC, 8) != 0 ||
+			fread(val64, 8, 1, fp) < 1 || fread(val32, 4, 1, fp) < 1) {
+		return 0;
+	}
+	if(!(idx = calloc(1, sizeof *idx))) {
+		return 0;
+	}
+	idx->span = val64[0];
+	if(val32[0] && !(idx->pts = malloc(val32[0] * sizeof *idx->pts))) {
+		goto err;
+	}
+	idx->max_pts = val32[0];
+
+	while(idx->num_pts < idx->max_pts) {
+		pt = idx->pts + idx->num_pts;
+		if(fread(val64, 8, 2, fp) < 2 || fread(val32, 4, 2, fp) < 2) {
+			goto err;
+		}
+		if(val32[0] > 7 || val32[1] > compressBound(ZF_WSIZE) ||
+				(idx->num_pts && val64[0] <= pt[-1].out)) {
+			goto err;
+		}
+		pt->out = val64[0];
+		pt->in = val64[1];
+		pt->bits = val32[0];
+		pt->wsize = val32[1];
+		if(!(pt->window = malloc(pt->wsize)) || fread(pt->window, 1, pt->wsize, fp) < pt->wsize) {
+			free(pt->window);
+			goto err;
+		}
+		idx->num_pts++;
+	}
+	return idx;
+
+err:
+	zf_free_index(idx);
+	return 0;
+}
+
+int zf_inflate_mem(const void *src, long size, char **res, long *res_size)
+{
+	z_stream zs;
+	char *buf, *tmp;
+	long max, len = 0;
+	int zres;
+
+	max = size < 256 ? 1024 : size * 4;
+	if(!(buf = malloc(max))) {
+		return -1;
+	}
+
+	memset(&zs, 0, sizeof zs);
+	if(inflateInit2(&zs, ZF_WBITS) != Z_OK) {
+		free(buf);
+		return -1;
+	}
+	zs.next_in = (unsigned char*)src;
+	zs.avail_in = size;
+
+	for(;;) {
+		if(len >= max) {
+			max *= 2;
+			if(!(tmp = realloc(buf, max))) {
+				goto err;
+			}
+			buf = tmp;
+		}
+		zs.next_out = (unsigned char*)buf + len;
+		zs.avail_out = max - len;
+
+		zres = inflate(&zs, Z_NO_FLUSH);
+		len = max - zs.avail_out;
+
+		if(zres == Z_STREAM_END) {
+			if(!zs.avail_in) break;
+			if(inflateReset(&zs) != Z_OK) goto err;	/* next gzip member */
+		} else if(zres == Z_BUF_ERROR && zs.avail_out) {
+			break;	/* truncated, keep what we've got */
+		} else if(zres != Z_OK && zres != Z_BUF_ERROR) {
+			fprintf(stderr, "assfile: corrupted compressed data: %s\n", zs.msg ? zs.msg : "?");
+			goto err;
+		}
+	}
+	inflateEnd(&zs);
+
+	*res = buf;
+	*res_size = len;
+	return 0;
+
+err:
+	inflateEnd(&zs);
+	free(buf);
+	return -1;
+}
+
+#else	/* no zlib */
+
+struct zfile *zf_open(FILE *fp, long start)
+{
+	fprintf(stderr, "assfile: compiled without zlib, can't read compressed data\n");
+	return 0;
+}
+
+struct zfile *zf_open_raw(FILE *fp, long start)
+{
+	return zf_open(fp, start);
+}
+
+void zf_close(struct zfile *zf)
+{
+}
+
+long zf_read(struct zfile *zf, void *buf, long size)
+{
+	return -1;
+}
+
+long zf_seek(struct zfile *zf, long offs, int whence)
+{
+	return -1;
+}
+
+int zf_build_index(struct zfile *zf, long span)
+{
+	return -1;
+}
+
+struct zf_index *zf_take_index(struct zfile *zf)
+{
+	return 0;
+}
+
+void zf_use_index(struct zfile *zf, struct zf_index *idx)
+{
+}
+
+void zf_free_index(struct zf_index *idx)
+{
+}
+
+int zf_index_points(struct zf_index *idx)
+{
+	return 0;
+}
+
+long zf_index_comp_offset(struct zf_index *idx, long out)
+{
+	return -1;
+}
+
+int zf_write_index(struct zf_index *idx, FILE *fp)
+{
+	return -1;
+}
+
+struct zf_index *zf_read_index(FILE *fp)
+{
+	return 0;
+}
+
+int zf_inflate_mem(const void *src, long size, char **res, long *res_size)
+{
+	fprintf(stderr, "assfile: compiled without zlib, can't decompress data\n");
+	return -1;
+}
+#endif	/* HAVE_ZLIB */
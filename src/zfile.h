@@ -0,0 +1,72 @@
+/*
+assfile - library for accessing assets with an fopen/fread-like interface
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef ZFILE_H_
+#define ZFILE_H_
+
+#include <stdio.h>
+
+/* Reading a gzip or zlib stream stored in a file, as if it was uncompressed.
+ * Reads decompress sequentially; seeking forward decompresses and discards
+ * everything up to the target, and seeking backwards starts over from the
+ * beginning of the stream. Without zlib (HAVE_ZLIB undefined), zf_open and
+ * zf_inflate_mem always fail.
+ */
+struct zfile;
+
+/* starts reading a compressed stream at offset start in fp. The file isn't
+ * closed by zf_close, and its file position shouldn't be relied upon while
+ * it's being read through the zfile.
+ */
+struct zfile *zf_open(FILE *fp, long start);
+/* same for a raw deflate stream, without header or trailer, as in zip files */
+struct zfile *zf_open_raw(FILE *fp, long start);
+void zf_close(struct zfile *zf);
+
+long zf_read(struct zfile *zf, void *buf, long size);
+long zf_seek(struct zfile *zf, long offs, int whence);
+
+/* Random access index: points where decompression can start without
+ * decompressing everything before them, roughly every span bytes of
+ * uncompressed data. Seeking through a zfile with an index starts from the
+ * closest point before the target, instead of the start of the stream.
+ */
+struct zf_index;
+
+/* records access points while the stream is read sequentially through zf,
+ * from the start. The index belongs to zf until taken with zf_take_index.
+ */
+int zf_build_index(struct zfile *zf, long span);
+struct zf_index *zf_take_index(struct zfile *zf);
+/* uses an existing index for seeking; it isn't freed by zf_close */
+void zf_use_index(struct zfile *zf, struct zf_index *idx);
+void zf_free_index(struct zf_index *idx);
+int zf_index_points(struct zf_index *idx);
+/* offset in the compressed stream up to which the data must be read, to
+ * decompress everything before offset out, or -1 if it's past the last point
+ */
+long zf_index_comp_offset(struct zf_index *idx, long out);
+
+int zf_write_index(struct zf_index *idx, FILE *fp);
+struct zf_index *zf_read_index(FILE *fp);
+
+/* decompresses a whole stream in memory. On success *res points to a new
+ * buffer allocated with malloc, and the function returns 0.
+ */
+int zf_inflate_mem(const void *src, long size, char **res, long *res_size);
+
+#endif	/* ZFILE_H_ */